@@ -1,14 +1,15 @@
 #include "chip8.h"
+#include "jit.h"
+#include "log.h"
+#include "profile.h"
 
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include <SDL2/SDL.h>
-
 void print_instruction(instruction i) {
-  fprintf(stderr, "opcode: %d hi: %2x lo: %2x\n", i.opcode, i.hi, i.lo);
+  LOG_DEBUG("opcode: %d hi: %2x lo: %2x", i.opcode, i.hi, i.lo);
 }
 
 uint8_t N(instruction i) { return i.lo & 0x0F; }
@@ -57,24 +58,28 @@ void load_hex_fonts(chip8 *system) {
   memcpy(system->memory + 70, (char[]){0xF0, 0x80, 0xF0, 0x80, 0xF0}, 5);
   // Ascii "F".
   memcpy(system->memory + 75, (char[]){0xF0, 0x80, 0xF0, 0x80, 0x80}, 5);
+
+  invalidate_decoded(system, 0, FONT_SIZE);
 }
 
 int load_program(const char *filename, chip8 *system) {
   FILE *f = fopen(filename, "rb");
   if (f == NULL) {
-    fprintf(stderr, "Failed to open file: %s\n", filename);
+    LOG_ERROR("Failed to open file: %s", filename);
     return 1;
   }
 
   fseek(f, 0, SEEK_END);
   uint64_t length = ftell(f);
-  if (length > sizeof(system->memory)) {
-    fprintf(stderr, "File is to large to fit in chip8 system memory.\n");
+  if (length > sizeof(system->memory) - 0x200) {
+    LOG_ERROR("File is to large to fit in chip8 system memory.");
+    fclose(f);
     return 1;
   }
 
   fseek(f, 0, SEEK_SET);
   fread(system->memory + 0x200, 1, length, f);
+  invalidate_decoded(system, 0x200, length);
 
   fclose(f);
   return 0;
@@ -84,173 +89,183 @@ chip8 initialize_chip8() {
   chip8 system;
   // Zero-out all of the values in |system|.
   memset(&system, 0, sizeof(system));
+  system.engine = CHIP8_DEFAULT_ENGINE;
+  system.clock_speed = CLOCK_SPEED;
+  chip8_seed(&system, 0);
 
   return system;
 }
 
 void print_chip8(chip8 system) {
-  for (int i = 0; i < 16; ++i) {
-    fprintf(stderr, "V%d: %d, ", i, system.V[i]);
-  }
-  fprintf(stderr, "\n");
+  LOG_DEBUG("V0: %d, V1: %d, V2: %d, V3: %d, V4: %d, V5: %d, V6: %d, V7: %d, "
+            "V8: %d, V9: %d, VA: %d, VB: %d, VC: %d, VD: %d, VE: %d, VF: %d",
+            system.V[0], system.V[1], system.V[2], system.V[3], system.V[4],
+            system.V[5], system.V[6], system.V[7], system.V[8], system.V[9],
+            system.V[10], system.V[11], system.V[12], system.V[13],
+            system.V[14], system.V[15]);
 }
 
-instruction get_instruction(const chip8 *system) {
-  // Read the next 2 bytes from memory.
-  instruction next;
-  next.hi = system->memory[system->pc];
-  next.lo = system->memory[system->pc + 1];
+void chip8_snapshot(const chip8 *system, void *buf) {
+  memcpy(buf, system, CHIP8_SNAPSHOT_SIZE);
+}
+
+// Memory is compared with a snapshot in blocks of this many bytes.
+#define RESTORE_BLOCK 64
+
+void chip8_restore(chip8 *system, const void *buf) {
+  const uint8_t *memory = (const uint8_t *)buf + offsetof(chip8, memory);
+  const uint64_t *screen =
+      (const uint64_t *)((const uint8_t *)buf + offsetof(chip8, screen));
+
+  // Invalidate each run of differing blocks with a single call, as every call
+  // also scans the JIT blocks which may reach into the range.
+  uint32_t start = 0;
+  uint32_t length = 0;
+  uint32_t end = sizeof(system->memory);
+  if (memcmp(system->memory, memory, sizeof(system->memory)) == 0) {
+    // Usually nothing has changed, which is quicker to check all at once.
+    end = 0;
+  }
+  for (uint32_t address = 0; address < end;
+       address += RESTORE_BLOCK) {
+    if (memcmp(system->memory + address, memory + address, RESTORE_BLOCK)) {
+      if (length == 0) {
+        start = address;
+      }
+      length += RESTORE_BLOCK;
+    } else if (length > 0) {
+      invalidate_decoded(system, start, length);
+      length = 0;
+    }
+  }
+  if (length > 0) {
+    invalidate_decoded(system, start, length);
+  }
+
+  for (int y = 0; y < DISPLAY_HEIGHT; ++y) {
+    if (system->screen[y] != screen[y]) {
+      system->dirty_rows |= 1u << y;
+      system->draw_flag = 1;
+    }
+  }
+
+  memcpy(system, buf, CHIP8_SNAPSHOT_SIZE);
+}
 
+opcode_t decode_opcode(uint8_t hi, uint8_t lo) {
   // The highest 4 bits of |hi| are used to determine the opcode.
-  uint8_t msb = next.hi >> 4;
+  uint8_t msb = hi >> 4;
 
   // The last 4 bits of |lo| are used to disambiguate instructions with the same
   // value for |msb|.
-  uint8_t lsb = next.lo & 0x0F;
+  uint8_t lsb = lo & 0x0F;
 
   switch (msb) {
   case 0x0:
-    if (next.hi == 0x00) {
-      if (next.lo == 0xE0) {
-        next.opcode = CLEAR_SCREEN;
-      } else if (next.lo == 0xEE) {
-        next.opcode = RETURN;
-      } else {
-        fprintf(stderr, "Unexpected lo:%2x for msb 0x00\n", next.lo);
-        exit(1);
-      }
-    } else {
-      fprintf(stderr, "machine code routine...\n");
-      exit(1);
-      next.opcode = 0;
+    // Machine code routines (0NNN) aren't supported.
+    if (hi == 0x00 && lo == 0xE0) {
+      return CLEAR_SCREEN;
+    } else if (hi == 0x00 && lo == 0xEE) {
+      return RETURN;
     }
-    break;
+    return UNKNOWN;
   case 0x01:
-    next.opcode = JUMP;
-    break;
+    return JUMP;
   case 0x02:
-    next.opcode = CALL;
-    break;
+    return CALL;
   case 0x03:
-    next.opcode = IF_X_EQ_NN;
-    break;
+    return IF_X_EQ_NN;
   case 0x04:
-    next.opcode = IF_X_NEQ_NN;
-    break;
+    return IF_X_NEQ_NN;
   case 0x05:
-    next.opcode = IF_X_EQ_Y;
-    break;
+    return IF_X_EQ_Y;
   case 0x06:
-    next.opcode = SET_X_NN;
-    break;
+    return SET_X_NN;
   case 0x07:
-    next.opcode = ADD_X_NN;
-    break;
+    return ADD_X_NN;
   case 0x08:
     switch (lsb) {
     case 0:
-      next.opcode = SET_X_Y;
-      break;
+      return SET_X_Y;
     case 1:
-      next.opcode = OR_X_Y;
-      break;
+      return OR_X_Y;
     case 2:
-      next.opcode = AND_X_Y;
-      break;
+      return AND_X_Y;
     case 3:
-      next.opcode = XOR_X_Y;
-      break;
+      return XOR_X_Y;
     case 4:
-      next.opcode = ADD_X_Y;
-      break;
+      return ADD_X_Y;
     case 5:
-      next.opcode = SUB_X_Y;
-      break;
+      return SUB_X_Y;
     case 6:
-      next.opcode = SHIFT_X_RIGHT;
-      break;
+      return SHIFT_X_RIGHT;
     case 7:
-      next.opcode = SUB_X_Y_REV;
-      break;
+      return SUB_X_Y_REV;
     case 0x0E:
-      next.opcode = SHIFT_X_LEFT;
-      break;
+      return SHIFT_X_LEFT;
     default:
-      fprintf(stderr, "Unexpected lsb:%2x for msb 0x08\n", lsb);
-      exit(1);
-      break;
+      return UNKNOWN;
     }
-    break;
   case 0x09:
-    next.opcode = IF_X_NEQ_Y;
-    break;
+    return IF_X_NEQ_Y;
   case 0x0A:
-    next.opcode = SET_I_NNN;
-    break;
+    return SET_I_NNN;
   case 0x0B:
-    next.opcode = JUMP_ADDR;
-    break;
+    return JUMP_ADDR;
   case 0x0C:
-    next.opcode = SET_RAND;
-    break;
+    return SET_RAND;
   case 0x0D:
-    next.opcode = DRAW;
-    break;
+    return DRAW;
   case 0x0E:
-    switch (next.lo) {
+    switch (lo) {
     case 0x9E:
-      next.opcode = IF_KEY_EQ;
-      break;
+      return IF_KEY_EQ;
     case 0xA1:
-      next.opcode = IF_KEY_NEQ;
-      break;
+      return IF_KEY_NEQ;
     default:
-      fprintf(stderr, "Unexpected lo:%2x for msb 0x0E\n", next.lo);
-      exit(1);
-      break;
+      return UNKNOWN;
     }
-    break;
   case 0x0F:
-    switch (next.lo) {
+    switch (lo) {
     case 0x07:
-      next.opcode = GET_DELAY;
-      break;
+      return GET_DELAY;
     case 0x0A:
-      next.opcode = GET_KEY;
-      break;
+      return GET_KEY;
     case 0x15:
-      next.opcode = SET_DELAY;
-      break;
+      return SET_DELAY;
     case 0x18:
-      next.opcode = SET_SOUND;
-      break;
+      return SET_SOUND;
     case 0x1E:
-      next.opcode = ADD_X_I;
-      break;
+      return ADD_X_I;
     case 0x29:
-      next.opcode = LOAD_CHAR;
-      break;
+      return LOAD_CHAR;
     case 0x33:
-      next.opcode = BCD;
-      break;
+      return BCD;
     case 0x55:
-      next.opcode = REG_DUMP;
-      break;
+      return REG_DUMP;
     case 0x65:
-      next.opcode = REG_LOAD;
-      break;
+      return REG_LOAD;
     default:
-      fprintf(stderr, "Unexpected lo:%2x for msb 0x0F\n", next.lo);
-      exit(1);
-      break;
+      return UNKNOWN;
     }
-    break;
   default:
-    fprintf(stderr, "Unexpected value for msb:%2x\n", msb);
-    exit(1);
-    break;
+    return UNKNOWN;
+  }
+}
+
+instruction get_instruction(const chip8 *system) {
+  instruction next;
+  if (system->pc + 1 >= sizeof(system->memory)) {
+    // The instruction would run off the end of memory.
+    next.hi = next.lo = 0;
+    next.opcode = UNKNOWN;
+    return next;
   }
 
+  // Read the next 2 bytes from memory.
+  next.hi = system->memory[system->pc];
+  next.lo = system->memory[system->pc + 1];
+  next.opcode = decode_opcode(next.hi, next.lo);
   return next;
 }
 
@@ -258,12 +273,110 @@ void set_register(uint8_t vx, uint8_t val, chip8 *system) {
   system->V[vx] = val;
 }
 
+void raise_trap(chip8 *system, trap_t trap) {
+  if (system->trap == TRAP_NONE) {
+    system->trap = trap;
+  }
+  // Stay on the instruction which trapped.
+  system->jumped = 1;
+}
+
+const char *trap_name(trap_t trap) {
+  switch (trap) {
+  case TRAP_NONE:
+    return "none";
+  case TRAP_INVALID_OPCODE:
+    return "invalid_opcode";
+  case TRAP_STACK_OVERFLOW:
+    return "stack_overflow";
+  case TRAP_STACK_UNDERFLOW:
+    return "stack_underflow";
+  case TRAP_BAD_ADDRESS:
+    return "bad_address";
+  }
+  return "unknown";
+}
+
+const char *opcode_name(opcode_t opcode) {
+  static const char *const names[] = {
+    [UNKNOWN] = "UNKNOWN",
+    [CLEAR_SCREEN] = "CLEAR_SCREEN",
+    [RETURN] = "RETURN",
+    [JUMP] = "JUMP",
+    [CALL] = "CALL",
+    [IF_X_EQ_NN] = "IF_X_EQ_NN",
+    [IF_X_NEQ_NN] = "IF_X_NEQ_NN",
+    [IF_X_EQ_Y] = "IF_X_EQ_Y",
+    [SET_X_NN] = "SET_X_NN",
+    [ADD_X_NN] = "ADD_X_NN",
+    [SET_X_Y] = "SET_X_Y",
+    [OR_X_Y] = "OR_X_Y",
+    [AND_X_Y] = "AND_X_Y",
+    [XOR_X_Y] = "XOR_X_Y",
+    [ADD_X_Y] = "ADD_X_Y",
+    [SUB_X_Y] = "SUB_X_Y",
+    [SHIFT_X_RIGHT] = "SHIFT_X_RIGHT",
+    [SUB_X_Y_REV] = "SUB_X_Y_REV",
+    [SHIFT_X_LEFT] = "SHIFT_X_LEFT",
+    [IF_X_NEQ_Y] = "IF_X_NEQ_Y",
+    [SET_I_NNN] = "SET_I_NNN",
+    [JUMP_ADDR] = "JUMP_ADDR",
+    [SET_RAND] = "SET_RAND",
+    [DRAW] = "DRAW",
+    [IF_KEY_EQ] = "IF_KEY_EQ",
+    [IF_KEY_NEQ] = "IF_KEY_NEQ",
+    [GET_DELAY] = "GET_DELAY",
+    [GET_KEY] = "GET_KEY",
+    [SET_DELAY] = "SET_DELAY",
+    [SET_SOUND] = "SET_SOUND",
+    [ADD_X_I] = "ADD_X_I",
+    [LOAD_CHAR] = "LOAD_CHAR",
+    [BCD] = "BCD",
+    [REG_DUMP] = "REG_DUMP",
+    [REG_LOAD] = "REG_LOAD",
+  };
+  if ((size_t)opcode >= sizeof(names) / sizeof(names[0])) {
+    return "?";
+  }
+  return names[opcode];
+}
+
+// Returns a nonzero value, after raising TRAP_BAD_ADDRESS, if the |length|
+// bytes at |I| aren't all in memory.
+static inline uint8_t bad_i_range(chip8 *system, uint16_t length) {
+  if (system->I + length > sizeof(system->memory)) {
+    raise_trap(system, TRAP_BAD_ADDRESS);
+    return 1;
+  }
+  return 0;
+}
+
+// The handler for UNKNOWN instructions.
+static void invalid_instruction(instruction next, chip8 *system) {
+  if (system->pc + 1 >= sizeof(system->memory)) {
+    raise_trap(system, TRAP_BAD_ADDRESS);
+  } else {
+    raise_trap(system, TRAP_INVALID_OPCODE);
+  }
+}
+
 void clear_screen(instruction next, chip8 *system) {
+  // Only rows which had pixels set are changed by the clear.
+  for (int y = 0; y < DISPLAY_HEIGHT; ++y) {
+    if (system->screen[y]) {
+      system->dirty_rows |= 1u << y;
+      system->draw_flag = 1;
+    }
+  }
   memset(system->screen, 0, sizeof(system->screen));
 }
 
 void return_subroutine(instruction next, chip8 *system) {
-  // TODO: add a check that sp > 0.
+  if (system->sp == 0) {
+    raise_trap(system, TRAP_STACK_UNDERFLOW);
+    return;
+  }
+
   // Retrieve the old value of |pc| from the stack.
   system->sp -= 1;
   system->pc = system->stack[system->sp];
@@ -279,6 +392,11 @@ void jump(instruction next, chip8 *system) {
 
 void call(instruction next, chip8 *system) {
   uint16_t n = NNN(next);
+  if (system->sp >= sizeof(system->stack) / sizeof(system->stack[0])) {
+    raise_trap(system, TRAP_STACK_OVERFLOW);
+    return;
+  }
+
   // Store the current program counter on the stack.
   system->stack[system->sp] = system->pc;
   system->sp += 1;
@@ -418,6 +536,11 @@ void set_i_nnn(instruction next, chip8 *system) {
 
 void jump_addr(instruction next, chip8 *system) {
   uint16_t n = NNN(next);
+  if (system->V[0] + n >= sizeof(system->memory)) {
+    raise_trap(system, TRAP_BAD_ADDRESS);
+    return;
+  }
+
   // Jump to V0 + n.
   system->pc = system->V[0] + n;
 
@@ -425,157 +548,132 @@ void jump_addr(instruction next, chip8 *system) {
   system->jumped = 1;
 }
 
+// The multiplier and increment of the PCG32 generator.
+#define PCG_MULTIPLIER 6364136223846793005ULL
+#define PCG_INCREMENT 1442695040888963407ULL
+
+uint32_t next_random(uint64_t *rng) {
+  uint64_t old = *rng;
+  *rng = old * PCG_MULTIPLIER + PCG_INCREMENT;
+
+  // Output the top bits of the old state, xorshifted and randomly rotated.
+  uint32_t xorshifted = ((old >> 18) ^ old) >> 27;
+  uint32_t rotation = old >> 59;
+  return (xorshifted >> rotation) | (xorshifted << (-rotation & 31));
+}
+
+void chip8_seed(chip8 *system, uint64_t seed) {
+  // Seeded as by the reference implementation's pcg32_srandom_r().
+  system->rng = 0;
+  next_random(&system->rng);
+  system->rng += seed;
+  next_random(&system->rng);
+}
+
 void set_rand(instruction next, chip8 *system) {
   uint8_t x = X(next);
   uint8_t n = NN(next);
   // Generate the random number.
-  uint8_t r = rand() % 256;
+  uint8_t r;
+  if (system->libc_rand) {
+    r = rand() % 256;
+  } else {
+    r = next_random(&system->rng) >> 24;
+  }
 
   system->V[x] = r & n;
 }
 
 void draw_row(uint8_t x, uint8_t y, uint8_t row, chip8 *system) {
-  for (int i = 0; i < 8; ++i) {
-    uint8_t sprite_pixel = (row >> i) & 1;
-    // Start from the right side of the row.
-    uint16_t screen_index = (x + (7 - i)) + (64 * y);
-
-    // Store the previous state of the screen pixel.
-    uint8_t previous_state = system->screen[screen_index];
+  // Line up the sprite row with the screen row. Pixels past the right edge are
+  // shifted out, clipping the sprite.
+  uint64_t pixels = ((uint64_t)row << (DISPLAY_WIDTH - 8)) >> x;
 
-    // Draw the pixel to the screen.
-    system->screen[screen_index] = system->screen[screen_index] ^ sprite_pixel;
+  // If any previously set pixel is flipped, set VF = 1.
+  if (system->screen[y] & pixels) {
+    system->V[0x0F] = 1;
+  }
 
-    // If a previously set pixel was flipped, set VF = 1.
-    if (previous_state == 1 && system->screen[screen_index] == 0) {
-      system->V[0x0F] = 1;
-    }
+  // Draw the row to the screen.
+  system->screen[y] ^= pixels;
+  if (pixels) {
+    system->dirty_rows |= 1u << y;
   }
 }
 
 void draw(instruction next, chip8 *system) {
-  uint8_t x = X(next);
-  uint8_t y = Y(next);
   uint8_t n = N(next);
 
+  // The starting coordinate wraps around the screen.
+  uint8_t x = system->V[X(next)] % DISPLAY_WIDTH;
+  uint8_t y = system->V[Y(next)] % DISPLAY_HEIGHT;
+
+  if (bad_i_range(system, n)) {
+    return;
+  }
+
   // Set the initial state of VF to 0.
   system->V[0x0F] = 0;
 
-  for (int i = 0; i < n; ++i) {
+  // Rows past the bottom edge are clipped.
+  for (int i = 0; i < n && y + i < DISPLAY_HEIGHT; ++i) {
     // Load the row as bit-encoded memory.
     uint8_t row = system->memory[system->I + i];
-    draw_row(system->V[x], system->V[y] + i, row, system);
+    draw_row(x, y + i, row, system);
   }
 
   system->draw_flag = 1;
 }
 
-void if_key_eq(instruction next, chip8 *system) {
-  uint8_t x = X(next);
-  system->skip = system->keys[system->V[x]];
+uint8_t get_pixel(const chip8 *system, uint8_t x, uint8_t y) {
+  return (system->screen[y] >> (DISPLAY_WIDTH - 1 - x)) & 1;
 }
 
-void if_key_neq(instruction next, chip8 *system) {
-  uint8_t x = X(next);
-  system->skip = !system->keys[system->V[x]];
+uint64_t screen_hash(const chip8 *system) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (int y = 0; y < DISPLAY_HEIGHT; ++y) {
+    for (int shift = 56; shift >= 0; shift -= 8) {
+      hash ^= (system->screen[y] >> shift) & 0xFF;
+      hash *= 0x100000001b3;
+    }
+  }
+  return hash;
 }
 
-void get_delay(instruction next, chip8 *system) {
-  uint8_t x = X(next);
-  system->V[x] = system->delay_timer;
-}
+void set_key(chip8 *system, uint8_t key, uint8_t pressed) {
+  LOG_DEBUG("key %X %s", key & 0xF, pressed ? "pressed" : "released");
+  system->keys[key & 0xF] = pressed;
 
-uint8_t is_chip8_key(SDL_Keycode keycode) {
-  switch (keycode) {
-  case SDLK_1:
-  case SDLK_2:
-  case SDLK_3:
-  case SDLK_4:
-  case SDLK_q:
-  case SDLK_w:
-  case SDLK_e:
-  case SDLK_r:
-  case SDLK_a:
-  case SDLK_s:
-  case SDLK_d:
-  case SDLK_f:
-  case SDLK_z:
-  case SDLK_x:
-  case SDLK_c:
-  case SDLK_v:
-    return 1;
-  default:
-    return 0;
+  if (pressed && system->waiting_for_key) {
+    // Store pressed key in VX and continue after the GET_KEY instruction.
+    system->V[system->key_register] = key & 0xF;
+    system->waiting_for_key = 0;
+    system->pc += 2;
   }
-  return 0;
 }
 
-uint8_t hex_keycode(SDL_Keycode keycode) {
-  switch (keycode) {
-  case SDLK_1:
-    return 0x01;
-  case SDLK_2:
-    return 0x02;
-  case SDLK_3:
-    return 0x03;
-  case SDLK_4:
-    return 0x0C;
-  case SDLK_q:
-    return 0x04;
-  case SDLK_w:
-    return 0x05;
-  case SDLK_e:
-    return 0x06;
-  case SDLK_r:
-    return 0x0D;
-  case SDLK_a:
-    return 0x07;
-  case SDLK_s:
-    return 0x08;
-  case SDLK_d:
-    return 0x09;
-  case SDLK_f:
-    return 0x0E;
-  case SDLK_z:
-    return 0x0A;
-  case SDLK_x:
-    return 0x00;
-  case SDLK_c:
-    return 0x0B;
-  case SDLK_v:
-    return 0x0F;
-  default:
-    fprintf(stderr, "Invalid hex keycode %d\n", keycode);
-    return 0;
-  }
+void if_key_eq(instruction next, chip8 *system) {
+  uint8_t x = X(next);
+  system->skip = system->keys[system->V[x] & 0xF];
 }
 
-SDL_Event wait_for_keypress() {
-  SDL_Event e;
-  while (SDL_PollEvent(&e) == 0 ||
-         ((e.type != SDL_KEYDOWN || !is_chip8_key(e.key.keysym.sym)) &&
-          e.type != SDL_QUIT))
-    ;
-  return e;
+void if_key_neq(instruction next, chip8 *system) {
+  uint8_t x = X(next);
+  system->skip = !system->keys[system->V[x] & 0xF];
 }
 
-void get_key(instruction next, chip8 *system) {
+void get_delay(instruction next, chip8 *system) {
   uint8_t x = X(next);
+  system->V[x] = system->delay_timer;
+}
 
-  SDL_Event e = wait_for_keypress();
-  if (e.type == SDL_QUIT) {
-    fprintf(stderr, "Received quit event");
-    exit(1);
-  }
-  if (e.type == SDL_KEYDOWN) {
-    SDL_Keycode keycode = e.key.keysym.sym;
-    fprintf(stderr, "key pressed: %d\n", keycode);
-    // TODO: Add validation for chip8 keycode values.
-    // Convert pressed key to chip8 hex keyboard value.
-
-    // Store pressed key in VX
-    system->V[x] = hex_keycode(keycode);
-  }
+void get_key(instruction next, chip8 *system) {
+  // Stay on this instruction until set_key() stores the pressed key in VX and
+  // moves on.
+  LOG_DEBUG("waiting for a key into V%X at 0x%03x", X(next), system->pc);
+  system->waiting_for_key = 1;
+  system->key_register = X(next);
+  system->jumped = 1;
 }
 
 void set_delay(instruction next, chip8 *system) {
@@ -653,6 +751,10 @@ void load_char(instruction next, chip8 *system) {
 void bcd(instruction next, chip8 *system) {
   uint8_t x = X(next);
 
+  if (bad_i_range(system, 3)) {
+    return;
+  }
+
   uint8_t vx = system->V[x];
   // Store the ones digit at I+2
   system->memory[system->I + 2] = vx % 10;
@@ -664,19 +766,29 @@ void bcd(instruction next, chip8 *system) {
   // Store the hundreds digit at I
   vx /= 10;
   system->memory[system->I] = vx % 10;
+
+  invalidate_decoded(system, system->I, 3);
 }
 
 void reg_dump(instruction next, chip8 *system) {
   uint8_t x = X(next);
+  if (bad_i_range(system, x + 1)) {
+    return;
+  }
 
   // Store the values of each register from V0 to VX in memory.
   for (uint8_t i = 0; i <= x; ++i) {
     system->memory[system->I + i] = system->V[i];
   }
+
+  invalidate_decoded(system, system->I, x + 1);
 }
 
 void reg_load(instruction next, chip8 *system) {
   uint8_t x = X(next);
+  if (bad_i_range(system, x + 1)) {
+    return;
+  }
 
   // Load values for V0 to VX from memory.
   for (uint8_t i = 0; i <= x; ++i) {
@@ -684,6 +796,82 @@ void reg_load(instruction next, chip8 *system) {
   }
 }
 
+// The handler for each opcode, indexed by opcode_t.
+static const instruction_handler handlers[] = {
+    [UNKNOWN] = invalid_instruction,
+    [CLEAR_SCREEN] = clear_screen,
+    [RETURN] = return_subroutine,
+    [JUMP] = jump,
+    [CALL] = call,
+    [IF_X_EQ_NN] = if_x_eq_nn,
+    [IF_X_NEQ_NN] = if_x_neq_nn,
+    [IF_X_EQ_Y] = if_x_eq_y,
+    [SET_X_NN] = set_x_nn,
+    [ADD_X_NN] = add_x_nn,
+    [SET_X_Y] = set_x_y,
+    [OR_X_Y] = or_x_y,
+    [AND_X_Y] = and_x_y,
+    [XOR_X_Y] = xor_x_y,
+    [ADD_X_Y] = add_x_y,
+    [SUB_X_Y] = sub_x_y,
+    [SHIFT_X_RIGHT] = shift_x_right,
+    [SUB_X_Y_REV] = sub_x_y_rev,
+    [SHIFT_X_LEFT] = shift_x_left,
+    [IF_X_NEQ_Y] = if_x_neq_y,
+    [SET_I_NNN] = set_i_nnn,
+    [JUMP_ADDR] = jump_addr,
+    [SET_RAND] = set_rand,
+    [DRAW] = draw,
+    [IF_KEY_EQ] = if_key_eq,
+    [IF_KEY_NEQ] = if_key_neq,
+    [GET_DELAY] = get_delay,
+    [GET_KEY] = get_key,
+    [SET_DELAY] = set_delay,
+    [SET_SOUND] = set_sound,
+    [ADD_X_I] = add_x_i,
+    [LOAD_CHAR] = load_char,
+    [BCD] = bcd,
+    [REG_DUMP] = reg_dump,
+    [REG_LOAD] = reg_load,
+};
+
+const decoded_instruction *fetch_decoded(chip8 *system, uint16_t pc) {
+  decoded_instruction *d = &system->decoded[pc >> 1];
+  if (d->handler != NULL) {
+    return d;
+  }
+
+  // First time this instruction is executed, decode it and its operands.
+  d->next = get_instruction(system);
+  d->handler = handlers[d->next.opcode];
+  d->x = X(d->next);
+  d->y = Y(d->next);
+  d->n = N(d->next);
+  d->nn = NN(d->next);
+  d->nnn = NNN(d->next);
+  return d;
+}
+
+void invalidate_decoded(chip8 *system, uint16_t address, uint16_t length) {
+  if (length == 0 || address >= sizeof(system->memory)) {
+    return;
+  }
+
+  uint32_t last = (uint32_t)address + length - 1;
+  if (last >= sizeof(system->memory)) {
+    last = sizeof(system->memory) - 1;
+  }
+
+  // Each slot covers 2 bytes of memory.
+  for (uint32_t slot = address >> 1; slot <= last >> 1; ++slot) {
+    system->decoded[slot].handler = NULL;
+  }
+
+  if (system->jit != NULL) {
+    jit_invalidate(system->jit, address, last - address + 1);
+  }
+}
+
 void perform_instruction(instruction next, chip8 *system) {
   switch (next.opcode) {
   case CLEAR_SCREEN:
@@ -734,6 +922,9 @@ void perform_instruction(instruction next, chip8 *system) {
   case SHIFT_X_RIGHT:
     shift_x_right(next, system);
     break;
+  case SUB_X_Y_REV:
+    sub_x_y_rev(next, system);
+    break;
   case SHIFT_X_LEFT:
     shift_x_left(next, system);
     break;
@@ -786,46 +977,42 @@ void perform_instruction(instruction next, chip8 *system) {
     reg_load(next, system);
     break;
   default:
-    fprintf(stderr, "Unknown instruction: %d\n", next.opcode);
+    invalid_instruction(next, system);
     break;
   }
 }
 
-void draw_screen(chip8 *system) {
-  SDL_Surface *screen_surface = system->screen_surface;
-  // Fill the screen black.
-  SDL_FillRect(screen_surface, NULL,
-               SDL_MapRGB(screen_surface->format, 0, 0, 0));
+// Counts down the timers by |ticks| frames.
+static void tick_timers(chip8 *system, uint64_t ticks) {
+  if (system->delay_timer > ticks) {
+    system->delay_timer -= ticks;
+  } else {
+    system->delay_timer = 0;
+  }
 
-  for (int i = 0; i < 32; ++i) {
-    for (int j = 0; j < 64; ++j) {
-      // Skip drawing if the pixel in the screen isn't set.
-      if (!system->screen[i * 64 + j]) {
-        continue;
-      }
-      SDL_Rect rect;
-      rect.y = i * 10;
-      rect.x = j * 10;
-      rect.h = 10;
-      rect.w = 10;
-      SDL_FillRect(screen_surface, &rect,
-                   SDL_MapRGB(screen_surface->format, 0xFF, 0xFF, 0xFF));
+  // Beep once for each tick that the sound timer was still running.
+  uint8_t beeps = system->sound_timer > ticks ? ticks : system->sound_timer;
+  if (system->host != NULL && system->host->beep != NULL) {
+    for (uint8_t i = 0; i < beeps; ++i) {
+      system->host->beep(system->host->userdata);
     }
   }
+  system->sound_timer -= beeps;
 }
 
-void emulate_cycle(chip8 *system) {
-  // Determine next instrution.
-  instruction next = get_instruction(system);
+// Updates the cycle count and timers for one cycle.
+static inline void tick_cycle(chip8 *system) {
+  ++system->cycle;
 
-  // If the skip flag is set from the previous cycle, ignore the current
-  // instruction and reset the skip flag.
-  if (system->skip) {
-    system->skip = 0;
-  } else {
-    perform_instruction(next, system);
+  // Tick the timers when the cycle crosses into a new frame.
+  system->timer_phase += FRAME_RATE;
+  if (system->timer_phase >= system->clock_speed) {
+    system->timer_phase -= system->clock_speed;
+    tick_timers(system, 1);
   }
+}
 
+void end_cycle(chip8 *system) {
   // Increment the Program Counter by 2 bytes.
   if (!system->jumped) {
     system->pc += 2;
@@ -833,50 +1020,406 @@ void emulate_cycle(chip8 *system) {
     system->jumped = 0;
   }
 
-  ++system->cycle;
+  tick_cycle(system);
+}
 
-  // Update system timers.
-  if (system->cycle > CLOCK_SPEED / 60) {
-    if (system->delay_timer > 0) {
-      --system->delay_timer;
+void advance_cycles(chip8 *system, uint64_t cycles) {
+  system->cycle += cycles;
+
+  uint64_t phase = system->timer_phase + cycles * FRAME_RATE;
+  system->timer_phase = phase % system->clock_speed;
+  tick_timers(system, phase / system->clock_speed);
+}
+
+void emulate_cycle(chip8 *system) {
+  // If the skip flag is set from the previous cycle, ignore the current
+  // instruction and reset the skip flag.
+  if (system->skip) {
+    system->skip = 0;
+    PROFILE_SKIP();
+  } else if (system->pc & 1) {
+    // Instructions at odd addresses aren't cached, decode them every time.
+    instruction next = get_instruction(system);
+    PROFILE_HANDLER(system, next.opcode, perform_instruction(next, system));
+  } else {
+    const decoded_instruction *d = fetch_decoded(system, system->pc);
+    PROFILE_HANDLER(system, d->next.opcode, d->handler(d->next, system));
+  }
+
+  end_cycle(system);
+}
+
+uint64_t skip_idle_loop(chip8 *system, uint64_t cycles) {
+#ifdef CHIP8_PROFILE
+  // Skipping is disabled so that the profile counts every iteration exactly.
+  return 0;
+#else
+  uint16_t pc = system->pc;
+  if (system->trap || system->skip || (pc & 1) ||
+      pc + 6 > sizeof(system->memory)) {
+    return 0;
+  }
+  const uint8_t *m = system->memory + pc;
+  uint8_t jump_hi = 0x10 | pc >> 8;
+  uint8_t jump_lo = pc & 0xFF;
+
+  // 1PPP: nothing ever changes.
+  if (m[0] == jump_hi && m[1] == jump_lo) {
+    advance_cycles(system, cycles);
+    return cycles;
+  }
+
+  // EX9E or EXA1, 1PPP: the keys only change between run_cycles() calls.
+  if ((m[0] & 0xF0) == 0xE0 && (m[1] == 0x9E || m[1] == 0xA1) &&
+      m[2] == jump_hi && m[3] == jump_lo) {
+    uint8_t pressed = system->keys[system->V[m[0] & 0x0F] & 0xF] != 0;
+    if (pressed != (m[1] == 0xA1)) {
+      // The instruction skips the jump.
+      return 0;
     }
-    if (system->sound_timer > 0) {
-      fprintf(stderr, "BEEP!\n");
-      --system->sound_timer;
+    uint64_t skipped = cycles - cycles % 2;
+    advance_cycles(system, skipped);
+    return skipped;
+  }
+
+  // FX07, 3XNN, 1PPP: the delay timer only counts down.
+  if ((m[0] & 0xF0) == 0xF0 && m[1] == 0x07 && m[2] == (0x30 | (m[0] & 0x0F)) &&
+      m[4] == jump_hi && m[5] == jump_lo) {
+    uint8_t x = m[0] & 0x0F;
+    uint8_t nn = m[3];
+    uint8_t delay = system->delay_timer;
+    uint64_t iterations = cycles / 3;
+    if (nn < delay) {
+      // The loop ends in the first iteration which starts after the timer has
+      // ticked |delay - nn| times.
+      uint64_t phase =
+          (uint64_t)(delay - nn) * system->clock_speed - system->timer_phase;
+      uint64_t last = (phase + 3 * FRAME_RATE - 1) / (3 * FRAME_RATE);
+      if (last < iterations) {
+        iterations = last;
+      }
+    } else if (nn == delay) {
+      return 0;
     }
+    if (iterations == 0) {
+      return 0;
+    }
+
+    // VX holds the timer as read by the last iteration skipped.
+    uint64_t ticks =
+        (system->timer_phase + (iterations - 1) * 3 * FRAME_RATE) /
+        system->clock_speed;
+    system->V[x] = ticks < delay ? delay - ticks : 0;
+    advance_cycles(system, iterations * 3);
+    return iterations * 3;
   }
+
+  return 0;
+#endif
 }
 
-void game_loop(chip8 *system) {
-  uint8_t running = 1;
-  SDL_Event event;
-  while (running) {
-    while (SDL_PollEvent(&event) > 0) {
-      switch (event.type) {
-      case SDL_QUIT:
-        running = 0;
-        break;
-      case SDL_KEYDOWN:
-        if (is_chip8_key(event.key.keysym.sym)) {
-          system->keys[hex_keycode(event.key.keysym.sym)] = 1;
-        }
-        break;
-      case SDL_KEYUP:
-        if (is_chip8_key(event.key.keysym.sym)) {
-          system->keys[hex_keycode(event.key.keysym.sym)] = 0;
-        }
-        break;
-      }
+// Returns a nonzero value if |d|, a JUMP which was just performed, jumped
+// back by at most 2 instructions: the shape of the loops skip_idle_loop()
+// recognizes.
+static inline uint8_t jumped_back_short(const chip8 *system,
+                                        const decoded_instruction *d) {
+  uint16_t address = (d - system->decoded) << 1;
+  return (uint16_t)(address - system->pc) <= 4;
+}
+
+// Threaded versions of the most common instructions. They work on the operands
+// stored in the decoded instruction instead of extracting them from |next|.
+
+static inline void t_return(chip8 *system, const decoded_instruction *d) {
+  if (system->sp == 0) {
+    raise_trap(system, TRAP_STACK_UNDERFLOW);
+    return;
+  }
+  system->sp -= 1;
+  system->pc = system->stack[system->sp];
+}
+
+static inline void t_jump(chip8 *system, const decoded_instruction *d) {
+  system->pc = d->nnn;
+  system->jumped = 1;
+}
+
+static inline void t_call(chip8 *system, const decoded_instruction *d) {
+  if (system->sp >= sizeof(system->stack) / sizeof(system->stack[0])) {
+    raise_trap(system, TRAP_STACK_OVERFLOW);
+    return;
+  }
+  system->stack[system->sp] = system->pc;
+  system->sp += 1;
+  system->pc = d->nnn;
+  system->jumped = 1;
+}
+
+static inline void t_if_x_eq_nn(chip8 *system, const decoded_instruction *d) {
+  system->skip = (system->V[d->x] == d->nn);
+}
+
+static inline void t_if_x_neq_nn(chip8 *system, const decoded_instruction *d) {
+  system->skip = (system->V[d->x] != d->nn);
+}
+
+static inline void t_if_x_eq_y(chip8 *system, const decoded_instruction *d) {
+  system->skip = (system->V[d->x] == system->V[d->y]);
+}
+
+static inline void t_set_x_nn(chip8 *system, const decoded_instruction *d) {
+  system->V[d->x] = d->nn;
+}
+
+static inline void t_add_x_nn(chip8 *system, const decoded_instruction *d) {
+  system->V[d->x] += d->nn;
+}
+
+static inline void t_set_x_y(chip8 *system, const decoded_instruction *d) {
+  system->V[d->x] = system->V[d->y];
+}
+
+static inline void t_or_x_y(chip8 *system, const decoded_instruction *d) {
+  system->V[d->x] |= system->V[d->y];
+}
+
+static inline void t_and_x_y(chip8 *system, const decoded_instruction *d) {
+  system->V[d->x] &= system->V[d->y];
+}
+
+static inline void t_xor_x_y(chip8 *system, const decoded_instruction *d) {
+  system->V[d->x] ^= system->V[d->y];
+}
+
+// NOTE: The arithmetic instructions set VF before writing VX, exactly like
+//       their regular handlers, so that they agree when X or Y is F.
+
+static inline void t_add_x_y(chip8 *system, const decoded_instruction *d) {
+  uint8_t *V = system->V;
+  V[0xF] = (V[d->x] + V[d->y]) > 255;
+  V[d->x] = V[d->x] + V[d->y];
+}
+
+static inline void t_sub_x_y(chip8 *system, const decoded_instruction *d) {
+  uint8_t *V = system->V;
+  V[0xF] = V[d->x] >= V[d->y];
+  V[d->x] = V[d->x] - V[d->y];
+}
+
+static inline void t_shift_x_right(chip8 *system,
+                                   const decoded_instruction *d) {
+  uint8_t *V = system->V;
+  V[0xF] = V[d->x] & 0b00000001;
+  V[d->x] = V[d->x] >> 1;
+}
+
+static inline void t_sub_x_y_rev(chip8 *system, const decoded_instruction *d) {
+  uint8_t *V = system->V;
+  V[0xF] = 1;
+  V[d->x] = V[d->y] - V[d->x];
+}
+
+static inline void t_shift_x_left(chip8 *system,
+                                  const decoded_instruction *d) {
+  uint8_t *V = system->V;
+  V[0xF] = V[d->x] >> 7;
+  V[d->x] = V[d->x] << 1;
+}
+
+static inline void t_if_x_neq_y(chip8 *system, const decoded_instruction *d) {
+  system->skip = (system->V[d->x] != system->V[d->y]);
+}
+
+static inline void t_set_i_nnn(chip8 *system, const decoded_instruction *d) {
+  system->I = d->nnn;
+}
+
+static inline void t_jump_addr(chip8 *system, const decoded_instruction *d) {
+  if (system->V[0] + d->nnn >= sizeof(system->memory)) {
+    raise_trap(system, TRAP_BAD_ADDRESS);
+    return;
+  }
+  system->pc = system->V[0] + d->nnn;
+  system->jumped = 1;
+}
+
+static inline void t_get_delay(chip8 *system, const decoded_instruction *d) {
+  system->V[d->x] = system->delay_timer;
+}
+
+static inline void t_set_delay(chip8 *system, const decoded_instruction *d) {
+  system->delay_timer = system->V[d->x];
+}
+
+static inline void t_add_x_i(chip8 *system, const decoded_instruction *d) {
+  system->I += system->V[d->x];
+}
+
+static inline void t_reg_load(chip8 *system, const decoded_instruction *d) {
+  if (bad_i_range(system, d->x + 1)) {
+    return;
+  }
+  for (uint8_t i = 0; i <= d->x; ++i) {
+    system->V[i] = system->memory[system->I + i];
+  }
+}
+
+// Everything else (drawing, input, sound, randomness and memory writes) goes
+// through the instruction's regular handler.
+static inline void t_handler(chip8 *system, const decoded_instruction *d) {
+  d->handler(d->next, system);
+}
+
+// The threaded implementation of every opcode.
+#define THREADED_OPS(OP)                                                       \
+  OP(UNKNOWN, t_handler)                                                       \
+  OP(CLEAR_SCREEN, t_handler)                                                  \
+  OP(RETURN, t_return)                                                         \
+  OP(JUMP, t_jump)                                                             \
+  OP(CALL, t_call)                                                             \
+  OP(IF_X_EQ_NN, t_if_x_eq_nn)                                                 \
+  OP(IF_X_NEQ_NN, t_if_x_neq_nn)                                               \
+  OP(IF_X_EQ_Y, t_if_x_eq_y)                                                   \
+  OP(SET_X_NN, t_set_x_nn)                                                     \
+  OP(ADD_X_NN, t_add_x_nn)                                                     \
+  OP(SET_X_Y, t_set_x_y)                                                       \
+  OP(OR_X_Y, t_or_x_y)                                                         \
+  OP(AND_X_Y, t_and_x_y)                                                       \
+  OP(XOR_X_Y, t_xor_x_y)                                                       \
+  OP(ADD_X_Y, t_add_x_y)                                                       \
+  OP(SUB_X_Y, t_sub_x_y)                                                       \
+  OP(SHIFT_X_RIGHT, t_shift_x_right)                                           \
+  OP(SUB_X_Y_REV, t_sub_x_y_rev)                                               \
+  OP(SHIFT_X_LEFT, t_shift_x_left)                                             \
+  OP(IF_X_NEQ_Y, t_if_x_neq_y)                                                 \
+  OP(SET_I_NNN, t_set_i_nnn)                                                   \
+  OP(JUMP_ADDR, t_jump_addr)                                                   \
+  OP(SET_RAND, t_handler)                                                      \
+  OP(DRAW, t_handler)                                                          \
+  OP(IF_KEY_EQ, t_handler)                                                     \
+  OP(IF_KEY_NEQ, t_handler)                                                    \
+  OP(GET_DELAY, t_get_delay)                                                   \
+  OP(GET_KEY, t_handler)                                                       \
+  OP(SET_DELAY, t_set_delay)                                                   \
+  OP(SET_SOUND, t_handler)                                                     \
+  OP(ADD_X_I, t_add_x_i)                                                       \
+  OP(LOAD_CHAR, t_handler)                                                     \
+  OP(BCD, t_handler)                                                           \
+  OP(REG_DUMP, t_handler)                                                      \
+  OP(REG_LOAD, t_reg_load)
+
+#if defined(__GNUC__) && !defined(CHIP8_NO_COMPUTED_GOTO)
+
+void run_threaded(chip8 *system, uint64_t cycles) {
+#define THREADED_LABEL(op, fn) [op] = &&op_##op,
+  static void *const labels[] = {THREADED_OPS(THREADED_LABEL)};
+#undef THREADED_LABEL
+
+  const decoded_instruction *d;
+
+  // Jumps to the handler for the instruction at |pc|. Skipped instructions and
+  // instructions at odd addresses aren't cached, emulate_cycle() handles them.
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    while (cycles > 0 && (system->skip || (system->pc & 1)) &&               \
+           !system->trap) {                                                    \
+      emulate_cycle(system);                                                   \
+      --cycles;                                                                \
+    }                                                                          \
+    if (cycles == 0 || system->trap) {                                         \
+      return;                                                                  \
+    }                                                                          \
+    --cycles;                                                                  \
+    d = &system->decoded[system->pc >> 1];                                     \
+    if (d->handler == NULL) {                                                  \
+      d = fetch_decoded(system, system->pc);                                   \
+    }                                                                          \
+    goto *labels[d->next.opcode];                                              \
+  } while (0)
+
+  DISPATCH();
+
+#define THREADED_BODY(op, fn)                                                  \
+  op_##op : PROFILE_HANDLER(system, op, fn(system, d));                        \
+  end_cycle(system);                                                           \
+  if (op == JUMP && jumped_back_short(system, d)) {                            \
+    cycles -= skip_idle_loop(system, cycles);                                  \
+  }                                                                            \
+  DISPATCH();
+  THREADED_OPS(THREADED_BODY)
+#undef THREADED_BODY
+#undef DISPATCH
+}
+
+#else
+
+void run_threaded(chip8 *system, uint64_t cycles) {
+#define THREADED_ENTRY(op, fn) [op] = fn,
+  static void (*const ops[])(chip8 *, const decoded_instruction *) = {
+      THREADED_OPS(THREADED_ENTRY)};
+#undef THREADED_ENTRY
+
+  for (; cycles > 0 && !system->trap; --cycles) {
+    if (system->skip || (system->pc & 1)) {
+      emulate_cycle(system);
+      continue;
     }
+    const decoded_instruction *d = fetch_decoded(system, system->pc);
+    PROFILE_HANDLER(system, d->next.opcode,
+                    ops[d->next.opcode](system, d));
+    end_cycle(system);
+    if (d->next.opcode == JUMP && jumped_back_short(system, d)) {
+      // This cycle is counted by the loop.
+      cycles -= skip_idle_loop(system, cycles - 1);
+    }
+  }
+}
+
+#endif
+
+void present_frame(chip8 *system) {
+  if (!system->draw_flag) {
+    return;
+  }
+  if (system->host != NULL && system->host->present != NULL) {
+    system->host->present(system->host->userdata, system);
+  }
+  system->draw_flag = 0;
+  system->dirty_rows = 0;
+}
 
-    // Emulate one cycle.
-    emulate_cycle(system);
+void run_cycles(chip8 *system, uint64_t cycles) {
+  PROFILE_POLL(system);
+  if (system->trap) {
+    return;
+  }
+  if (system->waiting_for_key) {
+    // Nothing would run but GET_KEY over and over.
+    advance_cycles(system, cycles);
+    return;
+  }
 
-    // If the draw flag is set, update the screen.
-    if (system->draw_flag) {
-      draw_screen(system);
-      SDL_UpdateWindowSurface(system->window);
-      system->draw_flag = 0;
+  switch (system->engine) {
+  case ENGINE_THREADED:
+    run_threaded(system, cycles);
+    break;
+  case ENGINE_JIT:
+#ifdef CHIP8_PROFILE
+    // Translated code isn't instrumented, see profile.h.
+    run_threaded(system, cycles);
+#else
+    run_jit(system, cycles);
+#endif
+    break;
+  default:
+    for (uint64_t i = 0; i < cycles && !system->trap; ++i) {
+      uint16_t pc = system->pc;
+      emulate_cycle(system);
+      if ((uint16_t)(pc - system->pc) <= 4) {
+        // Went back by at most 2 instructions, which might be an idle loop.
+        i += skip_idle_loop(system, cycles - i - 1);
+      }
     }
+    break;
   }
-}
\ No newline at end of file
+}
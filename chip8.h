@@ -1,9 +1,22 @@
-#include <stdint.h>
+#ifndef CHIP8_H
+#define CHIP8_H
 
-#include <SDL2/SDL.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #define FONT_SIZE 80
+#define DISPLAY_WIDTH 64
+#define DISPLAY_HEIGHT 32
+// The number of instructions run per second, and the rate at which the timers
+// count down and the screen is presented.
 #define CLOCK_SPEED 1000000
+#define FRAME_RATE 60
+
+// The engine used to run instructions by default. Can be overridden at build
+// time, e.g. with -DCHIP8_DEFAULT_ENGINE=ENGINE_THREADED.
+#ifndef CHIP8_DEFAULT_ENGINE
+#define CHIP8_DEFAULT_ENGINE ENGINE_SWITCH
+#endif
 
 typedef enum opcode {
   UNKNOWN = 0,
@@ -44,14 +57,79 @@ typedef enum opcode {
   REG_LOAD,      // 0xFX65
 } opcode_t;
 
+// Reasons for a program to stop. Once a trap is raised the system is halted:
+// run_cycles() no longer executes anything and |pc| is left on the instruction
+// which trapped.
+typedef enum trap {
+  TRAP_NONE = 0,
+  // The instruction at |pc| isn't a valid instruction (including 0NNN).
+  TRAP_INVALID_OPCODE,
+  // CALL (0x2NNN) with all 16 stack entries in use.
+  TRAP_STACK_OVERFLOW,
+  // RETURN (0x00EE) with an empty stack.
+  TRAP_STACK_UNDERFLOW,
+  // |pc|, or a memory access at |I|, is past the end of memory.
+  TRAP_BAD_ADDRESS,
+} trap_t;
+
+// The ways in which run_cycles() can execute instructions. All of them produce
+// identical results.
+typedef enum engine {
+  // Dispatches each instruction through emulate_cycle().
+  ENGINE_SWITCH = 0,
+  // Direct-threaded dispatch over the decoded instruction cache, see
+  // run_threaded().
+  ENGINE_THREADED,
+  // Native code translated from the program, see jit.h. Falls back to
+  // ENGINE_THREADED if |jit| isn't set.
+  ENGINE_JIT,
+} engine_t;
+
 typedef struct instruction {
   opcode_t opcode;
   uint8_t hi;
   uint8_t lo;
 } instruction;
 
+// Logs |i| at debug level, see log.h.
 void print_instruction(instruction i);
 
+struct chip8;
+
+// Every instruction is performed by a handler with this signature.
+typedef void (*instruction_handler)(instruction next, struct chip8 *system);
+
+// An instruction that has already been decoded, along with its operands.
+typedef struct decoded_instruction {
+  // The handler which performs |next|, or NULL if the slot hasn't been decoded
+  // yet (or has been invalidated by a write to memory).
+  instruction_handler handler;
+
+  instruction next;
+
+  // The operands of |next|, see X(), Y(), N(), NN() and NNN().
+  uint8_t x;
+  uint8_t y;
+  uint8_t n;
+  uint8_t nn;
+  uint16_t nnn;
+} decoded_instruction;
+
+// The interface between the core and the machine it runs on: video, input and
+// audio. Any of the callbacks may be NULL, e.g. when running headless.
+typedef struct chip8_host {
+  // Passed to each of the callbacks.
+  void *userdata;
+
+  // Displays |system->screen|. Called by present_frame() when the screen has
+  // changed. Only the rows in |system->dirty_rows| differ from the previous
+  // call.
+  void (*present)(void *userdata, const struct chip8 *system);
+
+  // Called on every timer update while the sound timer is nonzero.
+  void (*beep)(void *userdata);
+} chip8_host;
+
 typedef struct chip8 {
   // The Chip 8 has 4k of memory in total.
   uint8_t memory[4096];
@@ -78,7 +156,9 @@ typedef struct chip8 {
   uint8_t keys[16];
 
   // The Chip 8 has a monochrome screen with a 64 x 32 resolution.
-  uint8_t screen[64 * 32];
+  // Each row is packed into a single word, with the leftmost pixel in the most
+  // significant bit. See get_pixel().
+  uint64_t screen[DISPLAY_HEIGHT];
 
   // Whether to skip the following instruction.
   uint8_t skip;
@@ -90,24 +170,83 @@ typedef struct chip8 {
   // nonzero. Counts down at 60Hz.
   uint8_t sound_timer;
 
-  // Indicates that a "DRAW" operation has been performed on the previous cycle
-  // and that the screen should be updated.
-  uint8_t draw_flag;
-
   // Flag used to indicate that a "jump-like" instruction has just been
   // executed. If this flag is set then the Program Counter isn't incremented
   // for the cycle.
   uint8_t jumped;
 
+  // Set while a GET_KEY instruction (0xFX0A) is waiting for a key press, which
+  // is stored in V[|key_register|]. |pc| stays on the instruction until
+  // set_key() reports a press.
+  uint8_t waiting_for_key;
+  uint8_t key_register;
+
+  // The trap_t which halted the system, or TRAP_NONE while it is running.
+  uint8_t trap;
+
+  // The number of cycles executed so far. At |clock_speed| cycles per second
+  // this is the emulated time elapsed since the system started.
   uint64_t cycle;
 
-  // The SDL window that the chip8 system is running in.
-  SDL_Window *window;
+  // The number of cycles in an emulated second, CLOCK_SPEED by default. Must
+  // be at least FRAME_RATE.
+  uint32_t clock_speed;
 
-  // The screen surface used for drawing.
-  SDL_Surface *screen_surface;
+  // How far the emulated time is into the current timer frame, in units of
+  // 1 / (|clock_speed| * FRAME_RATE) seconds. Each cycle adds FRAME_RATE, and
+  // the timers tick whenever it reaches |clock_speed|. This spaces the ticks
+  // exactly FRAME_RATE per |clock_speed| cycles even when the clock speed
+  // isn't a multiple of the frame rate.
+  uint32_t timer_phase;
+
+  // The state of the PCG32 generator which SET_RAND draws from, see
+  // chip8_seed() and next_random().
+  uint64_t rng;
+
+  // Everything above is the emulated state, saved by chip8_snapshot(). The
+  // fields below describe how the system is run and displayed.
+
+  // Indicates that a "DRAW" operation has been performed on the previous cycle
+  // and that the screen should be updated.
+  uint8_t draw_flag;
+
+  // Bit y is set when row y of the screen has changed since it was last
+  // presented, so that hosts only need to repaint those rows.
+  uint32_t dirty_rows;
+
+  // When set, SET_RAND draws from the C library's rand() as it used to instead
+  // of |rng|. rand() is shared by every system in the process, so runs are
+  // only reproducible with a single system and srand().
+  uint8_t libc_rand;
+
+  // The engine_t used by run_cycles().
+  uint8_t engine;
+
+  // Native code translated from |memory| for ENGINE_JIT. Created with
+  // jit_create() and owned by the caller, so copies of a chip8 must not share
+  // it.
+  struct jit *jit;
+
+  // The host that the chip8 system is running on, or NULL when headless.
+  const chip8_host *host;
+
+  // Cache of decoded instructions. Slot |pc / 2| holds the instruction at the
+  // even address |pc|, so that it only has to be decoded the first time it is
+  // executed.
+  //
+  // The two slots past the end of memory are for a |pc| which ran off the end
+  // (at most two instructions, e.g. a skip at 0xFFE). They decode as UNKNOWN
+  // and trap.
+  //
+  // NOTE: Any write to |memory| made outside of the instruction handlers and
+  //       load_program() must be followed by a call to invalidate_decoded().
+  decoded_instruction decoded[4096 / 2 + 2];
 } chip8;
 
+// The number of bytes saved by chip8_snapshot(): the emulated state at the
+// start of the chip8 struct.
+#define CHIP8_SNAPSHOT_SIZE offsetof(chip8, draw_flag)
+
 // Extracts the value of N from the instruction |i| in the form:
 //
 //   ___N
@@ -144,13 +283,48 @@ int load_program(const char *filename, chip8 *system);
 // Create a new chip8 struct with it's values initialized.
 chip8 initialize_chip8();
 
-// Print the contents of |system| for debugging purposes.
+// Logs the registers of |system| at debug level, see log.h.
 void print_chip8(chip8 system);
 
+// Copies the emulated state of |system| (memory, registers, stack, keys,
+// screen, timers and cycle count) into |buf|, which must hold
+// CHIP8_SNAPSHOT_SIZE bytes.
+void chip8_snapshot(const chip8 *system, void *buf);
+
+// Returns |system| to the state saved in |buf| by chip8_snapshot(). Only the
+// decoded instructions covering memory which differs from |buf| are
+// invalidated, and only the screen rows which differ are marked dirty. The
+// engine, JIT and host of |system| are kept.
+void chip8_restore(chip8 *system, const void *buf);
+
+// Returns the opcode represented by the bytes |hi| and |lo|, or UNKNOWN if they
+// don't form a valid instruction.
+opcode_t decode_opcode(uint8_t hi, uint8_t lo);
+
+// Reads and decodes the instruction at |pc|. An invalid instruction decodes
+// to UNKNOWN, which traps with TRAP_INVALID_OPCODE when executed.
 instruction get_instruction(const chip8 *system);
 
+// Returns the decoded instruction at the even address |pc|, decoding it and
+// filling its slot in |decoded| if necessary.
+const decoded_instruction *fetch_decoded(chip8 *system, uint16_t pc);
+
+// Marks the decoded instructions covering the |length| bytes of memory starting
+// at |address| as stale, so that they are decoded again on their next use.
+void invalidate_decoded(chip8 *system, uint16_t address, uint16_t length);
+
 void set_register(uint8_t vx, uint8_t val, chip8 *system);
 
+// Halts |system| with |trap| on the current instruction. Only the first trap is
+// kept.
+void raise_trap(chip8 *system, trap_t trap);
+
+// Returns a short lower case name for |trap|, e.g. "stack_overflow".
+const char *trap_name(trap_t trap);
+
+// Returns the name of |opcode| as written in opcode_t, e.g. "SET_X_NN".
+const char *opcode_name(opcode_t opcode);
+
 // Performs the CLEAR_SCREEN instruction.
 //
 // NOTE: The values in |next| are not required to perform this instruction, but
@@ -249,17 +423,30 @@ void set_i_nnn(instruction next, chip8 *system);
 // For the given instruction 0xBNNN jumps to the address of V0 + NNN.
 void jump_addr(instruction next, chip8 *system);
 
+// Seeds the random number generator of |system|. Systems with the same seed
+// draw the same random numbers. initialize_chip8() seeds with 0.
+void chip8_seed(chip8 *system, uint64_t seed);
+
+// Advances the PCG32 generator |rng| and returns its next output.
+uint32_t next_random(uint64_t *rng);
+
 // Performs the SET_RAND instruction.
-// For the given instruction 0xCXNN sets VX = rand() & NN.
-//
-// NOTE: Assumes that stdlib rand() has already been seeded.
+// For the given instruction 0xCXNN sets VX = random byte & NN. The byte comes
+// from the generator of |system|, or from rand() if |libc_rand| is set.
 void set_rand(instruction next, chip8 *system);
 
+// XORs the sprite row |row| onto screen row |y|, starting at column |x|. Sets
+// VF to 1 if a set pixel is flipped, leaving it alone otherwise. Pixels past
+// the right edge are clipped.
+void draw_row(uint8_t x, uint8_t y, uint8_t row, chip8 *system);
+
 // Performs the DRAW instruction.
 // For the given instruction 0xDXYN draws a sprite at coordinate (VX, VY) to the
 // screen.
 //
-// The sprite is 8 pixels wide and N pixels in height.
+// The sprite is 8 pixels wide and N pixels in height. The coordinate wraps
+// around the screen, while the parts of the sprite that go past the right or
+// bottom edge are clipped.
 //
 // The sprite is loaded from memory as bit-encoded rows starting from I.
 // I is unchanged by the operation.
@@ -268,6 +455,17 @@ void set_rand(instruction next, chip8 *system);
 // sprite is drawn. Otherwise, it is set to 0.
 void draw(instruction next, chip8 *system);
 
+// Returns the value (0 or 1) of the pixel at (|x|, |y|) on the screen.
+uint8_t get_pixel(const chip8 *system, uint8_t x, uint8_t y);
+
+// Hashes the screen of |system| with 64-bit FNV-1a, each row from the leftmost
+// pixel.
+uint64_t screen_hash(const chip8 *system);
+
+// Sets whether |key| (0x0 - 0xF) of the hex keypad is held down. A press ends
+// the wait of a GET_KEY instruction, see get_key().
+void set_key(chip8 *system, uint8_t key, uint8_t pressed);
+
 // Performs the IF_KEY_EQ instruction.
 // For the given instruction 0xEX9E skips the next instruction if the key
 // corresponding to the value of VX is pressed.
@@ -286,8 +484,9 @@ void get_delay(instruction next, chip8 *system);
 // For the given instruction 0xFX0A waits for a key press and stores it's value
 // in VX.
 //
-// NOTE: This is a blocking operation. All processing is halted until the next
-//       key event.
+// NOTE: The instruction doesn't block. It sets |waiting_for_key| and leaves
+//       |pc| where it is, so time keeps passing until the host reports a key
+//       press with set_key().
 void get_key(instruction next, chip8 *system);
 
 // Performs the SET_DELAY instruction.
@@ -328,15 +527,50 @@ void reg_dump(instruction next, chip8 *system);
 //   - I is not modified by the operation.
 void reg_load(instruction next, chip8 *system);
 
-void draw_screen(chip8 *system);
+// Performs |next| by dispatching on its opcode.
+void perform_instruction(instruction next, chip8 *system);
 
-void emulate_cycle(chip8 *system);
+// Finishes the current cycle: moves |pc| on to the following instruction
+// (unless the instruction jumped) and updates the cycle count and timers.
+void end_cycle(chip8 *system);
 
-void game_loop(chip8 *system);
+// Counts |cycles| cycles as elapsed without executing anything, updating the
+// timers as if that many instructions had run. Takes constant time however
+// large |cycles| is.
+void advance_cycles(chip8 *system, uint64_t cycles);
 
-// Returns a nonzero value if |keycode| represents a key on the chip8 hex
-// keypad.
-uint8_t is_chip8_key(SDL_Keycode keycode);
+void emulate_cycle(chip8 *system);
 
-// Returns the hex-key value which corresponds to |keycode|.
-uint8_t hex_keycode(SDL_Keycode keycode);
\ No newline at end of file
+// Recognizes a loop at |pc| which can't end within |cycles| cycles, or not
+// before a known cycle, and skips as many whole iterations of it as possible
+// with advance_cycles(). Returns the number of cycles skipped, leaving
+// |system| exactly as running them would have. The loops recognized are
+//
+//   1PPP              a jump to itself, which never ends
+//   EX9E or EXA1      waiting for key VX to be pressed or released, which
+//   1PPP              can't happen within a run_cycles() call
+//   FX07              waiting for the delay timer to reach NN
+//   3XNN
+//   1PPP
+//
+// where PPP is |pc|. Engines call this after jumping backwards. Does nothing
+// in profiling builds, so that the loops show up in the profile.
+uint64_t skip_idle_loop(chip8 *system, uint64_t cycles);
+
+// Runs |cycles| cycles using direct-threaded dispatch: each instruction's
+// handler jumps straight to the handler of the following instruction instead
+// of returning to a central switch. Uses computed goto when the compiler
+// supports it, and a table of handler calls otherwise.
+void run_threaded(chip8 *system, uint64_t cycles);
+
+// Runs |cycles| cycles with the engine selected by |system->engine|. While the
+// system is waiting for a key this only advances the timers, in constant time,
+// and idle loops are skipped the same way, see skip_idle_loop(). Stops early
+// if a trap is raised.
+void run_cycles(chip8 *system, uint64_t cycles);
+
+// Shows the screen through the host's present() callback if it has changed
+// since the last call, and clears |draw_flag| and |dirty_rows|.
+void present_frame(chip8 *system);
+
+#endif // CHIP8_H
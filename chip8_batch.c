@@ -0,0 +1,355 @@
+// Runs a list of ROMs headless on a pool of threads and prints one JSON object
+// per ROM with the state it finished in.
+//
+// Each line of the list is the path of a ROM, optionally followed by the number
+// of cycles to run it for:
+//
+//   roms/pong.ch8 100000
+//   roms/tetris.ch8
+//
+// The results are printed in the order of the list, e.g.
+//
+//   {"rom": "roms/pong.ch8", "budget": 100000, "cycles": 100000,
+//    "pc": 530, "trap": "none", "waiting_for_key": false,
+//    "screen_hash": "a4c1...", "wall_ns": 812345}
+//
+// (on a single line). "trap" names the trap_t which halted the ROM, in which
+// case "cycles" is less than "budget".
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "chip8.h"
+#include "jit.h"
+#include "json.h"
+#include "scheduler.h"
+
+#define DEFAULT_BUDGET 10000000
+
+typedef struct task {
+  char *rom;
+  uint64_t budget;
+
+  // Results.
+  uint8_t loaded;
+  uint64_t cycles;
+  uint16_t pc;
+  uint8_t trap;
+  uint8_t waiting_for_key;
+  uint64_t screen_hash;
+  uint64_t wall_ns;
+} task;
+
+// The tasks owned by a worker: indices [head, tail) of the task list. The
+// worker takes tasks from |head| while idle workers steal from |tail|.
+typedef struct task_deque {
+  pthread_mutex_t lock;
+  size_t head;
+  size_t tail;
+} task_deque;
+
+typedef struct pool {
+  task *tasks;
+  task_deque *deques;
+  int workers;
+  uint8_t engine;
+} pool;
+
+typedef struct worker {
+  pool *p;
+  int index;
+} worker;
+
+// Takes the next task from the worker's own deque. Returns 0 if it is empty.
+static int pop_task(task_deque *d, size_t *index) {
+  int found = 0;
+  pthread_mutex_lock(&d->lock);
+  if (d->head < d->tail) {
+    *index = d->head++;
+    found = 1;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+// Moves the back half of another worker's remaining tasks into |self|'s
+// deque. Returns 0 if every other deque is empty, which means all tasks have
+// been handed out since running a task never creates more.
+static int steal_tasks(pool *p, int self) {
+  for (int i = 1; i < p->workers; ++i) {
+    task_deque *victim = &p->deques[(self + i) % p->workers];
+
+    pthread_mutex_lock(&victim->lock);
+    size_t left = victim->tail - victim->head;
+    size_t head = victim->tail - (left + 1) / 2;
+    size_t tail = victim->tail;
+    victim->tail = head;
+    pthread_mutex_unlock(&victim->lock);
+
+    if (left > 0) {
+      task_deque *d = &p->deques[self];
+      pthread_mutex_lock(&d->lock);
+      d->head = head;
+      d->tail = tail;
+      pthread_mutex_unlock(&d->lock);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void run_task(task *t, chip8 *system, struct jit *j, uint8_t engine) {
+  uint64_t start = monotonic_ns();
+
+  *system = initialize_chip8();
+  system->engine = engine;
+  system->jit = j;
+  if (j != NULL) {
+    // Drop the translations of the previous ROM.
+    jit_invalidate(j, 0, sizeof(system->memory));
+  }
+  load_hex_fonts(system);
+  system->pc = 0x200;
+
+  if (load_program(t->rom, system) == 0) {
+    t->loaded = 1;
+    run_cycles(system, t->budget);
+    t->cycles = system->cycle;
+    t->pc = system->pc;
+    t->trap = system->trap;
+    t->waiting_for_key = system->waiting_for_key;
+    t->screen_hash = screen_hash(system);
+  }
+
+  t->wall_ns = monotonic_ns() - start;
+}
+
+static void *worker_main(void *arg) {
+  worker *w = arg;
+  pool *p = w->p;
+
+  // The chip8 struct is too large to comfortably live on the stack.
+  chip8 *system = malloc(sizeof(chip8));
+  if (system == NULL) {
+    // Leave the tasks to the other workers. Any which no worker runs are
+    // reported as failed to load.
+    fprintf(stderr, "Out of memory starting worker %d\n", w->index);
+    return NULL;
+  }
+  struct jit *j = p->engine == ENGINE_JIT ? jit_create() : NULL;
+
+  size_t index;
+  for (;;) {
+    if (!pop_task(&p->deques[w->index], &index)) {
+      if (!steal_tasks(p, w->index)) {
+        break;
+      }
+      continue;
+    }
+    run_task(&p->tasks[index], system, j, p->engine);
+  }
+
+  jit_destroy(j);
+  free(system);
+  return NULL;
+}
+
+// Runs |count| tasks on |workers| threads, starting each worker with an equal
+// share of consecutive tasks. Workers which can't be started have their tasks
+// run on the calling thread instead.
+static void run_pool(task *tasks, size_t count, int workers, uint8_t engine) {
+  pool p = {tasks, calloc(workers, sizeof(task_deque)), workers, engine};
+  worker *w = calloc(workers, sizeof(worker));
+  pthread_t *threads = calloc(workers, sizeof(pthread_t));
+  if (p.deques == NULL || w == NULL || threads == NULL) {
+    fprintf(stderr, "Out of memory starting %d workers, running on one\n",
+            workers);
+    free(threads);
+    free(w);
+    free(p.deques);
+
+    task_deque d = {PTHREAD_MUTEX_INITIALIZER, 0, count};
+    pool single = {tasks, &d, 1, engine};
+    worker only = {&single, 0};
+    worker_main(&only);
+    pthread_mutex_destroy(&d.lock);
+    return;
+  }
+
+  for (int i = 0; i < workers; ++i) {
+    pthread_mutex_init(&p.deques[i].lock, NULL);
+    p.deques[i].head = count * i / workers;
+    p.deques[i].tail = count * (i + 1) / workers;
+    w[i].p = &p;
+    w[i].index = i;
+  }
+  int started = 0;
+  for (; started < workers; ++started) {
+    int error = pthread_create(&threads[started], NULL, worker_main,
+                               &w[started]);
+    if (error != 0) {
+      fprintf(stderr, "Can't start worker %d: %s\n", started,
+              strerror(error));
+      break;
+    }
+  }
+  // The first of these steals whatever the others were left with.
+  for (int i = started; i < workers; ++i) {
+    worker_main(&w[i]);
+  }
+  for (int i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  for (int i = 0; i < workers; ++i) {
+    pthread_mutex_destroy(&p.deques[i].lock);
+  }
+
+  free(threads);
+  free(w);
+  free(p.deques);
+}
+
+static void print_result(FILE *f, const task *t) {
+  fprintf(f, "{\"rom\": ");
+  print_json_string(f, t->rom);
+  fprintf(f, ", \"budget\": %llu", (unsigned long long)t->budget);
+  if (!t->loaded) {
+    fprintf(f, ", \"error\": \"failed to load\"}\n");
+    return;
+  }
+  fprintf(f,
+          ", \"cycles\": %llu, \"pc\": %u, \"trap\": \"%s\", "
+          "\"waiting_for_key\": %s, \"screen_hash\": \"%016llx\", "
+          "\"wall_ns\": %llu}\n",
+          (unsigned long long)t->cycles, t->pc, trap_name(t->trap),
+          t->waiting_for_key ? "true" : "false",
+          (unsigned long long)t->screen_hash, (unsigned long long)t->wall_ns);
+}
+
+// Reads the ROM list from |f| into |*tasks|, storing the number of tasks in
+// |*count|. Returns a nonzero value if out of memory, with the tasks read so
+// far stored.
+static int read_tasks(FILE *f, uint64_t default_budget, task **tasks,
+                      size_t *count) {
+  size_t capacity = 0;
+  *tasks = NULL;
+  *count = 0;
+
+  char line[4096];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char rom[4096];
+    unsigned long long budget = default_budget;
+    if (sscanf(line, "%4095s %llu", rom, &budget) < 1 || rom[0] == '#') {
+      continue;
+    }
+
+    if (*count == capacity) {
+      size_t grown = capacity ? capacity * 2 : 64;
+      task *resized = realloc(*tasks, grown * sizeof(task));
+      if (resized == NULL) {
+        return 1;
+      }
+      *tasks = resized;
+      capacity = grown;
+    }
+    task *t = &(*tasks)[*count];
+    memset(t, 0, sizeof(*t));
+    t->rom = strdup(rom);
+    if (t->rom == NULL) {
+      return 1;
+    }
+    t->budget = budget;
+    ++*count;
+  }
+  return 0;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [--threads N] [--cycles N] [--engine E] [list]\n",
+          name);
+  fprintf(stderr, "  --threads N  worker threads (default: one per core)\n");
+  fprintf(stderr, "  --cycles N   cycles for ROMs without a budget (default "
+                  "%d)\n",
+          DEFAULT_BUDGET);
+  fprintf(stderr, "  --engine E   switch, threaded or jit (default jit)\n");
+  fprintf(stderr, "Reads the list of ROMs from stdin if |list| is missing.\n");
+}
+
+int main(int argc, char *argv[]) {
+  int workers = sysconf(_SC_NPROCESSORS_ONLN);
+  uint64_t budget = DEFAULT_BUDGET;
+  uint8_t engine = ENGINE_JIT;
+  const char *list = NULL;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      workers = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc) {
+      budget = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+      ++i;
+      if (strcmp(argv[i], "switch") == 0) {
+        engine = ENGINE_SWITCH;
+      } else if (strcmp(argv[i], "threaded") == 0) {
+        engine = ENGINE_THREADED;
+      } else if (strcmp(argv[i], "jit") == 0) {
+        engine = ENGINE_JIT;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+      usage(argv[0]);
+      return 1;
+    } else {
+      list = argv[i];
+    }
+  }
+  if (workers < 1) {
+    workers = 1;
+  }
+
+  FILE *f = stdin;
+  if (list != NULL && strcmp(list, "-") != 0) {
+    f = fopen(list, "r");
+    if (f == NULL) {
+      fprintf(stderr, "Failed to open file: %s\n", list);
+      return 1;
+    }
+  }
+  task *tasks;
+  size_t count;
+  int failed = read_tasks(f, budget, &tasks, &count);
+  if (f != stdin) {
+    fclose(f);
+  }
+  if (failed) {
+    fprintf(stderr, "Out of memory reading the ROM list\n");
+    for (size_t i = 0; i < count; ++i) {
+      free(tasks[i].rom);
+    }
+    free(tasks);
+    return 1;
+  }
+
+  uint64_t start = monotonic_ns();
+  run_pool(tasks, count, workers, engine);
+  double seconds = (monotonic_ns() - start) / 1e9;
+
+  uint64_t cycles = 0;
+  for (size_t i = 0; i < count; ++i) {
+    print_result(stdout, &tasks[i]);
+    cycles += tasks[i].cycles;
+    free(tasks[i].rom);
+  }
+  free(tasks);
+
+  fprintf(stderr, "%zu ROMs on %d threads in %.3f s, %.1f M cycles/s\n", count,
+          workers, seconds, seconds > 0 ? cycles / seconds / 1e6 : 0);
+  return 0;
+}
@@ -0,0 +1,685 @@
+#include "chip8.h"
+#include "expand.h"
+#include "jit.h"
+#include "json.h"
+#include "lockstep.h"
+#include "rewind.h"
+
+#ifdef CHIP8_BENCH_SDL
+#include "sdl_host.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_CYCLES 50000000
+#define BENCH_ROM_CYCLES 20000000
+#define BENCH_INSTRUCTIONS 10000000
+#define MAX_RESULTS 256
+#define BENCH_FRAMES 200000
+#define BENCH_LANES 256
+#define BENCH_SNAPSHOTS 1000000
+
+// A loop-heavy program which never draws or waits for input:
+//
+//   0x200: 6000  V0 = 0
+//   0x202: 6100  V1 = 0
+//   0x204: 6201  V2 = 1
+//   0x206: 8024  V0 += V2
+//   0x208: 8103  V1 ^= V0
+//   0x20A: A300  I = 0x300
+//   0x20C: F11E  I += V1
+//   0x20E: 3000  skip the next instruction if V0 == 0
+//   0x210: 1206  jump to 0x206
+//   0x212: 7301  V3 += 1
+//   0x214: 1206  jump to 0x206
+static const uint8_t loop_program[] = {
+    0x60, 0x00, 0x61, 0x00, 0x62, 0x01, 0x80, 0x24, 0x81, 0x03, 0xA3,
+    0x00, 0xF1, 0x1E, 0x30, 0x00, 0x12, 0x06, 0x73, 0x01, 0x12, 0x06,
+};
+
+// A measurement, collected for the report written with --json.
+typedef struct bench_result {
+  char name[128];
+  double value;
+  const char *unit;
+} bench_result;
+
+static bench_result results[MAX_RESULTS];
+static int result_count;
+
+// Records |value|, measured in |unit|, under |name| for the JSON report.
+static void record(const char *name, double value, const char *unit) {
+  if (result_count < MAX_RESULTS) {
+    bench_result *r = &results[result_count++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->value = value;
+    r->unit = unit;
+  }
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void load_loop_program(chip8 *system) {
+  *system = initialize_chip8();
+  memcpy(system->memory + 0x200, loop_program, sizeof(loop_program));
+  system->pc = 0x200;
+}
+
+// Emulates a cycle the way emulate_cycle() did before the decode cache, by
+// decoding the instruction at |pc| every time.
+static void emulate_cycle_uncached(chip8 *system) {
+  instruction next = get_instruction(system);
+  if (system->skip) {
+    system->skip = 0;
+  } else {
+    perform_instruction(next, system);
+  }
+  end_cycle(system);
+}
+
+// Runs |cycles| cycles of the loop program with |cycle_fn| and returns the
+// number of instructions emulated per second.
+static double run(void (*cycle_fn)(chip8 *), uint64_t cycles, chip8 *system) {
+  load_loop_program(system);
+
+  uint64_t start = now_ns();
+  for (uint64_t i = 0; i < cycles; ++i) {
+    cycle_fn(system);
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  return cycles / (elapsed / 1e9);
+}
+
+static void run_threaded_engine(chip8 *system, uint64_t cycles) {
+  system->engine = ENGINE_THREADED;
+  run_cycles(system, cycles);
+}
+
+static void run_jit_engine(chip8 *system, uint64_t cycles) {
+  system->engine = ENGINE_JIT;
+  system->jit = jit_create();
+  run_cycles(system, cycles);
+  jit_destroy(system->jit);
+  system->jit = NULL;
+}
+
+// Like run(), but hands all |cycles| to |engine_fn| at once.
+static double run_engine(void (*engine_fn)(chip8 *, uint64_t), uint64_t cycles,
+                         chip8 *system) {
+  load_loop_program(system);
+
+  uint64_t start = now_ns();
+  engine_fn(system, cycles);
+  uint64_t elapsed = now_ns() - start;
+
+  return cycles / (elapsed / 1e9);
+}
+
+// Drains the host's event queue, as the SDL frontend does between batches of
+// instructions. Only does anything when built with CHIP8_BENCH_SDL.
+static void poll_events() {
+#ifdef CHIP8_BENCH_SDL
+  SDL_Event event;
+  while (SDL_PollEvent(&event) > 0)
+    ;
+#endif
+}
+
+// Runs |cycles| cycles of the loop program on |engine|, polling for events and
+// calling run_cycles() every |batch| cycles, and returns the number of
+// instructions emulated per second.
+static double run_batched(uint8_t engine, uint64_t batch, uint64_t cycles,
+                          chip8 *system) {
+  load_loop_program(system);
+  system->engine = engine;
+  if (engine == ENGINE_JIT) {
+    system->jit = jit_create();
+  }
+
+  uint64_t start = now_ns();
+  for (uint64_t i = 0; i < cycles; i += batch) {
+    poll_events();
+    run_cycles(system, batch);
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  jit_destroy(system->jit);
+  system->jit = NULL;
+  return cycles / (elapsed / 1e9);
+}
+
+// The chip8 struct is too large to comfortably live on the stack.
+static chip8 system;
+
+// Fills |system|'s screen with a pattern of set and unset pixels.
+static void fill_screen(chip8 *system) {
+  for (int y = 0; y < DISPLAY_HEIGHT; ++y) {
+    system->screen[y] = 0xF0F0CCCC0FF05555ull * (y + 1);
+  }
+}
+
+// Expands the screen |frames| times with |kernel| and returns the number of
+// pixels expanded per second.
+static double run_expand(expand_fn kernel, uint64_t frames,
+                         const chip8 *system) {
+  static uint32_t pixels[DISPLAY_WIDTH * DISPLAY_HEIGHT];
+
+  uint64_t start = now_ns();
+  for (uint64_t i = 0; i < frames; ++i) {
+    kernel(system->screen, pixels, DISPLAY_WIDTH, 0xFFFFFFFF, 0xFF000000);
+    // Keep the compiler from hoisting the expansion out of the loop.
+    __asm__ volatile("" : : "r"(pixels) : "memory");
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  return frames * DISPLAY_WIDTH * DISPLAY_HEIGHT / (elapsed / 1e9);
+}
+
+#ifdef CHIP8_BENCH_SDL
+// Draws the screen |frames| times with the rect-based draw_screen() onto an
+// offscreen surface the size of the window, and returns the number of chip8
+// pixels drawn per second.
+static double run_rects(uint64_t frames, const chip8 *system) {
+  SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormat(
+      0, SCREEN_WIDTH, SCREEN_HEIGHT, 32, SDL_PIXELFORMAT_ARGB8888);
+
+  uint64_t start = now_ns();
+  for (uint64_t i = 0; i < frames; ++i) {
+    draw_screen(system, surface);
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  SDL_FreeSurface(surface);
+  return frames * DISPLAY_WIDTH * DISPLAY_HEIGHT / (elapsed / 1e9);
+}
+#endif
+
+// Prints and records the throughput of the expansion kernel |name|, which
+// expanded |pixels| pixels/s, against the scalar kernel's |scalar| pixels/s
+// and draw_screen()'s |rects|, each unless 0.
+static void report_kernel(const char *name, double pixels, double scalar,
+                          double rects) {
+  char label[32];
+  snprintf(label, sizeof(label), "expand %s:", name);
+  printf("%-18s%.1f M pixels/s", label, pixels / 1e6);
+  const char *separator = " (";
+  if (scalar > 0) {
+    printf("%s%.2fx scalar", separator, pixels / scalar);
+    separator = ", ";
+  }
+  if (rects > 0) {
+    printf("%s%.1fx draw_screen", separator, pixels / rects);
+    separator = ", ";
+  }
+  printf("%s\n", separator[0] == ',' ? ")" : "");
+
+  char key[64];
+  snprintf(key, sizeof(key), "expand.%s", name);
+  record(key, pixels, "pixels/s");
+  if (rects > 0) {
+    snprintf(key, sizeof(key), "expand.%s.vs_draw_screen", name);
+    record(key, pixels / rects, "x");
+  }
+}
+
+static void bench_expand() {
+  fill_screen(&system);
+
+  // The rect-based path the kernels replace, if built with SDL.
+  double rects = 0;
+#ifdef CHIP8_BENCH_SDL
+  // Far fewer frames, each one takes a lot longer.
+  rects = run_rects(BENCH_FRAMES / 100, &system);
+  printf("draw_screen:      %.1f M pixels/s\n", rects / 1e6);
+  record("draw_screen", rects, "pixels/s");
+#endif
+
+  double scalar = run_expand(expand_screen_scalar, BENCH_FRAMES, &system);
+  report_kernel("scalar", scalar, 0, rects);
+
+#if defined(__x86_64__) || defined(__i386__)
+  double sse2 = run_expand(expand_screen_sse2, BENCH_FRAMES, &system);
+  report_kernel("sse2", sse2, scalar, rects);
+
+  if (__builtin_cpu_supports("avx2")) {
+    double avx2 = run_expand(expand_screen_avx2, BENCH_FRAMES, &system);
+    report_kernel("avx2", avx2, scalar, rects);
+  }
+#endif
+}
+
+static int bench_engines() {
+  double uncached = run(emulate_cycle_uncached, BENCH_CYCLES, &system);
+  uint8_t v3 = system.V[3];
+
+  double cached = run(emulate_cycle, BENCH_CYCLES, &system);
+  if (system.V[3] != v3) {
+    fprintf(stderr, "Decoded and uncached runs disagree!\n");
+    return 1;
+  }
+
+  double threaded = run_engine(run_threaded_engine, BENCH_CYCLES, &system);
+  if (system.V[3] != v3) {
+    fprintf(stderr, "Threaded and uncached runs disagree!\n");
+    return 1;
+  }
+
+  double jitted = run_engine(run_jit_engine, BENCH_CYCLES, &system);
+  if (system.V[3] != v3) {
+    fprintf(stderr, "JIT and uncached runs disagree!\n");
+    return 1;
+  }
+
+  printf("get_instruction:  %.1f M instructions/s\n", uncached / 1e6);
+  printf("decode cache:     %.1f M instructions/s (%.2fx)\n", cached / 1e6,
+         cached / uncached);
+  printf("threaded:         %.1f M instructions/s (%.2fx)\n", threaded / 1e6,
+         threaded / uncached);
+  printf("jit:              %.1f M instructions/s (%.2fx)\n", jitted / 1e6,
+         jitted / uncached);
+  printf("emulate_cycle:    %.2f ns/instruction\n", 1e9 / cached);
+
+  record("engine.uncached", uncached, "instructions/s");
+  record("engine.switch", cached, "instructions/s");
+  record("engine.threaded", threaded, "instructions/s");
+  record("engine.jit", jitted, "instructions/s");
+  record("emulate_cycle", 1e9 / cached, "ns/instruction");
+  return 0;
+}
+
+// Compares polling for input before every instruction with polling once per
+// frame's worth of instructions at CLOCK_SPEED.
+static void bench_batching() {
+#ifdef CHIP8_BENCH_SDL
+  SDL_Init(SDL_INIT_EVENTS);
+#endif
+  uint64_t frame = CLOCK_SPEED / FRAME_RATE;
+  uint64_t cycles = BENCH_CYCLES / frame * frame;
+
+  const char *names[] = {"switch", "threaded", "jit"};
+  for (uint8_t engine = ENGINE_SWITCH; engine <= ENGINE_JIT; ++engine) {
+    double stepped = run_batched(engine, 1, cycles, &system);
+    double batched = run_batched(engine, frame, cycles, &system);
+    printf("%-8s per instruction: %.1f M instructions/s, per frame: %.1f M "
+           "instructions/s (%.2fx)\n",
+           names[engine], stepped / 1e6, batched / 1e6, batched / stepped);
+
+    char name[64];
+    snprintf(name, sizeof(name), "batching.%s.per_instruction", names[engine]);
+    record(name, stepped, "instructions/s");
+    snprintf(name, sizeof(name), "batching.%s.per_frame", names[engine]);
+    record(name, batched, "instructions/s");
+  }
+#ifdef CHIP8_BENCH_SDL
+  SDL_Quit();
+#endif
+}
+
+// Runs |cycles| cycles of the loop program in each of BENCH_LANES lanes of a
+// lockstep engine and returns the total number of instructions emulated per
+// second. Each lane starts with a different V3.
+static double run_lockstep(uint8_t simd, uint64_t cycles, uint8_t *v3) {
+  lockstep *ls = lockstep_create(BENCH_LANES);
+  lockstep_set_simd(ls, simd);
+  for (uint32_t lane = 0; lane < BENCH_LANES; ++lane) {
+    load_loop_program(&system);
+    system.V[3] = lane;
+    lockstep_set_lane(ls, lane, &system);
+  }
+
+  uint64_t start = now_ns();
+  lockstep_run(ls, cycles);
+  uint64_t elapsed = now_ns() - start;
+
+  system = initialize_chip8();
+  lockstep_get_lane(ls, BENCH_LANES - 1, &system);
+  *v3 = system.V[3];
+  lockstep_destroy(ls);
+  return cycles * BENCH_LANES / (elapsed / 1e9);
+}
+
+// Like run_lockstep(), but with BENCH_LANES independent systems each running
+// emulate_cycle() in turn.
+static double run_independent(uint64_t cycles, uint8_t *v3) {
+  static chip8 systems[BENCH_LANES];
+  for (uint32_t lane = 0; lane < BENCH_LANES; ++lane) {
+    load_loop_program(&systems[lane]);
+    systems[lane].V[3] = lane;
+  }
+
+  uint64_t start = now_ns();
+  for (uint32_t lane = 0; lane < BENCH_LANES; ++lane) {
+    for (uint64_t i = 0; i < cycles; ++i) {
+      emulate_cycle(&systems[lane]);
+    }
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  *v3 = systems[BENCH_LANES - 1].V[3];
+  return cycles * BENCH_LANES / (elapsed / 1e9);
+}
+
+// Compares the aggregate speed of many systems run in lockstep with running
+// them one after another.
+static int bench_lockstep() {
+  uint64_t cycles = BENCH_CYCLES / BENCH_LANES;
+  uint8_t independent_v3, scalar_v3, simd_v3;
+
+  double independent = run_independent(cycles, &independent_v3);
+  double scalar = run_lockstep(0, cycles, &scalar_v3);
+  double simd = run_lockstep(1, cycles, &simd_v3);
+  if (scalar_v3 != independent_v3 || simd_v3 != independent_v3) {
+    fprintf(stderr, "Lockstep and independent runs disagree!\n");
+    return 1;
+  }
+
+  printf("%d independent systems: %.1f M instructions/s\n", BENCH_LANES,
+         independent / 1e6);
+  printf("%d lockstep lanes:      %.1f M instructions/s (%.2fx) per lane, "
+         "%.1f M instructions/s (%.2fx) AVX2\n",
+         BENCH_LANES, scalar / 1e6, scalar / independent, simd / 1e6,
+         simd / independent);
+  record("lockstep.independent", independent, "instructions/s");
+  record("lockstep.scalar", scalar, "instructions/s");
+  record("lockstep.avx2", simd, "instructions/s");
+  return 0;
+}
+
+// Measures chip8_snapshot() and chip8_restore() on a running system, restoring
+// both an unchanged snapshot and one which differs in a byte of code.
+static void bench_snapshot() {
+  static uint8_t snapshot[CHIP8_SNAPSHOT_SIZE];
+  load_loop_program(&system);
+  run_cycles(&system, 1000);
+
+  uint64_t start = now_ns();
+  for (int i = 0; i < BENCH_SNAPSHOTS; ++i) {
+    chip8_snapshot(&system, snapshot);
+    // Keep the copy from being optimized out.
+    __asm__ volatile("" : : "r"(snapshot) : "memory");
+  }
+  double saving = (now_ns() - start) / (double)BENCH_SNAPSHOTS;
+
+  start = now_ns();
+  for (int i = 0; i < BENCH_SNAPSHOTS; ++i) {
+    chip8_restore(&system, snapshot);
+    __asm__ volatile("" : : "r"(&system) : "memory");
+  }
+  double unchanged = (now_ns() - start) / (double)BENCH_SNAPSHOTS;
+
+  start = now_ns();
+  for (int i = 0; i < BENCH_SNAPSHOTS; ++i) {
+    snapshot[offsetof(chip8, memory) + 0x213] = i & 1;
+    chip8_restore(&system, snapshot);
+    __asm__ volatile("" : : "r"(&system) : "memory");
+  }
+  double changed = (now_ns() - start) / (double)BENCH_SNAPSHOTS;
+
+  printf("snapshot: %.1f ns (%zu bytes), restore: %.1f ns unchanged, "
+         "%.1f ns with new code\n",
+         saving, CHIP8_SNAPSHOT_SIZE, unchanged, changed);
+  record("snapshot", saving, "ns");
+  record("restore.unchanged", unchanged, "ns");
+  record("restore.changed", changed, "ns");
+}
+
+// Measures recording a frame into a rewind buffer holding 60 seconds, while
+// running the loop program at CLOCK_SPEED.
+static void bench_rewind() {
+  uint32_t frames = 60 * FRAME_RATE;
+  uint64_t cycles_per_frame = CLOCK_SPEED / FRAME_RATE;
+  rewind_buffer r;
+  if (rewind_init(&r, 4 << 20, frames, FRAME_RATE)) {
+    return;
+  }
+  load_loop_program(&system);
+
+  uint64_t recording = 0;
+  uint64_t encoded = 0;
+  for (uint32_t frame = 0; frame < frames; ++frame) {
+    run_cycles(&system, cycles_per_frame);
+    uint64_t start = now_ns();
+    size_t used = r.used;
+    rewind_record(&r, &system);
+    recording += now_ns() - start;
+    encoded += r.used - used;
+  }
+
+  double per_frame = recording / (double)frames;
+  printf("rewind: %.2f us per frame (%.3f%% of a frame), %.1f bytes per frame, "
+         "%zu bytes for %u frames\n",
+         per_frame / 1e3, per_frame * FRAME_RATE / 1e7,
+         encoded / (double)frames, r.used, r.count);
+  record("rewind.record", per_frame, "ns");
+  record("rewind.frame_size", encoded / (double)frames, "bytes");
+  rewind_destroy(&r);
+}
+
+// The instructions of each class measured by bench_instructions(). Each list
+// can be performed over and over: it leaves the stack, I and the registers it
+// reads as it found them.
+typedef struct instruction_class {
+  const char *name;
+  uint16_t code[12];
+  int length;
+} instruction_class;
+
+static const instruction_class instruction_classes[] = {
+    {"flow", {0x2300, 0x00EE, 0x1200}, 3},
+    {"skip", {0x3001, 0x4001, 0x5010, 0x9010, 0xE09E, 0xE0A1}, 6},
+    {"alu",
+     {0x6A05, 0x7A03, 0x8A14, 0x8B25, 0x8C06, 0x8D0E, 0x8E17, 0x8A01,
+      0x8B12, 0x8C03},
+     10},
+    {"memory", {0xA300, 0xF01E, 0xF033, 0xF355, 0xF365, 0xF029}, 6},
+    {"timers", {0xF015, 0xF207, 0xF018}, 3},
+    {"rand", {0xC2FF}, 1},
+    {"draw", {0xA300, 0xD01F}, 2},
+};
+
+// Performs the instructions of |class| BENCH_INSTRUCTIONS times in total with
+// perform_instruction() and returns the time per instruction in nanoseconds.
+static double run_class(const instruction_class *class) {
+  instruction code[12];
+  for (int i = 0; i < class->length; ++i) {
+    code[i].hi = class->code[i] >> 8;
+    code[i].lo = class->code[i] & 0xFF;
+    code[i].opcode = decode_opcode(code[i].hi, code[i].lo);
+  }
+
+  system = initialize_chip8();
+  load_hex_fonts(&system);
+  system.pc = 0x200;
+  system.I = 0x300;
+  system.V[0] = 1;
+  system.V[1] = 2;
+  // Give DRAW a sprite with pixels to flip.
+  memset(system.memory + 0x300, 0xA5, 16);
+
+  uint64_t rounds = BENCH_INSTRUCTIONS / class->length;
+  uint64_t start = now_ns();
+  for (uint64_t i = 0; i < rounds; ++i) {
+    for (int j = 0; j < class->length; ++j) {
+      perform_instruction(code[j], &system);
+    }
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  return elapsed / (double)(rounds * class->length);
+}
+
+// Measures fetching and decoding instructions, performing each class of
+// instruction, and drawing.
+static void bench_instructions() {
+  // Fill memory with arbitrary instructions to decode.
+  system = initialize_chip8();
+  for (uint32_t i = 0; i < sizeof(system.memory); ++i) {
+    system.memory[i] = i * 0x9E37 >> 8;
+  }
+  uint64_t start = now_ns();
+  uint32_t sum = 0;
+  for (uint64_t i = 0; i < BENCH_INSTRUCTIONS; ++i) {
+    system.pc = i * 2 % (sizeof(system.memory) - 2);
+    sum += get_instruction(&system).opcode;
+  }
+  double fetch = (now_ns() - start) / (double)BENCH_INSTRUCTIONS;
+  // Keep the loop from being optimized out.
+  __asm__ volatile("" : : "r"(sum));
+  printf("get_instruction:  %.2f ns\n", fetch);
+  record("get_instruction", fetch, "ns");
+
+  size_t classes = sizeof(instruction_classes) / sizeof(instruction_classes[0]);
+  for (size_t i = 0; i < classes; ++i) {
+    double ns = run_class(&instruction_classes[i]);
+    char name[64];
+    snprintf(name, sizeof(name), "perform_instruction.%s",
+             instruction_classes[i].name);
+    printf("%-26s %.2f ns/instruction\n", name, ns);
+    record(name, ns, "ns/instruction");
+  }
+
+  system = initialize_chip8();
+  start = now_ns();
+  for (uint64_t i = 0; i < BENCH_INSTRUCTIONS; ++i) {
+    draw_row(i % DISPLAY_WIDTH, i % DISPLAY_HEIGHT, i, &system);
+  }
+  double row = (now_ns() - start) / (double)BENCH_INSTRUCTIONS;
+  printf("draw_row:         %.2f ns\n", row);
+  record("draw_row", row, "ns");
+}
+
+// Runs |rom| headless on each engine for |cycles| cycles, a frame at a time
+// like the SDL frontend, and reports its throughput. A key is tapped whenever
+// the ROM waits for one, so that it keeps running.
+static void bench_rom(const char *rom, uint64_t cycles) {
+  const char *names[] = {"switch", "threaded", "jit"};
+  const char *base = strrchr(rom, '/') ? strrchr(rom, '/') + 1 : rom;
+  uint64_t frame = CLOCK_SPEED / FRAME_RATE;
+
+  for (uint8_t engine = ENGINE_SWITCH; engine <= ENGINE_JIT; ++engine) {
+    system = initialize_chip8();
+    load_hex_fonts(&system);
+    system.pc = 0x200;
+    system.engine = engine;
+    if (load_program(rom, &system)) {
+      return;
+    }
+    if (engine == ENGINE_JIT) {
+      system.jit = jit_create();
+    }
+
+    uint64_t start = now_ns();
+    for (uint64_t done = 0; done < cycles && !system.trap; done += frame) {
+      if (system.waiting_for_key) {
+        set_key(&system, 5, 1);
+      } else if (system.keys[5]) {
+        set_key(&system, 5, 0);
+      }
+      run_cycles(&system, frame);
+      present_frame(&system);
+    }
+    double seconds = (now_ns() - start) / 1e9;
+    jit_destroy(system.jit);
+    system.jit = NULL;
+
+    double ips = system.cycle / seconds;
+    double fps = ips / frame;
+    printf("%s %-8s %.1f M instructions/s, %.0f frames/s, %.2f "
+           "ns/instruction%s\n",
+           base, names[engine], ips / 1e6, fps, 1e9 / ips,
+           system.trap ? " (trapped)" : "");
+
+    char name[128];
+    snprintf(name, sizeof(name), "rom.%s.%s.instructions_per_s", base,
+             names[engine]);
+    record(name, ips, "instructions/s");
+    snprintf(name, sizeof(name), "rom.%s.%s.frames_per_s", base,
+             names[engine]);
+    record(name, fps, "frames/s");
+    snprintf(name, sizeof(name), "rom.%s.%s.ns_per_instruction", base,
+             names[engine]);
+    record(name, 1e9 / ips, "ns/instruction");
+  }
+}
+
+// Writes the recorded results to |filename| as a JSON object:
+//
+//   {"compiler": "13.2.0", "results": [
+//     {"name": "engine.jit", "value": 1.2e9, "unit": "instructions/s"}, ...]}
+static int write_json(const char *filename) {
+  FILE *f = fopen(filename, "w");
+  if (f == NULL) {
+    fprintf(stderr, "Failed to open file: %s\n", filename);
+    return 1;
+  }
+
+  fprintf(f, "{\"compiler\": \"%s\", \"results\": [", __VERSION__);
+  for (int i = 0; i < result_count; ++i) {
+    // ROM file names end up in the names, so escape them.
+    fprintf(f, "%s\n  {\"name\": ", i ? "," : "");
+    print_json_string(f, results[i].name);
+    fprintf(f, ", \"value\": %.6g, \"unit\": ", results[i].value);
+    print_json_string(f, results[i].unit);
+    fputc('}', f);
+  }
+  fprintf(f, "\n]}\n");
+  return fclose(f) != 0;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [--json F] [--cycles N] [rom ...]\n", name);
+  fprintf(stderr, "  --json F    also write the results to F as JSON\n");
+  fprintf(stderr, "  --cycles N  cycles to run each ROM for (default %d)\n",
+          BENCH_ROM_CYCLES);
+}
+
+int main(int argc, char *argv[]) {
+  const char *json = NULL;
+  unsigned long long rom_cycles = BENCH_ROM_CYCLES;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+      json = argv[++i];
+    } else if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc) {
+      if (sscanf(argv[++i], "%llu", &rom_cycles) != 1) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (bench_engines()) {
+    return 1;
+  }
+  bench_expand();
+  bench_batching();
+  if (bench_lockstep()) {
+    return 1;
+  }
+  bench_snapshot();
+  bench_rewind();
+  bench_instructions();
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--json") == 0 || strcmp(argv[i], "--cycles") == 0) {
+      ++i;
+    } else {
+      bench_rom(argv[i], rom_cycles);
+    }
+  }
+
+  if (json != NULL) {
+    return write_json(json);
+  }
+  return 0;
+}
@@ -0,0 +1,183 @@
+// Replays a movie recorded with --record headless, as fast as possible, and
+// prints the state the session finished in as a JSON object, e.g.
+//
+//   {"movie": "bug.c8mv", "rom": "pong.ch8", "cycles": 5400000, "pc": 530,
+//    "trap": "none", "screen_hash": "a4c1...", "wall_ns": 25123456}
+//
+// (on a single line). With --repeat N the movie is played N times, and the
+// player fails if any run finishes differently from the first.
+//
+// Built with -DCHIP8_PROFILE, the player also prints the profile of the runs
+// (see profile.h) and can write their call stacks for flame graphs.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "jit.h"
+#include "json.h"
+#include "movie.h"
+#include "profile.h"
+#include "scheduler.h"
+
+// The state a replay finished in.
+typedef struct result {
+  uint64_t cycles;
+  uint16_t pc;
+  uint8_t trap;
+  uint64_t screen_hash;
+} result;
+
+// Replays |m| on a fresh system running |rom|. Returns a nonzero value if the
+// ROM can't be loaded or doesn't match.
+static int play(const movie *m, const char *rom, uint8_t engine, struct jit *j,
+                chip8 *system, result *r) {
+  *system = initialize_chip8();
+  system->engine = engine;
+  system->jit = j;
+  if (j != NULL) {
+    // Drop the translations of the previous run.
+    jit_invalidate(j, 0, sizeof(system->memory));
+  }
+  load_hex_fonts(system);
+  system->pc = 0x200;
+  if (load_program(rom, system) || movie_play(m, system)) {
+    return 1;
+  }
+
+  r->cycles = system->cycle;
+  r->pc = system->pc;
+  r->trap = system->trap;
+  r->screen_hash = screen_hash(system);
+  return 0;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [--engine E] [--repeat N] movie rom\n", name);
+  fprintf(stderr, "  --engine E  switch, threaded or jit (default jit)\n");
+  fprintf(stderr, "  --repeat N  play the movie N times and check that every "
+                  "run matches\n");
+#ifdef CHIP8_PROFILE
+  fprintf(stderr, "  --folded F  write the call stacks executed to F, for "
+                  "flame graphs\n");
+#endif
+}
+
+int main(int argc, char *argv[]) {
+  uint8_t engine = ENGINE_JIT;
+  uint64_t repeat = 1;
+  const char *files[2];
+  int nfiles = 0;
+#ifdef CHIP8_PROFILE
+  const char *folded = NULL;
+#endif
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+      ++i;
+      if (strcmp(argv[i], "switch") == 0) {
+        engine = ENGINE_SWITCH;
+      } else if (strcmp(argv[i], "threaded") == 0) {
+        engine = ENGINE_THREADED;
+      } else if (strcmp(argv[i], "jit") == 0) {
+        engine = ENGINE_JIT;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+      repeat = strtoull(argv[++i], NULL, 10);
+#ifdef CHIP8_PROFILE
+    } else if (strcmp(argv[i], "--folded") == 0 && i + 1 < argc) {
+      folded = argv[++i];
+#endif
+    } else if (argv[i][0] == '-' || nfiles == 2) {
+      usage(argv[0]);
+      return 1;
+    } else {
+      files[nfiles++] = argv[i];
+    }
+  }
+  if (nfiles != 2 || repeat == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+#ifdef CHIP8_PROFILE
+  profile_install();
+#endif
+
+  movie m;
+  if (movie_load(&m, files[0])) {
+    return 1;
+  }
+
+  // The chip8 struct is too large to comfortably live on the stack.
+  chip8 *system = malloc(sizeof(chip8));
+  if (system == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    movie_destroy(&m);
+    return 1;
+  }
+  struct jit *j = engine == ENGINE_JIT ? jit_create() : NULL;
+  int status = 0;
+
+  result first;
+  uint64_t start = monotonic_ns();
+  for (uint64_t i = 0; i < repeat; ++i) {
+    result r;
+    if (play(&m, files[1], engine, j, system, &r)) {
+      status = 1;
+      break;
+    }
+    if (i == 0) {
+      first = r;
+    } else if (r.cycles != first.cycles || r.pc != first.pc ||
+               r.trap != first.trap || r.screen_hash != first.screen_hash) {
+      fprintf(stderr, "Run %llu finished differently from the first.\n",
+              (unsigned long long)i + 1);
+      status = 1;
+      break;
+    }
+  }
+  uint64_t wall_ns = monotonic_ns() - start;
+
+  if (status == 0) {
+    printf("{\"movie\": ");
+    print_json_string(stdout, files[0]);
+    printf(", \"rom\": ");
+    print_json_string(stdout, files[1]);
+    printf(", \"cycles\": %llu, \"pc\": %u, \"trap\": \"%s\", "
+           "\"screen_hash\": \"%016llx\", \"wall_ns\": %llu}\n",
+           (unsigned long long)first.cycles, first.pc, trap_name(first.trap),
+           (unsigned long long)first.screen_hash, (unsigned long long)wall_ns);
+
+    // The emulated time of all runs against the wall clock.
+    double seconds = wall_ns / 1e9;
+    double emulated = (double)first.cycles * repeat / m.clock_speed;
+    fprintf(stderr, "%llu runs in %.3f s, %.0fx real time\n",
+            (unsigned long long)repeat, seconds,
+            seconds > 0 ? emulated / seconds : 0);
+  }
+
+#ifdef CHIP8_PROFILE
+  profile_dump(stderr, status == 0 ? system : NULL);
+  if (folded != NULL) {
+    FILE *f = fopen(folded, "w");
+    if (f == NULL) {
+      fprintf(stderr, "Failed to open file: %s\n", folded);
+      status = 1;
+    } else {
+      profile_write_folded(f);
+      fclose(f);
+    }
+  }
+#endif
+
+  jit_destroy(j);
+  free(system);
+  movie_destroy(&m);
+  return status;
+}
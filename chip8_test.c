@@ -1,9 +1,22 @@
 #include "chip8.h"
+#include "expand.h"
+#include "input_queue.h"
+#include "jit.h"
+#include "lockstep.h"
+#include "log.h"
+#include "movie.h"
+#include "profile.h"
+#include "rewind.h"
+#include "tone.h"
+#include "triple_buffer.h"
 
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 void test_n() {
   instruction i;
@@ -53,7 +66,7 @@ void test_clear_screen() {
   clear_screen(next, &system);
 
   uint8_t not_cleared = 0;
-  for (int i = 0; i < sizeof(system.screen); ++i) {
+  for (int i = 0; i < DISPLAY_HEIGHT; ++i) {
     if (system.screen[i] != 0) {
       not_cleared = 1;
     }
@@ -400,8 +413,9 @@ void test_draw() {
   // Verify the expected screen state.
   for (int i = 0; i < 8; ++i) {
     for (int j = 0; j < 8; ++j) {
-      assert(system.screen[i * 64 + j] == 1);
+      assert(get_pixel(&system, j, i) == 1);
     }
+    assert(get_pixel(&system, 8, i) == 0);
   }
   // We expect that VF is 0 since no set pixels were flipped by the draw.
   assert(system.V[0x0F] == 0);
@@ -411,24 +425,138 @@ void test_draw() {
   system.V[1] = 20;
   // Explitly set this pixel on the screen before the draw. We expect it will be
   // flipped by the draw operation and the carry flag will be set.
-  system.screen[16 + 64 * 20] = 1;
+  system.screen[20] |= 1ull << (63 - 16);
 
   draw(next, &system);
 
   // Verify the expected screen state.
-  assert(system.screen[16 + 64 * 20] == 0);
-  assert(system.screen[17 + 64 * 20] == 1);
-  assert(system.screen[18 + 64 * 20] == 1);
-  assert(system.screen[19 + 64 * 20] == 1);
-  assert(system.screen[20 + 64 * 20] == 1);
-  assert(system.screen[21 + 64 * 20] == 1);
-  assert(system.screen[22 + 64 * 20] == 1);
-  assert(system.screen[23 + 64 * 20] == 1);
+  assert(get_pixel(&system, 16, 20) == 0);
+  assert(get_pixel(&system, 17, 20) == 1);
+  assert(get_pixel(&system, 18, 20) == 1);
+  assert(get_pixel(&system, 19, 20) == 1);
+  assert(get_pixel(&system, 20, 20) == 1);
+  assert(get_pixel(&system, 21, 20) == 1);
+  assert(get_pixel(&system, 22, 20) == 1);
+  assert(get_pixel(&system, 23, 20) == 1);
 
   // We expect that VF is 1 since a set pixel was flipped by the draw.
   assert(system.V[0x0F] == 1);
 }
 
+void test_draw_edges() {
+  // Setup |next| to represent the DRAW operation (0xDXYN), drawing an 8x4
+  // sprite.
+  instruction next;
+  next.hi = 0xD0;
+  next.lo = 0x14;
+
+  chip8 system = initialize_chip8();
+  for (int i = 0; i < 4; ++i) {
+    system.memory[i] = 0xFF;
+  }
+
+  // A sprite in the bottom right corner is clipped at both edges.
+  system.V[0] = 60;
+  system.V[1] = 30;
+  draw(next, &system);
+  for (int x = 56; x < 64; ++x) {
+    assert(get_pixel(&system, x, 29) == 0);
+    assert(get_pixel(&system, x, 30) == (x >= 60));
+    assert(get_pixel(&system, x, 31) == (x >= 60));
+  }
+  // Nothing wraps around to the other side.
+  for (int y = 0; y < DISPLAY_HEIGHT - 2; ++y) {
+    assert(system.screen[y] == 0);
+  }
+  assert(system.V[0x0F] == 0);
+
+  // Coordinates past the edges wrap around, so this draws at (2, 1).
+  system.V[0] = 64 + 2;
+  system.V[1] = 32 + 1;
+  draw(next, &system);
+  for (int y = 1; y < 5; ++y) {
+    assert(system.screen[y] == 0xFFull << (56 - 2));
+  }
+  assert(system.V[0x0F] == 0);
+
+  // Drawing the same sprite again erases it and sets VF.
+  draw(next, &system);
+  for (int y = 1; y < 5; ++y) {
+    assert(system.screen[y] == 0);
+  }
+  assert(system.V[0x0F] == 1);
+}
+
+void test_dirty_rows() {
+  chip8 system = initialize_chip8();
+  system.memory[0] = 0xFF;
+  system.memory[1] = 0x00;
+  system.memory[2] = 0x81;
+
+  // Draw a 3 row sprite at (4, 10). Its middle row is empty, so it doesn't
+  // change row 11.
+  instruction next;
+  next.hi = 0xD0;
+  next.lo = 0x13;
+  system.V[0] = 4;
+  system.V[1] = 10;
+  draw(next, &system);
+  assert(system.draw_flag == 1);
+  assert(system.dirty_rows == ((1u << 10) | (1u << 12)));
+
+  // Presenting the frame resets the dirty rows.
+  present_frame(&system);
+  assert(system.draw_flag == 0);
+  assert(system.dirty_rows == 0);
+
+  // Clearing the screen only changes the rows that had pixels set.
+  next.hi = 0x00;
+  next.lo = 0xE0;
+  clear_screen(next, &system);
+  assert(system.draw_flag == 1);
+  assert(system.dirty_rows == ((1u << 10) | (1u << 12)));
+
+  present_frame(&system);
+  clear_screen(next, &system);
+  assert(system.draw_flag == 0);
+  assert(system.dirty_rows == 0);
+}
+
+// Checks that |kernel| expands the screen of |system| pixel for pixel.
+void check_expand_kernel(expand_fn kernel, const chip8 *system) {
+  // Use a pitch wider than the screen to check that rows are placed right.
+  static uint32_t pixels[DISPLAY_HEIGHT][DISPLAY_WIDTH + 3];
+  memset(pixels, 0, sizeof(pixels));
+
+  kernel(system->screen, &pixels[0][0], DISPLAY_WIDTH + 3, 0xFFFFFFFF,
+         0xFF000000);
+  for (int y = 0; y < DISPLAY_HEIGHT; ++y) {
+    for (int x = 0; x < DISPLAY_WIDTH; ++x) {
+      uint32_t expected = get_pixel(system, x, y) ? 0xFFFFFFFF : 0xFF000000;
+      assert(pixels[y][x] == expected);
+    }
+    assert(pixels[y][DISPLAY_WIDTH] == 0);
+  }
+}
+
+void test_expand_screen() {
+  chip8 system = initialize_chip8();
+  for (int y = 0; y < DISPLAY_HEIGHT; ++y) {
+    system.screen[y] = 0x8123456789ABCDEFull * (y + 1);
+  }
+  system.screen[0] = ~0ull;
+  system.screen[1] = 0;
+
+  check_expand_kernel(expand_screen, &system);
+  check_expand_kernel(expand_screen_scalar, &system);
+#if defined(__x86_64__) || defined(__i386__)
+  check_expand_kernel(expand_screen_sse2, &system);
+  if (__builtin_cpu_supports("avx2")) {
+    check_expand_kernel(expand_screen_avx2, &system);
+  }
+#endif
+}
+
 void test_if_key_eq() {
   // Setup |next| to represent the IF_KEY_EQ operation (0xE09E).
   instruction next;
@@ -477,6 +605,41 @@ void test_get_delay() {
   assert(system.V[0] == 10);
 }
 
+void test_get_key() {
+  // 0x200: F30A   wait for a key and store it in V3
+  // 0x202: 7401   V4 += 1
+  chip8 system = initialize_chip8();
+  system.memory[0x200] = 0xF3;
+  system.memory[0x201] = 0x0A;
+  system.memory[0x202] = 0x74;
+  system.memory[0x203] = 0x01;
+  system.pc = 0x200;
+  system.clock_speed = 600;
+  system.delay_timer = 10;
+
+  // The CPU waits on the instruction while time keeps passing.
+  run_cycles(&system, 1);
+  run_cycles(&system, 49);
+  assert(system.waiting_for_key);
+  assert(system.pc == 0x200);
+  assert(system.cycle == 50);
+  assert(system.delay_timer == 5);
+
+  // Releasing a key doesn't end the wait.
+  set_key(&system, 0x7, 0);
+  assert(system.waiting_for_key);
+
+  set_key(&system, 0xB, 1);
+  assert(!system.waiting_for_key);
+  assert(system.keys[0xB]);
+  assert(system.V[3] == 0xB);
+  assert(system.pc == 0x202);
+
+  run_cycles(&system, 1);
+  assert(system.V[4] == 1);
+  assert(system.pc == 0x204);
+}
+
 void test_set_delay() {
   // Setup |next| to represent the SET_DELAY operation (0xFX15).
   instruction next;
@@ -571,6 +734,977 @@ void test_reg_load() {
   assert(system.V[2] == 255);
 }
 
+// Runs the self-modifying program below with |engine| and checks that the
+// rewritten instruction is executed.
+void check_decoded_invalidation(uint8_t engine, jit *j) {
+  // A program which overwrites its own first instruction with REG_DUMP and
+  // then jumps back to it:
+  //
+  //   0x200: 6A05  VA = 5
+  //   0x202: 6060  V0 = 0x60
+  //   0x204: 6107  V1 = 0x07
+  //   0x206: A200  I = 0x200
+  //   0x208: F155  memory[0x200] = V0, memory[0x201] = V1
+  //   0x20A: 1200  jump to 0x200, which now holds 6007 (V0 = 7)
+  uint8_t program[] = {0x6A, 0x05, 0x60, 0x60, 0x61, 0x07,
+                       0xA2, 0x00, 0xF1, 0x55, 0x12, 0x00};
+
+  chip8 system = initialize_chip8();
+  memcpy(system.memory + 0x200, program, sizeof(program));
+  system.pc = 0x200;
+  system.engine = engine;
+  system.jit = j;
+
+  run_cycles(&system, 6);
+  assert(system.pc == 0x200);
+  assert(system.V[0xA] == 5);
+
+  // The decoded instruction at 0x200 is stale, so the rewritten instruction
+  // should be executed.
+  run_cycles(&system, 1);
+  assert(system.V[0] == 7);
+  assert(system.pc == 0x202);
+}
+
+void test_decoded_invalidation() {
+  check_decoded_invalidation(ENGINE_SWITCH, NULL);
+  check_decoded_invalidation(ENGINE_THREADED, NULL);
+
+  jit *j = jit_create();
+  check_decoded_invalidation(ENGINE_JIT, j);
+  jit_destroy(j);
+}
+
+// Asserts that all of the emulated state of |a| and |b| is identical.
+void assert_same_state(const chip8 *a, const chip8 *b) {
+  assert(memcmp(a->memory, b->memory, sizeof(a->memory)) == 0);
+  assert(memcmp(a->V, b->V, sizeof(a->V)) == 0);
+  assert(a->I == b->I);
+  assert(a->pc == b->pc);
+  assert(memcmp(a->stack, b->stack, sizeof(a->stack)) == 0);
+  assert(a->sp == b->sp);
+  assert(memcmp(a->screen, b->screen, sizeof(a->screen)) == 0);
+  assert(a->skip == b->skip);
+  assert(a->delay_timer == b->delay_timer);
+  assert(a->sound_timer == b->sound_timer);
+  assert(a->cycle == b->cycle);
+  assert(a->timer_phase == b->timer_phase);
+  assert(a->waiting_for_key == b->waiting_for_key);
+  assert(a->trap == b->trap);
+  assert(a->rng == b->rng);
+}
+
+// Runs a program on both ENGINE_SWITCH and |engine| and checks that they always
+// agree.
+void check_engine_matches_switch(uint8_t engine, jit *j) {
+  // A loop exercising arithmetic, skips, subroutines, drawing and memory
+  // writes:
+  //
+  //   0x200: 6001 6107 A300        V0 = 1, V1 = 7, I = 0x300
+  //   0x206: 8014 8125 8206 830E   ADD, SUB, SHIFT_RIGHT, SHIFT_LEFT
+  //   0x20E: 8017 8301 8412 8503   SUB_REV, OR, AND, XOR
+  //   0x216: 7207 2240             V2 += 7, call 0x240
+  //   0x21A: 4000 7601             V6 += 1 unless V0 != 0
+  //   0x21E: 5010 7701             V7 += 1 unless V0 == V1
+  //   0x222: 9010 7801             V8 += 1 unless V0 != V1
+  //   0x226: F033 F255 F265        BCD, REG_DUMP, REG_LOAD
+  //   0x22C: F01E A300             I += V0, I = 0x300
+  //   0x230: F015 F907 1206        delay = V0, V9 = delay, jump to 0x206
+  //
+  //   0x240: 8A00 6B1F 8AB2        VA = V0 & 0x1F
+  //   0x246: 8C10 6B0F 8CB2        VC = V1 & 0x0F
+  //   0x24C: DAC5 00EE             draw at (VA, VC), return
+  uint8_t program[] = {
+      0x60, 0x01, 0x61, 0x07, 0xA3, 0x00, 0x80, 0x14, 0x81, 0x25, 0x82, 0x06,
+      0x83, 0x0E, 0x80, 0x17, 0x83, 0x01, 0x84, 0x12, 0x85, 0x03, 0x72, 0x07,
+      0x22, 0x40, 0x40, 0x00, 0x76, 0x01, 0x50, 0x10, 0x77, 0x01, 0x90, 0x10,
+      0x78, 0x01, 0xF0, 0x33, 0xF2, 0x55, 0xF2, 0x65, 0xF0, 0x1E, 0xA3, 0x00,
+      0xF0, 0x15, 0xF9, 0x07, 0x12, 0x06,
+  };
+  uint8_t subroutine[] = {0x8A, 0x00, 0x6B, 0x1F, 0x8A, 0xB2, 0x8C, 0x10,
+                          0x6B, 0x0F, 0x8C, 0xB2, 0xDA, 0xC5, 0x00, 0xEE};
+
+  static chip8 reference;
+  static chip8 other;
+  reference = initialize_chip8();
+  memcpy(reference.memory + 0x200, program, sizeof(program));
+  memcpy(reference.memory + 0x240, subroutine, sizeof(subroutine));
+  reference.pc = 0x200;
+  other = reference;
+  reference.engine = ENGINE_SWITCH;
+  other.engine = engine;
+  other.jit = j;
+
+  // Compare the engines both after short runs and a long one.
+  for (int i = 0; i < 100; ++i) {
+    run_cycles(&reference, i);
+    run_cycles(&other, i);
+    assert_same_state(&reference, &other);
+  }
+  run_cycles(&reference, 100000);
+  run_cycles(&other, 100000);
+  assert_same_state(&reference, &other);
+}
+
+void test_threaded_matches_switch() {
+  check_engine_matches_switch(ENGINE_THREADED, NULL);
+}
+
+// Asserts that no memory of the process is both writable and executable.
+void assert_no_writable_code() {
+#ifdef __linux__
+  FILE *maps = fopen("/proc/self/maps", "r");
+  assert(maps != NULL);
+  char line[512];
+  while (fgets(line, sizeof(line), maps) != NULL) {
+    char perms[5];
+    assert(sscanf(line, "%*s %4s", perms) == 1);
+    assert(!(perms[1] == 'w' && perms[2] == 'x'));
+  }
+  fclose(maps);
+#endif
+}
+
+void test_jit_matches_switch() {
+  jit *j = jit_create();
+  assert_no_writable_code();
+  check_engine_matches_switch(ENGINE_JIT, j);
+  assert_no_writable_code();
+  jit_destroy(j);
+}
+
+// Runs |length| bytes of |program| loaded at |address| on |engine| and checks
+// that it halts with |trap| at |pc| after |cycles| cycles.
+void check_trap(const uint8_t *program, size_t length, uint16_t address,
+                uint8_t engine, trap_t trap, uint16_t pc, uint64_t cycles) {
+  chip8 system = initialize_chip8();
+  memcpy(system.memory + address, program, length);
+  system.pc = address;
+  system.V[0] = 1;
+  system.engine = engine;
+  if (engine == ENGINE_JIT) {
+    system.jit = jit_create();
+  }
+
+  run_cycles(&system, 1000);
+  assert(system.trap == trap);
+  assert(system.pc == pc);
+  assert(system.cycle == cycles);
+
+  // A halted system doesn't run any further.
+  run_cycles(&system, 1000);
+  assert(system.pc == pc);
+  assert(system.cycle == cycles);
+
+  jit_destroy(system.jit);
+}
+
+void test_traps() {
+  // 0x200: 0123   machine code routine
+  const uint8_t invalid[] = {0x01, 0x23};
+  // 0x200: 2200   call 0x200
+  const uint8_t overflow[] = {0x22, 0x00};
+  // 0x200: 00EE   return
+  const uint8_t underflow[] = {0x00, 0xEE};
+  // 0x200: BFFF   jump to 0xFFF + V0
+  const uint8_t jump_addr[] = {0xBF, 0xFF};
+  // 0x200: AFFE   I = 0xFFE
+  // 0x202: F255   memory[0xFFE..0x1000] = V0..V2
+  const uint8_t dump[] = {0xAF, 0xFE, 0xF2, 0x55};
+  // 0x200: AFFE   I = 0xFFE
+  // 0x202: D003   draw 3 rows of the sprite at I
+  const uint8_t sprite[] = {0xAF, 0xFE, 0xD0, 0x03};
+  // 0xFF8: 7001 7001 7001 7001   run off the end of memory
+  const uint8_t end[] = {0x70, 0x01, 0x70, 0x01, 0x70, 0x01, 0x70, 0x01};
+  // 0xFFE: 4000   skip past the end of memory if V0 != 0
+  const uint8_t skip[] = {0x40, 0x00};
+
+  for (uint8_t engine = ENGINE_SWITCH; engine <= ENGINE_JIT; ++engine) {
+    check_trap(invalid, sizeof(invalid), 0x200, engine, TRAP_INVALID_OPCODE,
+               0x200, 1);
+    check_trap(overflow, sizeof(overflow), 0x200, engine, TRAP_STACK_OVERFLOW,
+               0x200, 17);
+    check_trap(underflow, sizeof(underflow), 0x200, engine,
+               TRAP_STACK_UNDERFLOW, 0x200, 1);
+    check_trap(jump_addr, sizeof(jump_addr), 0x200, engine, TRAP_BAD_ADDRESS,
+               0x200, 1);
+    check_trap(dump, sizeof(dump), 0x200, engine, TRAP_BAD_ADDRESS, 0x202, 2);
+    check_trap(sprite, sizeof(sprite), 0x200, engine, TRAP_BAD_ADDRESS, 0x202,
+               2);
+    check_trap(end, sizeof(end), 0xFF8, engine, TRAP_BAD_ADDRESS, 0x1000, 5);
+    check_trap(skip, sizeof(skip), 0xFFE, engine, TRAP_BAD_ADDRESS, 0x1002, 3);
+  }
+}
+
+// Runs a program that jumps to itself for |seconds| emulated seconds at
+// |clock_speed| and checks that the delay timer ticks exactly at the frame
+// boundaries.
+void check_timer_rate(uint32_t clock_speed, uint32_t seconds) {
+  chip8 system = initialize_chip8();
+  system.clock_speed = clock_speed;
+  system.memory[0x200] = 0x12; // 0x200: 1200   jump to 0x200
+  system.memory[0x201] = 0x00;
+  system.pc = 0x200;
+
+  uint64_t ticks = 0;
+  for (uint64_t cycle = 1; cycle <= (uint64_t)clock_speed * seconds; ++cycle) {
+    system.delay_timer = 2;
+    run_cycles(&system, 1);
+    ticks += 2 - system.delay_timer;
+
+    // The timers should tick once for each frame boundary crossed so far.
+    assert(ticks == cycle * FRAME_RATE / clock_speed);
+  }
+  assert(ticks == FRAME_RATE * seconds);
+  assert(system.timer_phase == 0);
+}
+
+void test_timer_rate() {
+  check_timer_rate(CLOCK_SPEED, 3);
+  check_timer_rate(600, 100);
+  // Clock speeds that aren't multiples of the frame rate.
+  check_timer_rate(1000, 100);
+  check_timer_rate(61, 100);
+  check_timer_rate(FRAME_RATE, 100);
+}
+
+// Checks that advance_cycles() ticks the timers the same as running the cycles
+// one at a time.
+void test_advance_cycles() {
+  const uint64_t steps[] = {0, 1, 5, 16, 17, 1000, 12345, 16667, 100000};
+
+  for (uint32_t clock_speed = 60; clock_speed < 2000; clock_speed += 97) {
+    chip8 stepped = initialize_chip8();
+    chip8 advanced = initialize_chip8();
+    stepped.clock_speed = advanced.clock_speed = clock_speed;
+
+    for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); ++i) {
+      stepped.delay_timer = advanced.delay_timer = 200;
+      stepped.sound_timer = advanced.sound_timer = 100;
+
+      for (uint64_t j = 0; j < steps[i]; ++j) {
+        advance_cycles(&stepped, 1);
+      }
+      advance_cycles(&advanced, steps[i]);
+
+      assert(stepped.cycle == advanced.cycle);
+      assert(stepped.timer_phase == advanced.timer_phase);
+      assert(stepped.delay_timer == advanced.delay_timer);
+      assert(stepped.sound_timer == advanced.sound_timer);
+    }
+  }
+}
+
+// Runs the same program in many lanes of a lockstep engine and on independent
+// systems with different registers and keys, and checks that every lane always
+// matches its system.
+void check_lockstep(uint8_t simd) {
+  // The loop from check_engine_matches_switch(), without the register setup at
+  // 0x200, with a subroutine which reads the keys and rewrites itself:
+  //
+  //   0x240: 8A00 6B1F 8AB2        VA = V0 & 0x1F
+  //   0x246: 8C10 CB0F 8CB2        VC = V1 & a random number below 16
+  //   0x24C: DAC5 E09E 7D01        draw, VD += 1 unless key V0 is down
+  //   0x252: A251 F055 81F4        rewrite the 01 of 7D01 with V0, V1 += VF
+  //   0x258: 8F15 A300 00EE        VF -= V1, I = 0x300, return
+  //
+  //   0x260: F20A 1206             wait for a key, jump to 0x206
+  uint8_t program[] = {
+      0x60, 0x01, 0x61, 0x07, 0xA3, 0x00, 0x80, 0x14, 0x81, 0x25, 0x82, 0x06,
+      0x83, 0x0E, 0x80, 0x17, 0x83, 0x01, 0x84, 0x12, 0x85, 0x03, 0x72, 0x07,
+      0x22, 0x40, 0x40, 0x00, 0x76, 0x01, 0x50, 0x10, 0x77, 0x01, 0x90, 0x10,
+      0x78, 0x01, 0xF0, 0x33, 0xF2, 0x55, 0xF2, 0x65, 0xF0, 0x1E, 0xA3, 0x00,
+      0xF0, 0x15, 0xF9, 0x07, 0x12, 0x06,
+  };
+  uint8_t subroutine[] = {0x8A, 0x00, 0x6B, 0x1F, 0x8A, 0xB2, 0x8C, 0x10,
+                          0xCB, 0x0F, 0x8C, 0xB2, 0xDA, 0xC5, 0xE0, 0x9E,
+                          0x7D, 0x01, 0xA2, 0x51, 0xF0, 0x55, 0x81, 0xF4,
+                          0x8F, 0x15, 0xA3, 0x00, 0x00, 0xEE};
+  uint8_t wait[] = {0xF2, 0x0A, 0x12, 0x06};
+
+  // Not a multiple of the AVX2 block, so that some lanes are padding.
+  enum { LANES = 37 };
+  static chip8 systems[LANES];
+  static chip8 lane;
+  lockstep *ls = lockstep_create(LANES);
+  assert(ls != NULL);
+  lockstep_set_simd(ls, simd);
+
+  for (uint32_t i = 0; i < LANES; ++i) {
+    chip8 *system = &systems[i];
+    *system = initialize_chip8();
+    load_hex_fonts(system);
+    memcpy(system->memory + 0x200, program, sizeof(program));
+    memcpy(system->memory + 0x240, subroutine, sizeof(subroutine));
+    memcpy(system->memory + 0x260, wait, sizeof(wait));
+    system->clock_speed = 600;
+    system->pc = 0x206;
+    system->V[0] = i * 3;
+    system->V[1] = i * 7 + 1;
+    system->V[2] = i;
+    system->V[0xE] = i * 11;
+    system->keys[i % 16] = 1;
+    chip8_seed(system, i % 5);
+  }
+  // A lane running different code, one which traps on its first call and one
+  // which waits for a key.
+  systems[11].memory[0x207] = 0x24;
+  systems[5].sp = 16;
+  systems[13].pc = 0x260;
+
+  for (uint32_t i = 0; i < LANES; ++i) {
+    lockstep_set_lane(ls, i, &systems[i]);
+  }
+
+  for (int step = 0; step < 200; ++step) {
+    for (uint32_t i = 0; i < LANES; ++i) {
+      run_cycles(&systems[i], step);
+    }
+    lockstep_run(ls, step);
+
+    for (uint32_t i = 0; i < LANES; ++i) {
+      lane = initialize_chip8();
+      lockstep_get_lane(ls, i, &lane);
+      assert_same_state(&systems[i], &lane);
+    }
+
+    // Press and release keys between runs.
+    uint32_t i = step * 7 % LANES;
+    uint8_t key = step % 16;
+    uint8_t pressed = step % 3 != 0;
+    set_key(&systems[i], key, pressed);
+    lockstep_set_key(ls, i, key, pressed);
+  }
+  assert(systems[5].trap == TRAP_STACK_OVERFLOW);
+
+  lockstep_destroy(ls);
+}
+
+// Runs |program| on |engine| at |clock_speed| both one cycle at a time, which
+// never skips an idle loop, and in large batches, pressing key 5 for a while
+// in the middle. Checks that they always agree.
+void check_idle_loop(const uint8_t *program, size_t length, uint8_t engine,
+                     uint32_t clock_speed) {
+  static chip8 stepped;
+  static chip8 batched;
+  stepped = initialize_chip8();
+  memcpy(stepped.memory + 0x200, program, length);
+  stepped.pc = 0x200;
+  stepped.clock_speed = clock_speed;
+  stepped.engine = engine;
+  batched = stepped;
+  if (engine == ENGINE_JIT) {
+    stepped.jit = jit_create();
+    batched.jit = jit_create();
+  }
+
+  const uint64_t batches[] = {1, 2, 3, 5, 1000, 7919, 16667, 100000, 3};
+  for (int round = 0; round < 4; ++round) {
+    uint8_t pressed = round == 2;
+    set_key(&stepped, 5, pressed);
+    set_key(&batched, 5, pressed);
+    for (size_t i = 0; i < sizeof(batches) / sizeof(batches[0]); ++i) {
+      for (uint64_t c = 0; c < batches[i]; ++c) {
+        run_cycles(&stepped, 1);
+      }
+      run_cycles(&batched, batches[i]);
+      assert_same_state(&stepped, &batched);
+    }
+  }
+
+  jit_destroy(stepped.jit);
+  jit_destroy(batched.jit);
+}
+
+void test_idle_loops() {
+  //   0x200: 6064 F015   delay = 100
+  //   0x204: F107 3100   wait for the delay timer to reach 0
+  //   0x208: 1204
+  //   0x20A: 6205 120C   V2 = 5, loop forever
+  uint8_t delay[] = {0x60, 0x64, 0xF0, 0x15, 0xF1, 0x07, 0x31, 0x00,
+                     0x12, 0x04, 0x62, 0x05, 0x12, 0x0C};
+  //   0x200: 6005        V0 = 5
+  //   0x202: E09E 1202   wait for key 5 to be pressed
+  //   0x206: E0A1 1206   wait for key 5 to be released
+  //   0x20A: 6096 F015   delay = 150
+  //   0x20E: F307 3314   wait for the delay timer to reach 20
+  //   0x212: 120E
+  //   0x214: 1200        start over
+  uint8_t keys[] = {0x60, 0x05, 0xE0, 0x9E, 0x12, 0x02, 0xE0, 0xA1,
+                    0x12, 0x06, 0x60, 0x96, 0xF0, 0x15, 0xF3, 0x07,
+                    0x33, 0x14, 0x12, 0x0E, 0x12, 0x00};
+
+  const uint32_t clock_speeds[] = {CLOCK_SPEED, 1000, 150, 61, FRAME_RATE};
+  for (uint8_t engine = ENGINE_SWITCH; engine <= ENGINE_JIT; ++engine) {
+    for (size_t i = 0; i < sizeof(clock_speeds) / sizeof(clock_speeds[0]);
+         ++i) {
+      check_idle_loop(delay, sizeof(delay), engine, clock_speeds[i]);
+      check_idle_loop(keys, sizeof(keys), engine, clock_speeds[i]);
+    }
+  }
+
+#ifndef CHIP8_PROFILE
+  // The loops are skipped rather than run.
+  chip8 system = initialize_chip8();
+  memcpy(system.memory + 0x200, delay, sizeof(delay));
+  system.pc = 0x204;
+  system.delay_timer = 10;
+  assert(skip_idle_loop(&system, 1000000) == 3 * 55556);
+  assert(system.pc == 0x204);
+  assert(system.delay_timer == 0);
+  assert(system.V[1] == 1);
+  system.pc = 0x20C;
+  assert(skip_idle_loop(&system, 1000) == 1000);
+#endif
+}
+
+void test_lockstep() {
+  check_lockstep(0);
+  check_lockstep(1);
+}
+
+// Checks that restoring a snapshot on |engine| rewinds the system exactly,
+// including code which was changed after the snapshot was taken.
+void check_snapshot(uint8_t engine) {
+  // 0x200: 6005 F01E 1200   V0 = 5, I += V0, jump to 0x200
+  const uint8_t five[] = {0x60, 0x05, 0xF0, 0x1E, 0x12, 0x00};
+  // 0x200: 6007 D001 1200   V0 = 7, draw at (V0, V0), jump to 0x200
+  const uint8_t seven[] = {0x60, 0x07, 0xD0, 0x01, 0x12, 0x00};
+  static uint8_t snapshot[CHIP8_SNAPSHOT_SIZE];
+  static chip8 system;
+  static chip8 other;
+
+  other = initialize_chip8();
+  memcpy(other.memory + 0x200, seven, sizeof(seven));
+  other.pc = 0x200;
+  other.I = 0x200;
+  run_cycles(&other, 10);
+  chip8_snapshot(&other, snapshot);
+
+  system = initialize_chip8();
+  memcpy(system.memory + 0x200, five, sizeof(five));
+  system.pc = 0x200;
+  system.engine = engine;
+  if (engine == ENGINE_JIT) {
+    system.jit = jit_create();
+  }
+  run_cycles(&system, 1000);
+  system.dirty_rows = 0;
+  system.draw_flag = 0;
+
+  // The code at 0x200 was decoded (and translated) before the restore, and
+  // must be replaced by the restored code.
+  chip8_restore(&system, snapshot);
+  assert(system.engine == engine);
+  assert(system.dirty_rows == 1u << 7);
+  assert(system.draw_flag == 1);
+  assert_same_state(&system, &other);
+  run_cycles(&system, 1000);
+  run_cycles(&other, 1000);
+  assert_same_state(&system, &other);
+
+  // Rewinding to a snapshot and running again gives the same result.
+  chip8_snapshot(&system, snapshot);
+  run_cycles(&system, 999);
+  chip8_restore(&system, snapshot);
+  run_cycles(&system, 999);
+  run_cycles(&other, 999);
+  assert_same_state(&system, &other);
+
+  jit_destroy(system.jit);
+}
+
+void test_snapshot() {
+  for (uint8_t engine = ENGINE_SWITCH; engine <= ENGINE_JIT; ++engine) {
+    check_snapshot(engine);
+  }
+}
+
+// Records frames of a running program into a rewind buffer which is too small
+// to hold them all, then steps back through them and checks each one.
+void check_rewind(size_t bytes, uint32_t frames, uint32_t keyframe_interval) {
+  enum { FRAMES = 300, CYCLES_PER_FRAME = 997 };
+  static uint8_t expected[FRAMES][CHIP8_SNAPSHOT_SIZE];
+  static uint8_t actual[CHIP8_SNAPSHOT_SIZE];
+  static chip8 system;
+
+  // 0x200: 7001 F029 D125   V0 += 1, I = font of V0, draw it at (V1, V2)
+  // 0x206: 7103 A400 F355   V1 += 3, I = 0x400, memory[I..] = V0..V3
+  // 0x20C: F015 1200        delay = V0, jump to 0x200
+  const uint8_t program[] = {0x70, 0x01, 0xF0, 0x29, 0xD1, 0x25, 0x71,
+                             0x03, 0xA4, 0x00, 0xF3, 0x55, 0xF0, 0x15,
+                             0x12, 0x00};
+  system = initialize_chip8();
+  load_hex_fonts(&system);
+  memcpy(system.memory + 0x200, program, sizeof(program));
+  system.pc = 0x200;
+
+  rewind_buffer r;
+  assert(rewind_init(&r, bytes, frames, keyframe_interval) == 0);
+
+  for (int frame = 0; frame < FRAMES; ++frame) {
+    run_cycles(&system, CYCLES_PER_FRAME);
+    chip8_snapshot(&system, expected[frame]);
+    rewind_record(&r, &system);
+
+    assert(r.used <= r.capacity);
+    assert(r.count <= r.max_entries);
+    assert(r.entries[r.first].keyframe);
+
+    // Step back and forth once in a while, which must not disturb recording.
+    if (frame % 37 == 36) {
+      assert(rewind_step_back(&r, &system) == 0);
+      chip8_snapshot(&system, actual);
+      assert(memcmp(actual, expected[frame - 1], sizeof(actual)) == 0);
+      run_cycles(&system, CYCLES_PER_FRAME);
+      rewind_record(&r, &system);
+    }
+  }
+
+  // Step back through every frame still in the buffer.
+  uint32_t kept = r.count;
+  assert(kept > 1 && kept < FRAMES);
+  for (uint32_t i = 2; i <= kept; ++i) {
+    assert(rewind_step_back(&r, &system) == 0);
+    chip8_snapshot(&system, actual);
+    assert(memcmp(actual, expected[FRAMES - i], sizeof(actual)) == 0);
+  }
+  assert(rewind_step_back(&r, &system) != 0);
+
+  rewind_destroy(&r);
+}
+
+void test_rewind() {
+  // Limited by bytes, with a small and a large keyframe interval.
+  check_rewind(20000, 1000, 10);
+  check_rewind(20000, 1000, 60);
+  // Limited by frames.
+  check_rewind(1 << 20, 100, 7);
+  // Too small for more than a keyframe and a few frames.
+  check_rewind(2 * CHIP8_SNAPSHOT_SIZE, 1000, 60);
+}
+
+// Plays a session with key presses at arbitrary cycles while recording a
+// movie, and checks that replaying the movie on each engine ends in exactly the
+// same state. SET_RAND uses rand() if |libc_rand| is set.
+void check_movie(uint8_t libc_rand) {
+  // 0x200: C0FF F10A   V0 = random byte, wait for a key in V1
+  // 0x204: E19E 7201   V2 += 1 unless key V1 is down
+  // 0x208: 8304 1200   V3 += V0, jump to 0x200
+  const uint8_t program[] = {0xC0, 0xFF, 0xF1, 0x0A, 0xE1, 0x9E,
+                             0x72, 0x01, 0x83, 0x04, 0x12, 0x00};
+  static chip8 live;
+  static chip8 replay;
+
+  live = initialize_chip8();
+  memcpy(live.memory + 0x200, program, sizeof(program));
+  live.pc = 0x200;
+  live.clock_speed = 600;
+  live.libc_rand = libc_rand;
+  if (libc_rand) {
+    srand(1234);
+  } else {
+    chip8_seed(&live, 1234);
+  }
+
+  movie recorded;
+  movie_init(&recorded, &live, 1234);
+
+  // The session's input comes from its own generator, as rand() may drive
+  // CXNN.
+  uint32_t input = 1;
+  for (int i = 0; i < 500; ++i) {
+    input = input * 1103515245 + 12345;
+    run_cycles(&live, (input >> 16) % 50);
+    // Only changes are recorded, so toggle the key.
+    uint8_t key = (input >> 8) % 16;
+    set_key(&live, key, !live.keys[key]);
+    assert(movie_record_keys(&recorded, &live) == 0);
+  }
+  run_cycles(&live, 100);
+
+  char path[] = "/tmp/chip8_movie_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+  assert(movie_save(&recorded, path, live.cycle) == 0);
+  movie_destroy(&recorded);
+
+  movie loaded;
+  assert(movie_load(&loaded, path) == 0);
+  assert(loaded.end_cycle == live.cycle);
+  assert(loaded.clock_speed == 600);
+  assert(loaded.seed == 1234);
+  assert(loaded.libc_rand == libc_rand);
+
+  for (uint8_t engine = ENGINE_SWITCH; engine <= ENGINE_JIT; ++engine) {
+    chip8 *system = &replay;
+    *system = initialize_chip8();
+    memcpy(system->memory + 0x200, program, sizeof(program));
+    system->pc = 0x200;
+    system->engine = engine;
+    if (engine == ENGINE_JIT) {
+      system->jit = jit_create();
+    }
+
+    assert(movie_play(&loaded, system) == 0);
+    assert_same_state(system, &live);
+    assert(memcmp(system->keys, live.keys, sizeof(live.keys)) == 0);
+    jit_destroy(system->jit);
+  }
+
+  // A different ROM is refused.
+  replay = initialize_chip8();
+  assert(movie_play(&loaded, &replay) != 0);
+
+  movie_destroy(&loaded);
+  remove(path);
+}
+
+void test_movie() {
+  check_movie(0);
+  check_movie(1);
+}
+
+// Runs a program drawing random sprites on its own thread and records the hash
+// of the screen after each frame.
+typedef struct seeded_run {
+  pthread_t thread;
+  uint64_t seed;
+  uint64_t hashes[600];
+} seeded_run;
+
+void *run_seeded(void *arg) {
+  seeded_run *run = arg;
+
+  // 0x200: C03F C11F C20F   V0 = random x, V1 = random y, V2 = random digit
+  // 0x206: F229 D015 1200   I = font of V2, draw it at (V0, V1), loop
+  const uint8_t program[] = {0xC0, 0x3F, 0xC1, 0x1F, 0xC2, 0x0F,
+                             0xF2, 0x29, 0xD0, 0x15, 0x12, 0x00};
+  chip8 *system = malloc(sizeof(chip8));
+  *system = initialize_chip8();
+  load_hex_fonts(system);
+  memcpy(system->memory + 0x200, program, sizeof(program));
+  system->pc = 0x200;
+  chip8_seed(system, run->seed);
+
+  for (int frame = 0; frame < 600; ++frame) {
+    run_cycles(system, 1000);
+    run->hashes[frame] = screen_hash(system);
+  }
+  free(system);
+  return NULL;
+}
+
+// Checks that systems seeded the same draw the same frames, even while running
+// at the same time on different threads.
+void test_seeded_threads() {
+  static seeded_run runs[4] = {{.seed = 42}, {.seed = 42}, {.seed = 42},
+                               {.seed = 43}};
+  for (int i = 0; i < 4; ++i) {
+    assert(pthread_create(&runs[i].thread, NULL, run_seeded, &runs[i]) == 0);
+  }
+  for (int i = 0; i < 4; ++i) {
+    pthread_join(runs[i].thread, NULL);
+  }
+
+  assert(memcmp(runs[0].hashes, runs[1].hashes, sizeof(runs[0].hashes)) == 0);
+  assert(memcmp(runs[0].hashes, runs[2].hashes, sizeof(runs[0].hashes)) == 0);
+  assert(memcmp(runs[0].hashes, runs[3].hashes, sizeof(runs[0].hashes)) != 0);
+}
+
+#define HANDOFF_FRAMES 200000
+
+// Publishes frames 1 to HANDOFF_FRAMES, with every row of frame n set to n.
+void *publish_frames(void *arg) {
+  triple_buffer *b = arg;
+  for (uint64_t n = 1; n <= HANDOFF_FRAMES; ++n) {
+    frame *f = triple_buffer_back(b);
+    for (int y = 0; y < DISPLAY_HEIGHT; ++y) {
+      f->screen[y] = n;
+    }
+    f->cycle = n;
+    triple_buffer_publish(b);
+  }
+  return NULL;
+}
+
+void test_triple_buffer() {
+  static triple_buffer b;
+  triple_buffer_init(&b);
+  assert(triple_buffer_read(&b) == NULL);
+
+  triple_buffer_back(&b)->cycle = 1;
+  triple_buffer_publish(&b);
+  const frame *f = triple_buffer_read(&b);
+  assert(f != NULL && f->cycle == 1);
+  assert(triple_buffer_read(&b) == NULL);
+
+  // Only the newest frame is read.
+  triple_buffer_back(&b)->cycle = 2;
+  triple_buffer_publish(&b);
+  triple_buffer_back(&b)->cycle = 3;
+  triple_buffer_publish(&b);
+  f = triple_buffer_read(&b);
+  assert(f != NULL && f->cycle == 3);
+
+  // While being written on another thread, every frame read is whole and
+  // newer than the last.
+  triple_buffer_init(&b);
+  pthread_t writer;
+  assert(pthread_create(&writer, NULL, publish_frames, &b) == 0);
+  uint64_t last = 0;
+  while (last < HANDOFF_FRAMES) {
+    f = triple_buffer_read(&b);
+    if (f == NULL) {
+      sched_yield();
+      continue;
+    }
+    assert(f->cycle > last);
+    for (int y = 0; y < DISPLAY_HEIGHT; ++y) {
+      assert(f->screen[y] == f->cycle);
+    }
+    last = f->cycle;
+  }
+  pthread_join(writer, NULL);
+}
+
+// Pushes events with times 0 to HANDOFF_FRAMES - 1, waiting whenever the
+// queue is full.
+void *push_events(void *arg) {
+  input_queue *q = arg;
+  for (uint32_t i = 0; i < HANDOFF_FRAMES; ++i) {
+    input_event e = {.time = i, .type = INPUT_KEY, .key = i & 0xF};
+    while (input_queue_push(q, &e) != 0) {
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+void test_input_queue() {
+  static input_queue q;
+  input_queue_init(&q);
+  input_event e;
+  assert(input_queue_pop(&q, &e) != 0);
+
+  // Fill the queue, wrapping around, and empty it in order.
+  for (int round = 0; round < 3; ++round) {
+    for (uint32_t i = 0; i < INPUT_QUEUE_SIZE; ++i) {
+      e.time = i;
+      assert(input_queue_push(&q, &e) == 0);
+    }
+    assert(input_queue_push(&q, &e) != 0);
+    for (uint32_t i = 0; i < INPUT_QUEUE_SIZE; ++i) {
+      assert(input_queue_pop(&q, &e) == 0);
+      assert(e.time == i);
+    }
+    assert(input_queue_pop(&q, &e) != 0);
+  }
+
+  // Every event pushed on another thread is popped once, in order.
+  pthread_t producer;
+  assert(pthread_create(&producer, NULL, push_events, &q) == 0);
+  for (uint32_t i = 0; i < HANDOFF_FRAMES; ++i) {
+    while (input_queue_pop(&q, &e) != 0) {
+      sched_yield();
+    }
+    assert(e.time == i);
+    assert(e.key == (i & 0xF));
+  }
+  pthread_join(producer, NULL);
+  assert(input_queue_pop(&q, &e) != 0);
+}
+
+void test_tone() {
+  // 8 samples a tick, with a period of 4 samples.
+  tone t;
+  tone_init(&t, 8 * FRAME_RATE, 2 * FRAME_RATE, 100);
+  int16_t samples[64];
+
+  // Silence until a beep.
+  tone_fill(&t, samples, 8);
+  for (int i = 0; i < 8; ++i) {
+    assert(samples[i] == 0);
+  }
+
+  // Two ticks of a square wave, then silence.
+  tone_beep(&t);
+  tone_beep(&t);
+  tone_fill(&t, samples, 20);
+  for (int i = 0; i < 16; ++i) {
+    assert(samples[i] == (i % 4 < 2 ? 100 : -100));
+  }
+  for (int i = 16; i < 20; ++i) {
+    assert(samples[i] == 0);
+  }
+
+  // A tick carries on from one buffer to the next.
+  tone_beep(&t);
+  tone_fill(&t, samples, 5);
+  tone_fill(&t, samples + 5, 5);
+  for (int i = 0; i < 8; ++i) {
+    assert(samples[i] == (i % 4 < 2 ? 100 : -100));
+  }
+  assert(samples[8] == 0 && samples[9] == 0);
+
+  // Ticks beyond TONE_MAX_PENDING are dropped.
+  for (int i = 0; i < TONE_MAX_PENDING + 2; ++i) {
+    tone_beep(&t);
+  }
+  tone_fill(&t, samples, 64);
+  int sounding = 0;
+  for (int i = 0; i < 64; ++i) {
+    sounding += samples[i] != 0;
+  }
+  assert(sounding == 8 * TONE_MAX_PENDING);
+  assert(atomic_load(&t.pending) == 0);
+}
+
+// Few enough that even if the threads take turns with a single ring buffer,
+// it doesn't fill up.
+#define LOG_THREAD_MESSAGES 64
+
+void *log_messages(void *arg) {
+  int thread = *(int *)arg;
+  for (int i = 0; i < LOG_THREAD_MESSAGES; ++i) {
+    LOG_WARN("thread %d message %d", thread, i);
+  }
+  return NULL;
+}
+
+void test_log() {
+  FILE *f = tmpfile();
+  assert(f != NULL);
+  assert(log_start(f) == 0);
+  // Only one logging thread at a time.
+  assert(log_start(f) != 0);
+
+  // Debug messages are compiled out, without evaluating their arguments.
+  int evaluated = 0;
+  LOG_DEBUG("%d", ++evaluated);
+#if CHIP8_LOG_LEVEL > LOG_LEVEL_DEBUG
+  assert(evaluated == 0);
+#endif
+
+  int threads[2] = {1, 2};
+  pthread_t logging[2];
+  for (int t = 0; t < 2; ++t) {
+    assert(pthread_create(&logging[t], NULL, log_messages, &threads[t]) == 0);
+  }
+  int main_thread = 0;
+  log_messages(&main_thread);
+  for (int t = 0; t < 2; ++t) {
+    pthread_join(logging[t], NULL);
+  }
+  log_stop();
+  assert(log_dropped() == 0);
+
+  // Every message is written out once, each thread's in order.
+  rewind(f);
+  char line[256];
+  int next[3] = {0, 0, 0};
+  while (fgets(line, sizeof(line), f) != NULL) {
+    const char *message = strstr(line, "WARN  thread ");
+    if (message == NULL) {
+      // The debug message, in a debug build.
+      assert(strstr(line, "DEBUG 1") != NULL);
+      continue;
+    }
+    int thread, i;
+    assert(sscanf(message, "WARN  thread %d message %d", &thread, &i) == 2);
+    assert(thread >= 0 && thread < 3);
+    assert(i == next[thread]++);
+  }
+  for (int t = 0; t < 3; ++t) {
+    assert(next[t] == LOG_THREAD_MESSAGES);
+  }
+  fclose(f);
+}
+
+void test_opcode_name() {
+  assert(strcmp(opcode_name(UNKNOWN), "UNKNOWN") == 0);
+  assert(strcmp(opcode_name(DRAW), "DRAW") == 0);
+  assert(strcmp(opcode_name(REG_LOAD), "REG_LOAD") == 0);
+}
+
+#ifdef CHIP8_PROFILE
+// Checks the counts of a short program on each engine:
+//
+//   0x200: 6000  V0 = 0
+//   0x202: 3000  skip if V0 == 0
+//   0x204: 6005  (skipped)
+//   0x206: 7001  V0 += 1
+//   0x208: 1206  jump to 0x206
+void test_profile() {
+  const uint8_t program[] = {0x60, 0x00, 0x30, 0x00, 0x60, 0x05,
+                             0x70, 0x01, 0x12, 0x06};
+
+  for (uint8_t engine = ENGINE_SWITCH; engine <= ENGINE_JIT; ++engine) {
+    chip8 system = initialize_chip8();
+    system.pc = 0x200;
+    system.engine = engine;
+    memcpy(system.memory + 0x200, program, sizeof(program));
+
+    profile_reset();
+    run_cycles(&system, 1000);
+    assert(chip8_profile.count[SET_X_NN] == 1);
+    assert(chip8_profile.count[IF_X_EQ_NN] == 1);
+    assert(chip8_profile.skipped == 1);
+    assert(chip8_profile.count[ADD_X_NN] == 499);
+    assert(chip8_profile.count[JUMP] == 498);
+
+    // Every 64th execution of an opcode is timed.
+    assert(chip8_profile.samples[ADD_X_NN] == 499 / PROFILE_SAMPLE_PERIOD);
+    uint64_t bucketed = 0;
+    for (int b = 0; b < PROFILE_BUCKETS; ++b) {
+      bucketed += chip8_profile.histogram[ADD_X_NN][b];
+    }
+    assert(bucketed == chip8_profile.samples[ADD_X_NN]);
+
+    assert(chip8_profile.address[0x200] == 1);
+    assert(chip8_profile.address[0x204] == 0);
+    assert(chip8_profile.address[0x206] == 499);
+  }
+  profile_reset();
+}
+
+// Checks that instructions are attributed to the call stack they ran on:
+//
+//   0x200: 2300  call 0x300
+//   0x202: 1202  jump to 0x202
+//   0x300: 2310  call 0x310
+//   0x302: 00EE  return
+//   0x310: 7001  V0 += 1
+//   0x312: 00EE  return
+void test_profile_calls() {
+  chip8 system = initialize_chip8();
+  system.pc = 0x200;
+  const uint16_t program[][2] = {{0x200, 0x2300}, {0x202, 0x1202},
+                                 {0x300, 0x2310}, {0x302, 0x00EE},
+                                 {0x310, 0x7001}, {0x312, 0x00EE}};
+  for (size_t i = 0; i < sizeof(program) / sizeof(program[0]); ++i) {
+    system.memory[program[i][0]] = program[i][1] >> 8;
+    system.memory[program[i][0] + 1] = program[i][1] & 0xFF;
+  }
+
+  profile_reset();
+  run_cycles(&system, 16);
+  // main, main;0x300 and main;0x300;0x310.
+  assert(chip8_profile.frame_count == 3);
+  assert(chip8_profile.frame == 0);
+  assert(chip8_profile.frames[1].entry == 0x300);
+  assert(chip8_profile.frames[1].calls == 1);
+  assert(chip8_profile.frames[2].parent == 1);
+  assert(chip8_profile.frames[2].entry == 0x310);
+  // The CALL and the jump 11 times in main, the CALL and RETURN in 0x300.
+  assert(chip8_profile.frames[0].self == 12);
+  assert(chip8_profile.frames[1].self == 2);
+  assert(chip8_profile.frames[2].self == 2);
+  profile_reset();
+}
+#endif
+
 int main(int argc, char *argv[]) {
   fprintf(stderr, "Running tests...\n");
 
@@ -607,9 +1741,13 @@ int main(int argc, char *argv[]) {
   test_jump_addr();         // 0xBNNN
   test_set_rand();          // 0xCXNN
   test_draw();              // 0xDXYN
+  test_draw_edges();        // 0xDXYN
+  test_dirty_rows();        // 0xDXYN
+  test_expand_screen();     // 0xDXYN
   test_if_key_eq();         // 0xEX9E
   test_if_key_neq();        // 0xEXA1
   test_get_delay();         // 0xFX07
+  test_get_key();           // 0xFX0A
   test_set_delay();         // 0xFX15
   test_set_sound();         // 0xFX18
   test_add_x_i();           // 0xFX1E
@@ -617,6 +1755,29 @@ int main(int argc, char *argv[]) {
   test_reg_dump();          // 0xFX55
   test_reg_load();          // 0xFX65
 
+  // Emulation tests.
+  test_decoded_invalidation();
+  test_threaded_matches_switch();
+  test_jit_matches_switch();
+  test_timer_rate();
+  test_traps();
+  test_advance_cycles();
+  test_idle_loops();
+  test_lockstep();
+  test_snapshot();
+  test_rewind();
+  test_movie();
+  test_seeded_threads();
+  test_triple_buffer();
+  test_input_queue();
+  test_tone();
+  test_log();
+  test_opcode_name();
+#ifdef CHIP8_PROFILE
+  test_profile();
+  test_profile_calls();
+#endif
+
   fprintf(stderr, "Tests completed successfully!\n");
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,100 @@
+#include "expand.h"
+
+#include <stdint.h>
+
+#include "chip8.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+void expand_screen_scalar(const uint64_t *screen, uint32_t *pixels, int pitch,
+                          uint32_t on, uint32_t off) {
+  for (int y = 0; y < DISPLAY_HEIGHT; ++y) {
+    uint64_t row = screen[y];
+    uint32_t *out = pixels + y * pitch;
+    for (int x = 0; x < DISPLAY_WIDTH; ++x) {
+      // The leftmost pixel is the most significant bit.
+      out[x] = (row >> (DISPLAY_WIDTH - 1 - x)) & 1 ? on : off;
+    }
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sse2"))) void
+expand_screen_sse2(const uint64_t *screen, uint32_t *pixels, int pitch,
+                   uint32_t on, uint32_t off) {
+  const __m128i on_v = _mm_set1_epi32(on);
+  const __m128i off_v = _mm_set1_epi32(off);
+  // The bits of a byte which select the left and right 4 of its 8 pixels.
+  const __m128i left_bits = _mm_setr_epi32(0x80, 0x40, 0x20, 0x10);
+  const __m128i right_bits = _mm_setr_epi32(0x08, 0x04, 0x02, 0x01);
+
+  for (int y = 0; y < DISPLAY_HEIGHT; ++y) {
+    uint64_t row = screen[y];
+    uint32_t *out = pixels + y * pitch;
+    for (int x = 0; x < DISPLAY_WIDTH; x += 8) {
+      __m128i byte = _mm_set1_epi32((row >> (DISPLAY_WIDTH - 8 - x)) & 0xFF);
+
+      // Lanes whose bit is set become all ones.
+      __m128i left = _mm_cmpeq_epi32(_mm_and_si128(byte, left_bits), left_bits);
+      __m128i right =
+          _mm_cmpeq_epi32(_mm_and_si128(byte, right_bits), right_bits);
+
+      _mm_storeu_si128((__m128i *)(out + x),
+                       _mm_or_si128(_mm_and_si128(left, on_v),
+                                    _mm_andnot_si128(left, off_v)));
+      _mm_storeu_si128((__m128i *)(out + x + 4),
+                       _mm_or_si128(_mm_and_si128(right, on_v),
+                                    _mm_andnot_si128(right, off_v)));
+    }
+  }
+}
+
+__attribute__((target("avx2"))) void
+expand_screen_avx2(const uint64_t *screen, uint32_t *pixels, int pitch,
+                   uint32_t on, uint32_t off) {
+  const __m256i on_v = _mm256_set1_epi32(on);
+  const __m256i off_v = _mm256_set1_epi32(off);
+  // The bit of a byte which selects each of its 8 pixels.
+  const __m256i bits =
+      _mm256_setr_epi32(0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+
+  for (int y = 0; y < DISPLAY_HEIGHT; ++y) {
+    uint64_t row = screen[y];
+    uint32_t *out = pixels + y * pitch;
+    for (int x = 0; x < DISPLAY_WIDTH; x += 8) {
+      __m256i byte =
+          _mm256_set1_epi32((row >> (DISPLAY_WIDTH - 8 - x)) & 0xFF);
+      __m256i set = _mm256_cmpeq_epi32(_mm256_and_si256(byte, bits), bits);
+      _mm256_storeu_si256((__m256i *)(out + x),
+                          _mm256_blendv_epi8(off_v, on_v, set));
+    }
+  }
+}
+
+#endif
+
+// Picks the kernel for expand_screen() on its first call.
+static expand_fn select_kernel() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return expand_screen_avx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return expand_screen_sse2;
+  }
+#endif
+  return expand_screen_scalar;
+}
+
+void expand_screen(const uint64_t *screen, uint32_t *pixels, int pitch,
+                   uint32_t on, uint32_t off) {
+  static expand_fn kernel = NULL;
+  if (kernel == NULL) {
+    kernel = select_kernel();
+  }
+  kernel(screen, pixels, pitch, on, off);
+}
@@ -0,0 +1,30 @@
+#ifndef EXPAND_H
+#define EXPAND_H
+
+#include <stdint.h>
+
+// Kernels which expand the packed 1-bit chip8 screen (see chip8.screen) into
+// 32-bit pixels, DISPLAY_WIDTH x DISPLAY_HEIGHT of them. Set pixels become
+// |on| and unset pixels |off|. Rows are |pitch| pixels apart in |pixels|.
+typedef void (*expand_fn)(const uint64_t *screen, uint32_t *pixels, int pitch,
+                          uint32_t on, uint32_t off);
+
+// Expands |screen| with the fastest kernel the CPU supports.
+void expand_screen(const uint64_t *screen, uint32_t *pixels, int pitch,
+                   uint32_t on, uint32_t off);
+
+// Portable kernel, one pixel at a time.
+void expand_screen_scalar(const uint64_t *screen, uint32_t *pixels, int pitch,
+                          uint32_t on, uint32_t off);
+
+#if defined(__x86_64__) || defined(__i386__)
+// 4 pixels at a time.
+void expand_screen_sse2(const uint64_t *screen, uint32_t *pixels, int pitch,
+                        uint32_t on, uint32_t off);
+
+// 8 pixels at a time. Must only be called if the CPU supports AVX2.
+void expand_screen_avx2(const uint64_t *screen, uint32_t *pixels, int pitch,
+                        uint32_t on, uint32_t off);
+#endif
+
+#endif // EXPAND_H
@@ -0,0 +1,28 @@
+#include "input_queue.h"
+
+void input_queue_init(input_queue *q) {
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+}
+
+int input_queue_push(input_queue *q, const input_event *e) {
+  uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+  if (tail - head == INPUT_QUEUE_SIZE) {
+    return 1;
+  }
+  q->events[tail % INPUT_QUEUE_SIZE] = *e;
+  atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+  return 0;
+}
+
+int input_queue_pop(input_queue *q, input_event *e) {
+  uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+  if (head == tail) {
+    return 1;
+  }
+  *e = q->events[head % INPUT_QUEUE_SIZE];
+  atomic_store_explicit(&q->head, head + 1, memory_order_release);
+  return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef INPUT_QUEUE_H
+#define INPUT_QUEUE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// The most events the queue holds. Must be a power of 2.
+#define INPUT_QUEUE_SIZE 256
+
+typedef enum input_type {
+  // A key of the hex keypad, |key|, was pressed or released.
+  INPUT_KEY = 0,
+  // The window was closed.
+  INPUT_QUIT,
+  // The rewind key was pressed or released.
+  INPUT_REWIND,
+  // The fast-forward key was pressed.
+  INPUT_TURBO,
+} input_type;
+
+// An input event, as handed from the thread reading input to the emulation
+// thread.
+typedef struct input_event {
+  // When the event happened, in SDL_GetTicks() milliseconds.
+  uint32_t time;
+  uint8_t type;
+  uint8_t key;
+  uint8_t pressed;
+} input_event;
+
+// A lock-free queue of input events from one producer thread to one consumer
+// thread.
+typedef struct input_queue {
+  input_event events[INPUT_QUEUE_SIZE];
+
+  // The number of events ever popped and pushed. Each is only written by one
+  // thread, on a cache line of its own.
+  _Alignas(64) _Atomic uint32_t head;
+  _Alignas(64) _Atomic uint32_t tail;
+} input_queue;
+
+void input_queue_init(input_queue *q);
+
+// Adds |e| to the queue. Returns a nonzero value, dropping |e|, if the queue
+// is full. Only called by the producer.
+int input_queue_push(input_queue *q, const input_event *e);
+
+// Takes the oldest event off the queue into |e|. Returns a nonzero value if
+// the queue is empty. Only called by the consumer.
+int input_queue_pop(input_queue *q, input_event *e);
+
+#endif // INPUT_QUEUE_H
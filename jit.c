@@ -0,0 +1,504 @@
+#include "jit.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Size of the buffer holding translated code. When it fills up every block is
+// dropped and translation starts over.
+#define JIT_CODE_SIZE (4 * 1024 * 1024)
+
+// The maximum number of instructions translated into a single block.
+#define JIT_MAX_BLOCK 64
+
+// The largest amount of code a single instruction translates to, in bytes.
+#define JIT_MAX_INSTRUCTION_SIZE 48
+
+// The largest amount of code a block translates to, with its exit.
+#define JIT_MAX_BLOCK_SIZE ((JIT_MAX_BLOCK + 1) * JIT_MAX_INSTRUCTION_SIZE)
+
+// A translated block. It takes the chip8 it runs on and returns the number of
+// cycles it executed, after storing the address of the next instruction in
+// |pc|.
+typedef uint32_t (*jit_block_fn)(chip8 *system);
+
+typedef enum jit_block_state {
+  // The address hasn't been translated yet (or has been invalidated).
+  BLOCK_UNTRANSLATED = 0,
+  // |fn| holds the translation of the block starting at the address.
+  BLOCK_TRANSLATED,
+  // The instruction at the address can't be translated, so it is always
+  // interpreted.
+  BLOCK_INTERPRETED,
+} jit_block_state;
+
+typedef struct jit_block {
+  jit_block_fn fn;
+
+  // One past the last byte of memory the block was translated from.
+  uint16_t end;
+
+  // The most cycles a single run of the block can take.
+  uint8_t max_cycles;
+
+  // The jit_block_state of the block.
+  uint8_t state;
+} jit_block;
+
+struct jit {
+  // Translated code. It is never writable and executable at once: the pages a
+  // block is emitted into are made writable for the translation, and
+  // executable again after it.
+  uint8_t *code;
+  size_t page_size;
+
+  // The number of bytes of |code| in use.
+  size_t used;
+
+  // Block |pc / 2| is the block starting at the even address |pc|. Like
+  // chip8.decoded there are two extra blocks for a |pc| past the end of memory,
+  // which are always interpreted.
+  jit_block blocks[4096 / 2 + 2];
+};
+
+jit *jit_create() {
+  jit *j = calloc(1, sizeof(jit));
+  if (j == NULL) {
+    return NULL;
+  }
+
+  j->page_size = sysconf(_SC_PAGESIZE);
+  j->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (j->code == MAP_FAILED) {
+    free(j);
+    return NULL;
+  }
+
+  // Policies such as SELinux's execmem forbid making memory executable, so
+  // find out now, and leave ENGINE_JIT to the threaded interpreter.
+  if (mprotect(j->code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC) != 0) {
+    munmap(j->code, JIT_CODE_SIZE);
+    free(j);
+    return NULL;
+  }
+
+  return j;
+}
+
+void jit_destroy(jit *j) {
+  if (j == NULL) {
+    return;
+  }
+  munmap(j->code, JIT_CODE_SIZE);
+  free(j);
+}
+
+void jit_invalidate(jit *j, uint16_t address, uint16_t length) {
+  if (length == 0) {
+    return;
+  }
+
+  uint32_t last = (uint32_t)address + length - 1;
+
+  // Only blocks starting at most JIT_MAX_BLOCK instructions before |address|
+  // can contain it.
+  uint32_t first = address > JIT_MAX_BLOCK * 2 ? address - JIT_MAX_BLOCK * 2
+                                               : 0;
+  for (uint32_t start = first & ~1; start <= last && start < 4096;
+       start += 2) {
+    jit_block *block = &j->blocks[start >> 1];
+    if (block->state != BLOCK_UNTRANSLATED && block->end > address) {
+      block->state = BLOCK_UNTRANSLATED;
+    }
+  }
+}
+
+// Machine code emission.
+//
+// Every memory operand is addressed relative to the chip8 pointer in rdi,
+// using a 32-bit displacement (ModRM mod = 10, rm = 111).
+
+typedef struct emitter {
+  uint8_t *p;
+} emitter;
+
+static void emit8(emitter *e, uint8_t b) { *e->p++ = b; }
+
+static void emit16(emitter *e, uint16_t v) {
+  memcpy(e->p, &v, sizeof(v));
+  e->p += sizeof(v);
+}
+
+static void emit32(emitter *e, uint32_t v) {
+  memcpy(e->p, &v, sizeof(v));
+  e->p += sizeof(v);
+}
+
+// Emits the ModRM byte and displacement for [rdi + |disp|] with the register
+// (or opcode extension) |reg|.
+static void emit_mem(emitter *e, uint8_t reg, uint32_t disp) {
+  emit8(e, 0x80 | (reg << 3) | 7);
+  emit32(e, disp);
+}
+
+#define REG_AL 0
+#define REG_CL 1
+
+#define V_OFFSET(x) ((uint32_t)(offsetof(chip8, V) + (x)))
+#define I_OFFSET ((uint32_t)offsetof(chip8, I))
+#define PC_OFFSET ((uint32_t)offsetof(chip8, pc))
+
+// mov r8, byte [V + x]
+static void emit_load_v(emitter *e, uint8_t reg, uint8_t x) {
+  emit8(e, 0x8A);
+  emit_mem(e, reg, V_OFFSET(x));
+}
+
+// mov byte [V + x], r8
+static void emit_store_v(emitter *e, uint8_t reg, uint8_t x) {
+  emit8(e, 0x88);
+  emit_mem(e, reg, V_OFFSET(x));
+}
+
+// mov word [pc], |address|
+static void emit_set_pc(emitter *e, uint16_t address) {
+  emit8(e, 0x66);
+  emit8(e, 0xC7);
+  emit_mem(e, 0, PC_OFFSET);
+  emit16(e, address);
+}
+
+// mov eax, |cycles|; ret
+static void emit_return(emitter *e, uint32_t cycles) {
+  emit8(e, 0xB8);
+  emit32(e, cycles);
+  emit8(e, 0xC3);
+}
+
+// Emits the exit of a block ending in a skip instruction at |address|, whose
+// comparison has just set the flags. |skip_jcc| is the short conditional jump
+// opcode taken when the following instruction should NOT be skipped.
+static void emit_skip_exit(emitter *e, uint8_t skip_jcc, uint16_t address,
+                           uint32_t cycles) {
+  // Assume the following instruction runs. Neither mov changes the flags.
+  emit_set_pc(e, address + 2);
+  emit8(e, 0xB8);
+  emit32(e, cycles);
+
+  emit8(e, skip_jcc);
+  emit8(e, 11);
+
+  // The skipped instruction still takes a cycle.
+  emit_set_pc(e, address + 4); // 9 bytes
+  emit8(e, 0xFF);              // inc eax, 2 bytes
+  emit8(e, 0xC0);
+
+  emit8(e, 0xC3);
+}
+
+// Returns nonzero if the instruction with |opcode| sets VF and also uses it as
+// VX or VY, in which case it reads back its own carry flag. Those are left to
+// the interpreter.
+static uint8_t uses_vf(opcode_t opcode, uint8_t x, uint8_t y) {
+  switch (opcode) {
+  case ADD_X_Y:
+  case SUB_X_Y:
+  case SUB_X_Y_REV:
+  case SHIFT_X_RIGHT:
+  case SHIFT_X_LEFT:
+    return x == 0xF || y == 0xF;
+  default:
+    return 0;
+  }
+}
+
+// Translates the straight-line instruction |next|. Returns zero if it isn't
+// one this JIT handles.
+static uint8_t emit_instruction(emitter *e, instruction next) {
+  uint8_t x = X(next);
+  uint8_t y = Y(next);
+  if (uses_vf(next.opcode, x, y)) {
+    return 0;
+  }
+
+  switch (next.opcode) {
+  case SET_X_NN:
+    // mov byte [VX], NN
+    emit8(e, 0xC6);
+    emit_mem(e, 0, V_OFFSET(x));
+    emit8(e, NN(next));
+    return 1;
+  case ADD_X_NN:
+    // add byte [VX], NN
+    emit8(e, 0x80);
+    emit_mem(e, 0, V_OFFSET(x));
+    emit8(e, NN(next));
+    return 1;
+  case SET_X_Y:
+    emit_load_v(e, REG_AL, y);
+    emit_store_v(e, REG_AL, x);
+    return 1;
+  case OR_X_Y:
+  case AND_X_Y:
+  case XOR_X_Y:
+    emit_load_v(e, REG_AL, y);
+    // or / and / xor byte [VX], al
+    if (next.opcode == OR_X_Y) {
+      emit8(e, 0x08);
+    } else if (next.opcode == AND_X_Y) {
+      emit8(e, 0x20);
+    } else {
+      emit8(e, 0x30);
+    }
+    emit_mem(e, REG_AL, V_OFFSET(x));
+    return 1;
+  case ADD_X_Y:
+    emit_load_v(e, REG_AL, y);
+    // add byte [VX], al; setc byte [VF]
+    emit8(e, 0x00);
+    emit_mem(e, REG_AL, V_OFFSET(x));
+    emit8(e, 0x0F);
+    emit8(e, 0x92);
+    emit_mem(e, 0, V_OFFSET(0xF));
+    return 1;
+  case SUB_X_Y:
+    emit_load_v(e, REG_AL, x);
+    // sub al, byte [VY]
+    emit8(e, 0x2A);
+    emit_mem(e, REG_AL, V_OFFSET(y));
+    emit_store_v(e, REG_AL, x);
+    // setnc byte [VF]
+    emit8(e, 0x0F);
+    emit8(e, 0x93);
+    emit_mem(e, 0, V_OFFSET(0xF));
+    return 1;
+  case SUB_X_Y_REV:
+    // Matches sub_x_y_rev(), which always sets VF to 1.
+    emit_load_v(e, REG_AL, y);
+    emit8(e, 0x2A);
+    emit_mem(e, REG_AL, V_OFFSET(x));
+    emit_store_v(e, REG_AL, x);
+    emit8(e, 0xC6);
+    emit_mem(e, 0, V_OFFSET(0xF));
+    emit8(e, 1);
+    return 1;
+  case SHIFT_X_RIGHT:
+  case SHIFT_X_LEFT:
+    emit_load_v(e, REG_AL, x);
+    // mov cl, al
+    emit8(e, 0x88);
+    emit8(e, 0xC1);
+    if (next.opcode == SHIFT_X_RIGHT) {
+      // and cl, 1
+      emit8(e, 0x80);
+      emit8(e, 0xE1);
+      emit8(e, 0x01);
+    } else {
+      // shr cl, 7
+      emit8(e, 0xC0);
+      emit8(e, 0xE9);
+      emit8(e, 0x07);
+    }
+    emit_store_v(e, REG_CL, 0xF);
+    // shr al, 1 / shl al, 1
+    emit8(e, 0xD0);
+    emit8(e, next.opcode == SHIFT_X_RIGHT ? 0xE8 : 0xE0);
+    emit_store_v(e, REG_AL, x);
+    return 1;
+  case SET_I_NNN:
+    // mov word [I], NNN
+    emit8(e, 0x66);
+    emit8(e, 0xC7);
+    emit_mem(e, 0, I_OFFSET);
+    emit16(e, NNN(next));
+    return 1;
+  case ADD_X_I:
+    // movzx eax, byte [VX]; add word [I], ax
+    emit8(e, 0x0F);
+    emit8(e, 0xB6);
+    emit_mem(e, REG_AL, V_OFFSET(x));
+    emit8(e, 0x66);
+    emit8(e, 0x01);
+    emit_mem(e, REG_AL, I_OFFSET);
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+// Translates |next|, found at |address| after |count| other instructions, if
+// it is an instruction that ends a block. Returns zero otherwise.
+static uint8_t emit_exit(emitter *e, instruction next, uint16_t address,
+                         uint32_t count) {
+  uint8_t x = X(next);
+  uint8_t y = Y(next);
+
+  switch (next.opcode) {
+  case JUMP:
+    emit_set_pc(e, NNN(next));
+    emit_return(e, count + 1);
+    return 1;
+  case IF_X_EQ_NN:
+  case IF_X_NEQ_NN:
+    // cmp byte [VX], NN
+    emit8(e, 0x80);
+    emit_mem(e, 7, V_OFFSET(x));
+    emit8(e, NN(next));
+    // Don't skip on jne (for ==) or je (for !=).
+    emit_skip_exit(e, next.opcode == IF_X_EQ_NN ? 0x75 : 0x74, address,
+                   count + 1);
+    return 1;
+  case IF_X_EQ_Y:
+  case IF_X_NEQ_Y:
+    // mov al, byte [VX]; cmp al, byte [VY]
+    emit_load_v(e, REG_AL, x);
+    emit8(e, 0x3A);
+    emit_mem(e, REG_AL, V_OFFSET(y));
+    emit_skip_exit(e, next.opcode == IF_X_EQ_Y ? 0x75 : 0x74, address,
+                   count + 1);
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+// Sets the protection of the pages of |j->code| holding the |length| bytes at
+// |p| to |prot|. Returns a nonzero value on failure.
+static int protect(jit *j, uint8_t *p, size_t length, int prot) {
+  uintptr_t mask = j->page_size - 1;
+  uintptr_t first = (uintptr_t)p & ~mask;
+  uintptr_t end = ((uintptr_t)p + length + mask) & ~mask;
+  return mprotect((void *)first, end - first, prot);
+}
+
+// Translates the block starting at the even address |start|.
+static void translate(jit *j, const chip8 *system, uint16_t start) {
+  jit_block *block = &j->blocks[start >> 1];
+
+  if (JIT_CODE_SIZE - j->used < JIT_MAX_BLOCK_SIZE) {
+    // Out of space, start over.
+    memset(j->blocks, 0, sizeof(j->blocks));
+    j->used = 0;
+  }
+
+  emitter e = {j->code + j->used};
+  uint8_t *entry = e.p;
+  if (protect(j, entry, JIT_MAX_BLOCK_SIZE, PROT_READ | PROT_WRITE) != 0) {
+    block->state = BLOCK_INTERPRETED;
+    block->end = start + 2;
+    return;
+  }
+
+  uint32_t count = 0;
+  uint16_t address = start;
+  uint8_t max_cycles = 0;
+  // The last few instructions in memory are left to the interpreter, which
+  // traps if |pc| would run past the end.
+  while (count < JIT_MAX_BLOCK && address + 6 <= sizeof(system->memory)) {
+    instruction next;
+    next.hi = system->memory[address];
+    next.lo = system->memory[address + 1];
+    next.opcode = decode_opcode(next.hi, next.lo);
+
+    if (emit_exit(&e, next, address, count)) {
+      // A skip may also take a cycle for the instruction it skips.
+      max_cycles = next.opcode == JUMP ? count + 1 : count + 2;
+      address += 2;
+      break;
+    }
+    if (!emit_instruction(&e, next)) {
+      break;
+    }
+    ++count;
+    address += 2;
+  }
+
+  if (max_cycles == 0) {
+    if (count == 0) {
+      // The first instruction can't be translated.
+      protect(j, entry, JIT_MAX_BLOCK_SIZE, PROT_READ | PROT_EXEC);
+      block->state = BLOCK_INTERPRETED;
+      block->end = start + 2;
+      return;
+    }
+    // Continue with the instruction that ended the block.
+    emit_set_pc(&e, address);
+    emit_return(&e, count);
+    max_cycles = count;
+  }
+
+  if (protect(j, entry, JIT_MAX_BLOCK_SIZE, PROT_READ | PROT_EXEC) != 0) {
+    // Blocks sharing a page with this one can't run either, so drop them all.
+    memset(j->blocks, 0, sizeof(j->blocks));
+    j->used = 0;
+    block->state = BLOCK_INTERPRETED;
+    block->end = start + 2;
+    return;
+  }
+
+  j->used += e.p - entry;
+  block->fn = (jit_block_fn)entry;
+  block->end = address;
+  block->max_cycles = max_cycles;
+  block->state = BLOCK_TRANSLATED;
+}
+
+void run_jit(chip8 *system, uint64_t cycles) {
+  jit *j = system->jit;
+  if (j == NULL) {
+    run_threaded(system, cycles);
+    return;
+  }
+
+  while (cycles > 0 && !system->trap) {
+    uint16_t pc = system->pc;
+
+    // Skipped instructions and odd addresses are left to the interpreter.
+    if (system->skip || (pc & 1)) {
+      emulate_cycle(system);
+      --cycles;
+      continue;
+    }
+
+    jit_block *block = &j->blocks[system->pc >> 1];
+    if (block->state == BLOCK_UNTRANSLATED) {
+      translate(j, system, system->pc);
+    }
+
+    // Only run the block if it can't overshoot |cycles|.
+    if (block->state == BLOCK_TRANSLATED && block->max_cycles <= cycles) {
+      uint32_t executed = block->fn(system);
+      advance_cycles(system, executed);
+      cycles -= executed;
+    } else {
+      emulate_cycle(system);
+      --cycles;
+    }
+
+    if ((uint16_t)(pc - system->pc) <= 4) {
+      // Went back by at most 2 instructions, which might be an idle loop.
+      cycles -= skip_idle_loop(system, cycles);
+    }
+  }
+}
+
+#else
+
+jit *jit_create() { return NULL; }
+
+void jit_destroy(jit *j) {}
+
+void jit_invalidate(jit *j, uint16_t address, uint16_t length) {}
+
+void run_jit(chip8 *system, uint64_t cycles) { run_threaded(system, cycles); }
+
+#endif
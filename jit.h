@@ -0,0 +1,38 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdint.h>
+
+#include "chip8.h"
+
+// A dynamic recompiler which translates straight-line runs of chip8
+// instructions into native x86-64 code.
+//
+// A block starts at the address of |pc| and contains register and index
+// arithmetic (6XNN, 7XNN, 8XYN, ANNN, FX1E). It ends at a JUMP or one of the
+// skip instructions, which are translated as the block's exit, or just before
+// any other instruction. Those (drawing, input, timers, subroutines, memory
+// access...) are left to the interpreter.
+//
+// The translated code reads and writes |V|, |I| and |pc| of the chip8 struct
+// directly. Blocks are invalidated through invalidate_decoded() whenever memory
+// they were translated from is written to, e.g. by BCD (FX33) or REG_DUMP
+// (FX55).
+typedef struct jit jit;
+
+// Creates an empty translation cache. Returns NULL if the host isn't x86-64 or
+// executable memory can't be allocated, in which case ENGINE_JIT runs the
+// threaded interpreter instead.
+jit *jit_create();
+
+void jit_destroy(jit *j);
+
+// Drops the translations of any block containing one of the |length| bytes
+// starting at |address|.
+void jit_invalidate(jit *j, uint16_t address, uint16_t length);
+
+// Runs exactly |cycles| cycles of |system|, executing translated blocks where
+// possible and emulate_cycle() for everything else.
+void run_jit(chip8 *system, uint64_t cycles);
+
+#endif // JIT_H
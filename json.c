@@ -0,0 +1,15 @@
+#include "json.h"
+
+void print_json_string(FILE *f, const char *s) {
+  fputc('"', f);
+  for (; *s != '\0'; ++s) {
+    if (*s == '"' || *s == '\\') {
+      fprintf(f, "\\%c", *s);
+    } else if ((unsigned char)*s < 0x20) {
+      fprintf(f, "\\u%04x", *s);
+    } else {
+      fputc(*s, f);
+    }
+  }
+  fputc('"', f);
+}
@@ -0,0 +1,9 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include <stdio.h>
+
+// Prints |s| as a JSON string, quoted and escaped.
+void print_json_string(FILE *f, const char *s);
+
+#endif // JSON_H
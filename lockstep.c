@@ -0,0 +1,844 @@
+#include "lockstep.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// Lanes are processed in blocks of this many, the number of bytes in an AVX2
+// register. Every array is padded to a multiple of it.
+#define LANE_BLOCK 32
+
+#define MEMORY_SIZE 4096
+#define STACK_SIZE 16
+
+// Values of lockstep.uniform.
+#define SLOT_DIFFERS 0
+#define SLOT_SAME 1
+#define SLOT_UNKNOWN 2
+
+struct lockstep {
+  // The number of lanes, and that number rounded up to LANE_BLOCK. The lanes
+  // past |lanes| are padding and are always halted.
+  uint32_t lanes;
+  uint32_t width;
+
+  // The number of lanes which aren't halted.
+  uint32_t running;
+
+  // Whether to use the AVX2 kernels.
+  uint8_t use_simd;
+
+  // Shared by all lanes, see chip8.cycle, chip8.clock_speed and
+  // chip8.timer_phase.
+  uint64_t cycle;
+  uint32_t clock_speed;
+  uint32_t timer_phase;
+
+  // Per lane state, see the chip8 struct. Arrays of registers are indexed by
+  // register first, e.g. V[x * width + lane].
+  uint8_t *V;
+  uint16_t *I;
+  uint16_t *pc;
+  uint16_t *stack;
+  uint8_t *sp;
+  uint8_t *keys;
+  uint8_t *skip;
+  uint8_t *delay_timer;
+  uint8_t *sound_timer;
+  uint8_t *waiting_for_key;
+  uint8_t *key_register;
+  uint8_t *trap;
+  uint64_t *rng;
+  uint8_t *libc_rand;
+
+  // Memory and screen are indexed by lane first, e.g.
+  // memory[lane * MEMORY_SIZE + address].
+  uint8_t *memory;
+  uint64_t *screen;
+
+  // Set for lanes which trapped (or are padding) and no longer run. The cycle
+  // count and timer phase they stopped at are kept for lockstep_get_lane().
+  uint8_t *halted;
+  uint64_t *halted_cycle;
+  uint32_t *halted_phase;
+
+  // The number of lanes which trapped in the current cycle.
+  uint32_t new_traps;
+
+  // Scratch space for the group of lanes executing an instruction together.
+  uint8_t *group;
+
+  // Whether the instruction at |address| is the same in every running lane, at
+  // index |address / 2|. The slots past the end of memory are for a |pc| which
+  // ran off the end, see chip8.decoded.
+  uint8_t uniform[MEMORY_SIZE / 2 + 2];
+};
+
+// Allocates |size| zeroed bytes, aligned for AVX2 loads.
+static void *alloc_lanes(size_t size) {
+  size = (size + LANE_BLOCK - 1) / LANE_BLOCK * LANE_BLOCK;
+  void *p = aligned_alloc(LANE_BLOCK, size);
+  if (p != NULL) {
+    memset(p, 0, size);
+  }
+  return p;
+}
+
+lockstep *lockstep_create(uint32_t lanes) {
+  lockstep *ls = calloc(1, sizeof(lockstep));
+  if (ls == NULL) {
+    return NULL;
+  }
+
+  uint32_t width = (lanes + LANE_BLOCK - 1) / LANE_BLOCK * LANE_BLOCK;
+  ls->lanes = lanes;
+  ls->width = width;
+  ls->running = lanes;
+  ls->clock_speed = CLOCK_SPEED;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  ls->use_simd = __builtin_cpu_supports("avx2") != 0;
+#endif
+
+  ls->V = alloc_lanes(16 * width);
+  ls->I = alloc_lanes(width * sizeof(uint16_t));
+  ls->pc = alloc_lanes(width * sizeof(uint16_t));
+  ls->stack = alloc_lanes(STACK_SIZE * width * sizeof(uint16_t));
+  ls->sp = alloc_lanes(width);
+  ls->keys = alloc_lanes(16 * width);
+  ls->skip = alloc_lanes(width);
+  ls->delay_timer = alloc_lanes(width);
+  ls->sound_timer = alloc_lanes(width);
+  ls->waiting_for_key = alloc_lanes(width);
+  ls->key_register = alloc_lanes(width);
+  ls->trap = alloc_lanes(width);
+  ls->rng = alloc_lanes(width * sizeof(uint64_t));
+  ls->libc_rand = alloc_lanes(width);
+  ls->memory = alloc_lanes((size_t)width * MEMORY_SIZE);
+  ls->screen = alloc_lanes(width * DISPLAY_HEIGHT * sizeof(uint64_t));
+  ls->halted = alloc_lanes(width);
+  ls->halted_cycle = alloc_lanes(width * sizeof(uint64_t));
+  ls->halted_phase = alloc_lanes(width * sizeof(uint32_t));
+  ls->group = alloc_lanes(width);
+
+  if (ls->V == NULL || ls->I == NULL || ls->pc == NULL || ls->stack == NULL ||
+      ls->sp == NULL || ls->keys == NULL || ls->skip == NULL ||
+      ls->delay_timer == NULL || ls->sound_timer == NULL ||
+      ls->waiting_for_key == NULL || ls->key_register == NULL ||
+      ls->trap == NULL || ls->rng == NULL || ls->libc_rand == NULL ||
+      ls->memory == NULL || ls->screen == NULL ||
+      ls->halted == NULL || ls->halted_cycle == NULL ||
+      ls->halted_phase == NULL || ls->group == NULL) {
+    lockstep_destroy(ls);
+    return NULL;
+  }
+
+  for (uint32_t lane = lanes; lane < width; ++lane) {
+    ls->halted[lane] = 1;
+  }
+  memset(ls->uniform, SLOT_SAME, sizeof(ls->uniform));
+  return ls;
+}
+
+void lockstep_destroy(lockstep *ls) {
+  if (ls == NULL) {
+    return;
+  }
+  free(ls->V);
+  free(ls->I);
+  free(ls->pc);
+  free(ls->stack);
+  free(ls->sp);
+  free(ls->keys);
+  free(ls->skip);
+  free(ls->delay_timer);
+  free(ls->sound_timer);
+  free(ls->waiting_for_key);
+  free(ls->key_register);
+  free(ls->trap);
+  free(ls->rng);
+  free(ls->libc_rand);
+  free(ls->memory);
+  free(ls->screen);
+  free(ls->halted);
+  free(ls->halted_cycle);
+  free(ls->halted_phase);
+  free(ls->group);
+  free(ls);
+}
+
+void lockstep_set_lane(lockstep *ls, uint32_t lane, const chip8 *system) {
+  uint32_t w = ls->width;
+  for (int r = 0; r < 16; ++r) {
+    ls->V[r * w + lane] = system->V[r];
+    ls->keys[r * w + lane] = system->keys[r];
+  }
+  for (int i = 0; i < STACK_SIZE; ++i) {
+    ls->stack[i * w + lane] = system->stack[i];
+  }
+  ls->I[lane] = system->I;
+  ls->pc[lane] = system->pc;
+  ls->sp[lane] = system->sp;
+  ls->skip[lane] = system->skip;
+  ls->delay_timer[lane] = system->delay_timer;
+  ls->sound_timer[lane] = system->sound_timer;
+  ls->waiting_for_key[lane] = system->waiting_for_key;
+  ls->key_register[lane] = system->key_register;
+  ls->trap[lane] = system->trap;
+  ls->rng[lane] = system->rng;
+  ls->libc_rand[lane] = system->libc_rand;
+  memcpy(ls->memory + (size_t)lane * MEMORY_SIZE, system->memory, MEMORY_SIZE);
+  memcpy(ls->screen + lane * DISPLAY_HEIGHT, system->screen,
+         sizeof(system->screen));
+
+  if (ls->halted[lane]) {
+    ++ls->running;
+  }
+  ls->halted[lane] = system->trap != TRAP_NONE;
+  ls->halted_cycle[lane] = system->cycle;
+  ls->halted_phase[lane] = system->timer_phase;
+  if (ls->halted[lane]) {
+    --ls->running;
+  }
+
+  ls->cycle = system->cycle;
+  ls->clock_speed = system->clock_speed;
+  ls->timer_phase = system->timer_phase;
+
+  // Memory past the end is always invalid, whatever the lanes hold.
+  memset(ls->uniform, SLOT_UNKNOWN, MEMORY_SIZE / 2);
+}
+
+void lockstep_get_lane(const lockstep *ls, uint32_t lane, chip8 *system) {
+  uint32_t w = ls->width;
+  for (int r = 0; r < 16; ++r) {
+    system->V[r] = ls->V[r * w + lane];
+    system->keys[r] = ls->keys[r * w + lane];
+  }
+  for (int i = 0; i < STACK_SIZE; ++i) {
+    system->stack[i] = ls->stack[i * w + lane];
+  }
+  system->I = ls->I[lane];
+  system->pc = ls->pc[lane];
+  system->sp = ls->sp[lane];
+  system->skip = ls->skip[lane];
+  system->delay_timer = ls->delay_timer[lane];
+  system->sound_timer = ls->sound_timer[lane];
+  system->waiting_for_key = ls->waiting_for_key[lane];
+  system->key_register = ls->key_register[lane];
+  system->trap = ls->trap[lane];
+  system->rng = ls->rng[lane];
+  system->libc_rand = ls->libc_rand[lane];
+  memcpy(system->memory, ls->memory + (size_t)lane * MEMORY_SIZE, MEMORY_SIZE);
+  invalidate_decoded(system, 0, MEMORY_SIZE);
+  memcpy(system->screen, ls->screen + lane * DISPLAY_HEIGHT,
+         sizeof(system->screen));
+
+  system->clock_speed = ls->clock_speed;
+  if (ls->halted[lane]) {
+    system->cycle = ls->halted_cycle[lane];
+    system->timer_phase = ls->halted_phase[lane];
+  } else {
+    system->cycle = ls->cycle;
+    system->timer_phase = ls->timer_phase;
+  }
+}
+
+void lockstep_set_key(lockstep *ls, uint32_t lane, uint8_t key,
+                      uint8_t pressed) {
+  ls->keys[(key & 0xF) * ls->width + lane] = pressed;
+
+  if (pressed && ls->waiting_for_key[lane]) {
+    ls->V[ls->key_register[lane] * ls->width + lane] = key & 0xF;
+    ls->waiting_for_key[lane] = 0;
+    ls->pc[lane] += 2;
+  }
+}
+
+void lockstep_set_simd(lockstep *ls, uint8_t enabled) {
+#if defined(__x86_64__) || defined(__i386__)
+  ls->use_simd = enabled && __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+// Returns the instruction at |pc| in |memory|, or an UNKNOWN instruction if it
+// is past the end.
+static instruction fetch(const uint8_t *memory, uint16_t pc) {
+  instruction next;
+  if (pc + 1 >= MEMORY_SIZE) {
+    next.hi = next.lo = 0;
+    next.opcode = UNKNOWN;
+    return next;
+  }
+  next.hi = memory[pc];
+  next.lo = memory[pc + 1];
+  next.opcode = decode_opcode(next.hi, next.lo);
+  return next;
+}
+
+// Marks the instruction slots covering |length| bytes at |address| as possibly
+// differing between lanes.
+static void wrote_memory(lockstep *ls, uint16_t address, uint16_t length) {
+  for (uint32_t slot = address >> 1; slot <= (address + length - 1u) >> 1;
+       ++slot) {
+    ls->uniform[slot] = SLOT_UNKNOWN;
+  }
+}
+
+// Returns whether the instruction at the even address |pc| is the same in
+// every running lane.
+static uint8_t is_uniform(lockstep *ls, uint16_t pc) {
+  uint8_t *slot = &ls->uniform[pc >> 1];
+  if (*slot == SLOT_UNKNOWN) {
+    *slot = SLOT_SAME;
+    const uint8_t *first = NULL;
+    for (uint32_t lane = 0; lane < ls->lanes; ++lane) {
+      if (ls->halted[lane]) {
+        continue;
+      }
+      const uint8_t *code = ls->memory + (size_t)lane * MEMORY_SIZE + pc;
+      if (first == NULL) {
+        first = code;
+      } else if (code[0] != first[0] || code[1] != first[1]) {
+        *slot = SLOT_DIFFERS;
+        break;
+      }
+    }
+  }
+  return *slot == SLOT_SAME;
+}
+
+// Halts |lane| with |trap|, see raise_trap().
+static void lane_trap(lockstep *ls, uint32_t lane, trap_t trap) {
+  if (ls->trap[lane] == TRAP_NONE) {
+    ls->trap[lane] = trap;
+    ++ls->new_traps;
+  }
+}
+
+// Returns whether the |length| bytes at |I| of |lane| are in memory, trapping
+// if they aren't.
+static uint8_t lane_i_ok(lockstep *ls, uint32_t lane, uint16_t length) {
+  if (ls->I[lane] + length > MEMORY_SIZE) {
+    lane_trap(ls, lane, TRAP_BAD_ADDRESS);
+    return 0;
+  }
+  return 1;
+}
+
+// Executes one cycle of |lane| on its own, exactly like emulate_cycle() but
+// without updating the timers.
+static void step_lane(lockstep *ls, uint32_t lane) {
+  uint32_t w = ls->width;
+#define V(r) ls->V[(r) * w + lane]
+
+  if (ls->skip[lane]) {
+    ls->skip[lane] = 0;
+    ls->pc[lane] += 2;
+    return;
+  }
+
+  uint8_t *memory = ls->memory + (size_t)lane * MEMORY_SIZE;
+  uint64_t *screen = ls->screen + lane * DISPLAY_HEIGHT;
+  instruction next = fetch(memory, ls->pc[lane]);
+  uint8_t x = X(next);
+  uint8_t y = Y(next);
+  uint8_t jumped = 0;
+
+  switch (next.opcode) {
+  case CLEAR_SCREEN:
+    memset(screen, 0, DISPLAY_HEIGHT * sizeof(uint64_t));
+    break;
+  case RETURN:
+    if (ls->sp[lane] == 0) {
+      lane_trap(ls, lane, TRAP_STACK_UNDERFLOW);
+      jumped = 1;
+      break;
+    }
+    ls->sp[lane] -= 1;
+    ls->pc[lane] = ls->stack[ls->sp[lane] * w + lane];
+    break;
+  case JUMP:
+    ls->pc[lane] = NNN(next);
+    jumped = 1;
+    break;
+  case CALL:
+    if (ls->sp[lane] >= STACK_SIZE) {
+      lane_trap(ls, lane, TRAP_STACK_OVERFLOW);
+      jumped = 1;
+      break;
+    }
+    ls->stack[ls->sp[lane] * w + lane] = ls->pc[lane];
+    ls->sp[lane] += 1;
+    ls->pc[lane] = NNN(next);
+    jumped = 1;
+    break;
+  case IF_X_EQ_NN:
+    ls->skip[lane] = V(x) == NN(next);
+    break;
+  case IF_X_NEQ_NN:
+    ls->skip[lane] = V(x) != NN(next);
+    break;
+  case IF_X_EQ_Y:
+    ls->skip[lane] = V(x) == V(y);
+    break;
+  case SET_X_NN:
+    V(x) = NN(next);
+    break;
+  case ADD_X_NN:
+    V(x) += NN(next);
+    break;
+  case SET_X_Y:
+    V(x) = V(y);
+    break;
+  case OR_X_Y:
+    V(x) |= V(y);
+    break;
+  case AND_X_Y:
+    V(x) &= V(y);
+    break;
+  case XOR_X_Y:
+    V(x) ^= V(y);
+    break;
+  // VF is written before VX, as in the regular handlers.
+  case ADD_X_Y:
+    V(0xF) = V(x) + V(y) > 255;
+    V(x) = V(x) + V(y);
+    break;
+  case SUB_X_Y:
+    V(0xF) = V(x) >= V(y);
+    V(x) = V(x) - V(y);
+    break;
+  case SHIFT_X_RIGHT:
+    V(0xF) = V(x) & 1;
+    V(x) = V(x) >> 1;
+    break;
+  case SUB_X_Y_REV:
+    V(0xF) = 1;
+    V(x) = V(y) - V(x);
+    break;
+  case SHIFT_X_LEFT:
+    V(0xF) = V(x) >> 7;
+    V(x) = V(x) << 1;
+    break;
+  case IF_X_NEQ_Y:
+    ls->skip[lane] = V(x) != V(y);
+    break;
+  case SET_I_NNN:
+    ls->I[lane] = NNN(next);
+    break;
+  case JUMP_ADDR:
+    if (V(0) + NNN(next) >= MEMORY_SIZE) {
+      lane_trap(ls, lane, TRAP_BAD_ADDRESS);
+    } else {
+      ls->pc[lane] = V(0) + NNN(next);
+    }
+    jumped = 1;
+    break;
+  case SET_RAND:
+    if (ls->libc_rand[lane]) {
+      V(x) = (rand() % 256) & NN(next);
+    } else {
+      V(x) = (next_random(&ls->rng[lane]) >> 24) & NN(next);
+    }
+    break;
+  case DRAW: {
+    uint8_t n = N(next);
+    if (!lane_i_ok(ls, lane, n)) {
+      jumped = 1;
+      break;
+    }
+    uint8_t px = V(x) % DISPLAY_WIDTH;
+    uint8_t py = V(y) % DISPLAY_HEIGHT;
+    V(0xF) = 0;
+    for (int i = 0; i < n && py + i < DISPLAY_HEIGHT; ++i) {
+      uint64_t pixels =
+          ((uint64_t)memory[ls->I[lane] + i] << (DISPLAY_WIDTH - 8)) >> px;
+      if (screen[py + i] & pixels) {
+        V(0xF) = 1;
+      }
+      screen[py + i] ^= pixels;
+    }
+    break;
+  }
+  case IF_KEY_EQ:
+    ls->skip[lane] = ls->keys[(V(x) & 0xF) * w + lane];
+    break;
+  case IF_KEY_NEQ:
+    ls->skip[lane] = !ls->keys[(V(x) & 0xF) * w + lane];
+    break;
+  case GET_DELAY:
+    V(x) = ls->delay_timer[lane];
+    break;
+  case GET_KEY:
+    ls->waiting_for_key[lane] = 1;
+    ls->key_register[lane] = x;
+    jumped = 1;
+    break;
+  case SET_DELAY:
+    ls->delay_timer[lane] = V(x);
+    break;
+  case SET_SOUND:
+    ls->sound_timer[lane] = V(x);
+    break;
+  case ADD_X_I:
+    ls->I[lane] += V(x);
+    break;
+  case LOAD_CHAR:
+    // Each font character is 5 bytes long, see load_hex_fonts().
+    if (V(x) < 16) {
+      ls->I[lane] = V(x) * 5;
+    }
+    break;
+  case BCD:
+    if (!lane_i_ok(ls, lane, 3)) {
+      jumped = 1;
+      break;
+    }
+    memory[ls->I[lane]] = V(x) / 100;
+    memory[ls->I[lane] + 1] = V(x) / 10 % 10;
+    memory[ls->I[lane] + 2] = V(x) % 10;
+    wrote_memory(ls, ls->I[lane], 3);
+    break;
+  case REG_DUMP:
+    if (!lane_i_ok(ls, lane, x + 1)) {
+      jumped = 1;
+      break;
+    }
+    for (uint8_t i = 0; i <= x; ++i) {
+      memory[ls->I[lane] + i] = V(i);
+    }
+    wrote_memory(ls, ls->I[lane], x + 1);
+    break;
+  case REG_LOAD:
+    if (!lane_i_ok(ls, lane, x + 1)) {
+      jumped = 1;
+      break;
+    }
+    for (uint8_t i = 0; i <= x; ++i) {
+      V(i) = memory[ls->I[lane] + i];
+    }
+    break;
+  default:
+    lane_trap(ls, lane, ls->pc[lane] + 1 >= MEMORY_SIZE ? TRAP_BAD_ADDRESS
+                                                        : TRAP_INVALID_OPCODE);
+    jumped = 1;
+    break;
+  }
+
+  if (!jumped) {
+    ls->pc[lane] += 2;
+  }
+#undef V
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Returns whether execute_group_avx2() can execute |opcode|.
+static uint8_t is_vector_op(opcode_t opcode) {
+  switch (opcode) {
+  case JUMP:
+  case IF_X_EQ_NN:
+  case IF_X_NEQ_NN:
+  case IF_X_EQ_Y:
+  case SET_X_NN:
+  case ADD_X_NN:
+  case SET_X_Y:
+  case OR_X_Y:
+  case AND_X_Y:
+  case XOR_X_Y:
+  case ADD_X_Y:
+  case SUB_X_Y:
+  case SHIFT_X_RIGHT:
+  case SUB_X_Y_REV:
+  case SHIFT_X_LEFT:
+  case IF_X_NEQ_Y:
+  case SET_I_NNN:
+  case GET_DELAY:
+  case SET_DELAY:
+  case SET_SOUND:
+  case ADD_X_I:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+#define LOAD(p) _mm256_load_si256((const __m256i *)(p))
+#define STORE(p, v) _mm256_store_si256((__m256i *)(p), (v))
+
+// Stores |v| into the lanes of the byte array |p| selected by |mask|.
+#define STORE_MASKED(p, v, mask)                                               \
+  STORE((p), _mm256_blendv_epi8(LOAD(p), (v), (mask)))
+
+// Returns 1 in each byte where |a| >= |b| (unsigned), 0 elsewhere.
+__attribute__((target("avx2"))) static inline __m256i ge_epu8(__m256i a,
+                                                              __m256i b) {
+  return _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(a, b), a),
+                          _mm256_set1_epi8(1));
+}
+
+// Returns 1 in each byte where |a| == |b|, 0 elsewhere.
+__attribute__((target("avx2"))) static inline __m256i eq_epu8(__m256i a,
+                                                              __m256i b) {
+  return _mm256_and_si256(_mm256_cmpeq_epi8(a, b), _mm256_set1_epi8(1));
+}
+
+// Updates the 16-bit values at |p| for the 32 lanes of a block: lanes set in
+// the byte mask |mask| get |value| or, when |add| is set, |p| + |value|.
+// |value| holds 16 lanes per register, |value[0]| the first 16.
+__attribute__((target("avx2"))) static inline void
+update_words(uint16_t *p, const __m256i value[2], __m256i mask, uint8_t add) {
+  __m256i masks[2] = {
+      _mm256_cvtepi8_epi16(_mm256_castsi256_si128(mask)),
+      _mm256_cvtepi8_epi16(_mm256_extracti128_si256(mask, 1)),
+  };
+  for (int half = 0; half < 2; ++half) {
+    __m256i old = LOAD(p + half * 16);
+    __m256i v = add ? _mm256_add_epi16(old, value[half]) : value[half];
+    STORE(p + half * 16, _mm256_blendv_epi8(old, v, masks[half]));
+  }
+}
+
+// Marks the lanes of the block at |base| whose |pc| is |leader| and which
+// aren't halted in |group|. Returns the number of lanes marked.
+__attribute__((target("avx2"))) static uint32_t
+mark_group(lockstep *ls, uint32_t base, uint16_t leader) {
+  __m256i lead = _mm256_set1_epi16(leader);
+  __m256i lo = _mm256_cmpeq_epi16(LOAD(ls->pc + base), lead);
+  __m256i hi = _mm256_cmpeq_epi16(LOAD(ls->pc + base + 16), lead);
+  // packs works within 128-bit halves, put the lanes back in order.
+  __m256i same =
+      _mm256_permute4x64_epi64(_mm256_packs_epi16(lo, hi), 0xD8);
+  __m256i running =
+      _mm256_cmpeq_epi8(LOAD(ls->halted + base), _mm256_setzero_si256());
+  __m256i group = _mm256_and_si256(same, running);
+  STORE(ls->group + base, group);
+  return __builtin_popcount((uint32_t)_mm256_movemask_epi8(group));
+}
+
+// Executes |next| for the block of 32 lanes at |base|. Lanes in |group| which
+// have their skip flag set skip it instead.
+__attribute__((target("avx2"))) static void
+execute_block_avx2(lockstep *ls, uint32_t base, instruction next) {
+  uint32_t w = ls->width;
+  uint8_t x = X(next);
+  uint8_t y = Y(next);
+  uint8_t *vx = ls->V + x * w + base;
+  uint8_t *vy = ls->V + y * w + base;
+  uint8_t *vf = ls->V + 0xF * w + base;
+  uint8_t *skip = ls->skip + base;
+
+  __m256i group = LOAD(ls->group + base);
+  __m256i skipping = _mm256_and_si256(
+      group, _mm256_cmpgt_epi8(LOAD(skip), _mm256_setzero_si256()));
+  __m256i exec = _mm256_andnot_si256(skipping, group);
+  STORE_MASKED(skip, _mm256_setzero_si256(), skipping);
+
+  __m256i nn = _mm256_set1_epi8(NN(next));
+  __m256i one = _mm256_set1_epi8(1);
+  switch (next.opcode) {
+  case IF_X_EQ_NN:
+    STORE_MASKED(skip, eq_epu8(LOAD(vx), nn), exec);
+    break;
+  case IF_X_NEQ_NN:
+    STORE_MASKED(skip, _mm256_xor_si256(eq_epu8(LOAD(vx), nn), one), exec);
+    break;
+  case IF_X_EQ_Y:
+    STORE_MASKED(skip, eq_epu8(LOAD(vx), LOAD(vy)), exec);
+    break;
+  case IF_X_NEQ_Y:
+    STORE_MASKED(skip, _mm256_xor_si256(eq_epu8(LOAD(vx), LOAD(vy)), one),
+                 exec);
+    break;
+  case SET_X_NN:
+    STORE_MASKED(vx, nn, exec);
+    break;
+  case ADD_X_NN:
+    STORE_MASKED(vx, _mm256_add_epi8(LOAD(vx), nn), exec);
+    break;
+  case SET_X_Y:
+    STORE_MASKED(vx, LOAD(vy), exec);
+    break;
+  case OR_X_Y:
+    STORE_MASKED(vx, _mm256_or_si256(LOAD(vx), LOAD(vy)), exec);
+    break;
+  case AND_X_Y:
+    STORE_MASKED(vx, _mm256_and_si256(LOAD(vx), LOAD(vy)), exec);
+    break;
+  case XOR_X_Y:
+    STORE_MASKED(vx, _mm256_xor_si256(LOAD(vx), LOAD(vy)), exec);
+    break;
+  // VF is written before VX is reloaded, so that X or Y being F behaves as in
+  // the regular handlers.
+  case ADD_X_Y: {
+    __m256i sum = _mm256_add_epi8(LOAD(vx), LOAD(vy));
+    // The addition carried if the sum is smaller than VX.
+    __m256i carry = _mm256_xor_si256(ge_epu8(sum, LOAD(vx)), one);
+    STORE_MASKED(vf, carry, exec);
+    STORE_MASKED(vx, _mm256_add_epi8(LOAD(vx), LOAD(vy)), exec);
+    break;
+  }
+  case SUB_X_Y:
+    STORE_MASKED(vf, ge_epu8(LOAD(vx), LOAD(vy)), exec);
+    STORE_MASKED(vx, _mm256_sub_epi8(LOAD(vx), LOAD(vy)), exec);
+    break;
+  case SHIFT_X_RIGHT:
+    STORE_MASKED(vf, _mm256_and_si256(LOAD(vx), one), exec);
+    STORE_MASKED(vx,
+                 _mm256_and_si256(_mm256_srli_epi16(LOAD(vx), 1),
+                                  _mm256_set1_epi8(0x7F)),
+                 exec);
+    break;
+  case SUB_X_Y_REV:
+    STORE_MASKED(vf, one, exec);
+    STORE_MASKED(vx, _mm256_sub_epi8(LOAD(vy), LOAD(vx)), exec);
+    break;
+  case SHIFT_X_LEFT: {
+    __m256i high = _mm256_cmpgt_epi8(_mm256_setzero_si256(), LOAD(vx));
+    STORE_MASKED(vf, _mm256_and_si256(high, one), exec);
+    STORE_MASKED(vx, _mm256_add_epi8(LOAD(vx), LOAD(vx)), exec);
+    break;
+  }
+  case GET_DELAY:
+    STORE_MASKED(vx, LOAD(ls->delay_timer + base), exec);
+    break;
+  case SET_DELAY:
+    STORE_MASKED(ls->delay_timer + base, LOAD(vx), exec);
+    break;
+  case SET_SOUND:
+    STORE_MASKED(ls->sound_timer + base, LOAD(vx), exec);
+    break;
+  case SET_I_NNN: {
+    __m256i nnn[2] = {_mm256_set1_epi16(NNN(next)),
+                      _mm256_set1_epi16(NNN(next))};
+    update_words(ls->I + base, nnn, exec, 0);
+    break;
+  }
+  case ADD_X_I: {
+    __m256i v = LOAD(vx);
+    __m256i wide[2] = {
+        _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)),
+        _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)),
+    };
+    update_words(ls->I + base, wide, exec, 1);
+    break;
+  }
+  default:
+    break;
+  }
+
+  // Move the group on to the following instruction, or the jump target.
+  __m256i two[2] = {_mm256_set1_epi16(2), _mm256_set1_epi16(2)};
+  if (next.opcode == JUMP) {
+    __m256i target[2] = {_mm256_set1_epi16(NNN(next)),
+                         _mm256_set1_epi16(NNN(next))};
+    update_words(ls->pc + base, two, skipping, 1);
+    update_words(ls->pc + base, target, exec, 0);
+  } else {
+    update_words(ls->pc + base, two, group, 1);
+  }
+}
+
+// Executes the instruction at |leader| in all running lanes whose |pc| is
+// |leader|. Returns the number of lanes which executed it, or 0 if it has to
+// be executed lane by lane.
+__attribute__((target("avx2"))) static uint32_t
+execute_group_avx2(lockstep *ls, uint16_t leader, const uint8_t *memory) {
+  if ((leader & 1) || !is_uniform(ls, leader)) {
+    return 0;
+  }
+  instruction next = fetch(memory, leader);
+  if (!is_vector_op(next.opcode)) {
+    return 0;
+  }
+
+  uint32_t members = 0;
+  for (uint32_t base = 0; base < ls->width; base += LANE_BLOCK) {
+    members += mark_group(ls, base, leader);
+  }
+  for (uint32_t base = 0; base < ls->width; base += LANE_BLOCK) {
+    execute_block_avx2(ls, base, next);
+  }
+  return members;
+}
+
+#undef LOAD
+#undef STORE
+#undef STORE_MASKED
+
+#endif
+
+// Counts down the timers of the running lanes by one frame.
+static void tick_timers(lockstep *ls) {
+  for (uint32_t lane = 0; lane < ls->width; ++lane) {
+    uint8_t running = !ls->halted[lane];
+    ls->delay_timer[lane] -= running && ls->delay_timer[lane] > 0;
+    ls->sound_timer[lane] -= running && ls->sound_timer[lane] > 0;
+  }
+}
+
+// Halts the lanes which trapped this cycle.
+static void halt_trapped(lockstep *ls) {
+  for (uint32_t lane = 0; lane < ls->lanes; ++lane) {
+    if (ls->trap[lane] != TRAP_NONE && !ls->halted[lane]) {
+      ls->halted[lane] = 1;
+      ls->halted_cycle[lane] = ls->cycle;
+      ls->halted_phase[lane] = ls->timer_phase;
+      --ls->running;
+    }
+  }
+  ls->new_traps = 0;
+}
+
+void lockstep_run(lockstep *ls, uint64_t cycles) {
+  for (; cycles > 0 && ls->running > 0; --cycles) {
+    // The first running lane leads the group.
+    uint32_t first = 0;
+    while (ls->halted[first]) {
+      ++first;
+    }
+    uint16_t leader = ls->pc[first];
+
+    uint32_t members = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (ls->use_simd) {
+      members = execute_group_avx2(
+          ls, leader, ls->memory + (size_t)first * MEMORY_SIZE);
+    }
+#endif
+
+    if (members == 0) {
+      for (uint32_t lane = first; lane < ls->lanes; ++lane) {
+        if (!ls->halted[lane]) {
+          step_lane(ls, lane);
+        }
+      }
+    } else if (members < ls->running) {
+      // Execute the lanes which have diverged from the group on their own.
+      for (uint32_t lane = first; lane < ls->lanes; ++lane) {
+        if (!ls->halted[lane] && !ls->group[lane]) {
+          step_lane(ls, lane);
+        }
+      }
+    }
+
+    // Update the cycle count and timers, as tick_cycle() does.
+    ++ls->cycle;
+    ls->timer_phase += FRAME_RATE;
+    if (ls->timer_phase >= ls->clock_speed) {
+      ls->timer_phase -= ls->clock_speed;
+      tick_timers(ls);
+    }
+
+    if (ls->new_traps > 0) {
+      halt_trapped(ls);
+    }
+  }
+}
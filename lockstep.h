@@ -0,0 +1,49 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include <stdint.h>
+
+#include "chip8.h"
+
+// Runs many chip8 systems ("lanes") in lockstep, e.g. one ROM with different
+// inputs.
+//
+// The state of the lanes is stored as struct-of-arrays: register VX of every
+// lane is in one array, as are |I|, |pc| and so on. Each cycle the lanes whose
+// |pc| matches the first running lane form a group. If the instruction at that
+// address is the same in all lanes and is register arithmetic, a skip, a jump
+// or a timer access, the whole group executes it at once with AVX2 kernels,
+// 32 lanes at a time. Every other lane, and every other instruction, is
+// executed lane by lane.
+//
+// All lanes share the cycle count, clock speed and timer phase. A lane which
+// traps is halted and no longer counts cycles, as with run_cycles().
+typedef struct lockstep lockstep;
+
+// Creates |lanes| lanes, all zeroed as by initialize_chip8(). Returns NULL if
+// memory can't be allocated.
+lockstep *lockstep_create(uint32_t lanes);
+
+void lockstep_destroy(lockstep *ls);
+
+// Copies the emulated state of |system| into |lane|. The cycle count, clock
+// speed and timer phase are taken from |system| for all lanes, so every lane
+// should be set from a system at the same point in time.
+void lockstep_set_lane(lockstep *ls, uint32_t lane, const chip8 *system);
+
+// Copies the emulated state of |lane| into |system|, which must have been set
+// up with initialize_chip8().
+void lockstep_get_lane(const lockstep *ls, uint32_t lane, chip8 *system);
+
+// Sets whether |key| of |lane| is held down, like set_key().
+void lockstep_set_key(lockstep *ls, uint32_t lane, uint8_t key,
+                      uint8_t pressed);
+
+// Enables or disables the AVX2 kernels, which are used by default when the CPU
+// supports them. Without them every lane is executed on its own.
+void lockstep_set_simd(lockstep *ls, uint8_t enabled);
+
+// Runs all lanes for |cycles| cycles.
+void lockstep_run(lockstep *ls, uint64_t cycles);
+
+#endif // LOCKSTEP_H
@@ -0,0 +1,204 @@
+#include "log.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef struct log_entry {
+  // When the message was logged, in nanoseconds of the monotonic clock.
+  uint64_t time;
+  uint8_t level;
+  char text[LOG_MESSAGE_SIZE];
+} log_entry;
+
+// The messages logged by one thread, waiting for the logging thread. Like
+// input_queue, with a single producer and a single consumer.
+typedef struct log_ring {
+  log_entry entries[LOG_RING_SIZE];
+
+  // The number of messages ever written out and logged.
+  _Alignas(64) _Atomic uint32_t head;
+  _Alignas(64) _Atomic uint32_t tail;
+
+  // Set while the ring belongs to a thread. The ring of a thread which has
+  // exited goes to the next new thread to log.
+  _Atomic uint8_t owned;
+
+  // The next ring in |rings|. Rings are never freed, so that the logging
+  // thread can walk the list without locks.
+  struct log_ring *next;
+} log_ring;
+
+static _Atomic(log_ring *) rings;
+
+// The ring of the current thread, or NULL until it first logs.
+static _Thread_local log_ring *ring;
+
+// Releases the ring of a thread when it exits.
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static _Atomic uint64_t dropped;
+
+// Set between log_start() and log_stop(), and when the logging thread is to
+// stop.
+static _Atomic uint8_t running;
+static _Atomic uint8_t stopping;
+
+static pthread_t logger;
+static FILE *out;
+
+// The time of log_start(), which message times are printed relative to.
+static uint64_t epoch;
+
+static const char *level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+static uint64_t now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static void release_ring(void *r) {
+  atomic_store_explicit(&((log_ring *)r)->owned, 0, memory_order_release);
+}
+
+static void create_ring_key() { pthread_key_create(&ring_key, release_ring); }
+
+// Returns a ring for the current thread: one left by a thread which exited,
+// or else a new one. Returns NULL if out of memory.
+static log_ring *claim_ring() {
+  pthread_once(&ring_key_once, create_ring_key);
+
+  log_ring *r = atomic_load(&rings);
+  for (; r != NULL; r = r->next) {
+    uint8_t owned = 0;
+    if (atomic_compare_exchange_strong(&r->owned, &owned, 1)) {
+      break;
+    }
+  }
+  if (r == NULL) {
+    r = calloc(1, sizeof(*r));
+    if (r == NULL) {
+      return NULL;
+    }
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->owned, 1);
+    r->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &r->next, r)) {
+    }
+  }
+
+  pthread_setspecific(ring_key, r);
+  return r;
+}
+
+void log_message(int level, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+
+  if (!atomic_load_explicit(&running, memory_order_acquire)) {
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+    return;
+  }
+
+  if (ring == NULL) {
+    ring = claim_ring();
+  }
+  uint32_t tail = 0;
+  uint32_t head = 0;
+  if (ring != NULL) {
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  }
+  if (ring == NULL || tail - head == LOG_RING_SIZE) {
+    atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+    va_end(args);
+    return;
+  }
+
+  log_entry *e = &ring->entries[tail % LOG_RING_SIZE];
+  e->time = now();
+  e->level = level;
+  vsnprintf(e->text, sizeof(e->text), format, args);
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+  va_end(args);
+}
+
+// Writes out the messages waiting in all rings, merged by the time they were
+// logged.
+static void drain() {
+  for (;;) {
+    log_ring *oldest = NULL;
+    const log_entry *first = NULL;
+    log_ring *r = atomic_load_explicit(&rings, memory_order_acquire);
+    for (; r != NULL; r = r->next) {
+      uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+      uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+      if (head == tail) {
+        continue;
+      }
+      const log_entry *e = &r->entries[head % LOG_RING_SIZE];
+      if (first == NULL || e->time < first->time) {
+        oldest = r;
+        first = e;
+      }
+    }
+    if (first == NULL) {
+      break;
+    }
+
+    // Late messages from before a previous log_stop() count from 0.
+    uint64_t time = first->time > epoch ? first->time - epoch : 0;
+    fprintf(out, "[%4llu.%06llu] %-5s %s\n",
+            (unsigned long long)(time / 1000000000),
+            (unsigned long long)(time / 1000 % 1000000),
+            level_names[first->level], first->text);
+    uint32_t head = atomic_load_explicit(&oldest->head, memory_order_relaxed);
+    atomic_store_explicit(&oldest->head, head + 1, memory_order_release);
+  }
+  fflush(out);
+}
+
+static void *drain_loop(void *arg) {
+  struct timespec pause = {0, LOG_DRAIN_MS * 1000000L};
+  while (!atomic_load_explicit(&stopping, memory_order_acquire)) {
+    drain();
+    nanosleep(&pause, NULL);
+  }
+  return NULL;
+}
+
+int log_start(FILE *f) {
+  if (atomic_load(&running)) {
+    return 1;
+  }
+  out = f;
+  epoch = now();
+  atomic_store(&stopping, 0);
+  if (pthread_create(&logger, NULL, drain_loop, NULL) != 0) {
+    return 1;
+  }
+  atomic_store_explicit(&running, 1, memory_order_release);
+  return 0;
+}
+
+void log_stop() {
+  if (!atomic_load(&running)) {
+    return;
+  }
+  // Anything logged from here on goes to stderr.
+  atomic_store(&running, 0);
+  atomic_store_explicit(&stopping, 1, memory_order_release);
+  pthread_join(logger, NULL);
+  drain();
+}
+
+uint64_t log_dropped() {
+  return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
@@ -0,0 +1,67 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Logging which stays off the hot paths. Messages are formatted into a ring
+// buffer of the thread logging them, without locks or I/O, and a background
+// thread started by log_start() writes them out. Before log_start() and after
+// log_stop(), messages are written straight to stderr.
+//
+// Messages below CHIP8_LOG_LEVEL are compiled out, arguments and all, so debug
+// logging costs nothing unless built with -DCHIP8_LOG_LEVEL=LOG_LEVEL_DEBUG.
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_NONE 4
+
+#ifndef CHIP8_LOG_LEVEL
+#define CHIP8_LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// The most messages waiting in a thread's ring buffer. Messages logged while
+// it is full are dropped. Must be a power of 2.
+#define LOG_RING_SIZE 256
+
+// The longest message kept, including the terminating null byte. Longer ones
+// are truncated.
+#define LOG_MESSAGE_SIZE 112
+
+// How often the background thread writes out the messages logged.
+#define LOG_DRAIN_MS 10
+
+// Starts a thread writing the messages logged to |f| from now on. Returns a
+// nonzero value if it can't be started, leaving messages going to stderr.
+int log_start(FILE *f);
+
+// Writes out the messages still waiting, then stops the thread started by
+// log_start(). Messages logged by other threads while it stops may be lost,
+// so it should be called once they are done.
+void log_stop();
+
+// Returns the number of messages dropped because a ring buffer was full.
+uint64_t log_dropped();
+
+// Logs a message at |level|, formatted as by printf(). Use the LOG_* macros
+// instead, which compile out levels below CHIP8_LOG_LEVEL.
+void log_message(int level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// The condition is a constant, so that the call and its arguments are
+// removed when compiled out, but still type-checked.
+#define LOG_AT(level, ...)                                                     \
+  do {                                                                         \
+    if ((level) >= CHIP8_LOG_LEVEL) {                                          \
+      log_message(level, __VA_ARGS__);                                         \
+    }                                                                          \
+  } while (0)
+
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#endif // LOG_H
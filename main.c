@@ -1,55 +1,396 @@
 #define SDL_MAIN_HANDLED
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include <SDL2/SDL.h>
 
 #include "chip8.h"
+#include "log.h"
+#include "movie.h"
+#include "profile.h"
+#include "rewind.h"
+#include "scheduler.h"
+#include "sdl_host.h"
 
-#define SCREEN_WIDTH 640
-#define SCREEN_HEIGHT 320
+// The default length of the rewind history, and the memory it may use.
+#define REWIND_SECONDS 60
+#define REWIND_BYTES_PER_SECOND (64 * 1024)
 
-int main(int argc, char *args[]) {
-  // Start SDL
-  SDL_Init(SDL_INIT_EVERYTHING);
+// The default number of emulated frames per frame presented while
+// fast-forwarding.
+#define TURBO_FRAMESKIP 8
 
-  SDL_Window *window = SDL_CreateWindow("hello_sdl2", SDL_WINDOWPOS_UNDEFINED,
-                                        SDL_WINDOWPOS_UNDEFINED, SCREEN_WIDTH,
-                                        SCREEN_HEIGHT, SDL_WINDOW_SHOWN);
+// Fast-forward settings, and statistics for the window title.
+typedef struct turbo {
+  // Emulated frames per real frame while fast-forwarding, or 0 to run as fast
+  // as possible.
+  uint32_t multiplier;
 
-  if (window == NULL) {
-    fprintf(stderr, "could not create window: %s\n", SDL_GetError());
-    return 1;
+  // Only every |frameskip|th emulated frame is presented while
+  // fast-forwarding. The others still update the screen state, so the frame
+  // which is presented shows every row which changed since the last one.
+  uint32_t frameskip;
+
+  // Emulated frames run while fast-forwarding, and how many of them weren't
+  // presented.
+  uint64_t frames;
+  uint64_t skipped;
+
+  // When the window title was last updated, and the cycle count and skipped
+  // frames at the time.
+  uint64_t status_ns;
+  uint64_t status_cycle;
+  uint64_t status_skipped;
+} turbo;
+
+// Shows the effective speed and the frames skipped in the window title once
+// a second while fast-forwarding, and clears them once it stops.
+static void update_status(chip8 *system, sdl_host *host, turbo *t,
+                          uint8_t active) {
+  uint64_t now = monotonic_ns();
+  if (!active) {
+    if (t->status_ns != 0) {
+      sdl_host_set_status(host, NULL);
+      t->status_ns = 0;
+    }
+    return;
+  }
+  if (t->status_ns == 0) {
+    t->status_ns = now;
+    t->status_cycle = system->cycle;
+    t->status_skipped = t->skipped;
+    sdl_host_set_status(host, "fast-forward");
+    return;
+  }
+  if (now - t->status_ns < 1000000000) {
+    return;
   }
 
-  SDL_Surface *screen_surface = SDL_GetWindowSurface(window);
-  if (screen_surface == NULL) {
-    fprintf(stderr, "could not create window surface: %s\n", SDL_GetError());
-    return 1;
+  double seconds = (now - t->status_ns) / 1e9;
+  double speed = (system->cycle - t->status_cycle) / seconds /
+                 system->clock_speed;
+  char status[64];
+  snprintf(status, sizeof(status), "fast-forward %.1fx, %llu frames skipped",
+           speed, (unsigned long long)(t->skipped - t->status_skipped));
+  sdl_host_set_status(host, status);
+  t->status_ns = now;
+  t->status_cycle = system->cycle;
+  t->status_skipped = t->skipped;
+}
+
+// Steps |system| one frame back in |rewind|. The keys keep their current
+// state, so that keys let go of while rewinding aren't stuck down afterwards.
+static void rewind_frame(chip8 *system, rewind_buffer *rewind) {
+  uint8_t keys[sizeof(system->keys)];
+  memcpy(keys, system->keys, sizeof(keys));
+  rewind_step_back(rewind, system);
+  memcpy(system->keys, keys, sizeof(keys));
+}
+
+// Runs |system| at |instructions_per_second|, polling for input
+// |polls_per_frame| times per frame and running the instructions in between as
+// a single batch. Each frame is recorded in |rewind|, if not NULL, and played
+// back in reverse while the rewind key is held. While fast-forward is on,
+// frames are run as set in |t|.
+static void game_loop(chip8 *system, sdl_host *host,
+                      uint32_t instructions_per_second,
+                      uint32_t polls_per_frame, rewind_buffer *rewind,
+                      turbo *t) {
+  scheduler sched;
+  scheduler_init(&sched, instructions_per_second);
+  uint64_t start = monotonic_ns();
+  uint64_t start_cycle = system->cycle;
+  uint64_t recording_ns = 0;
+  uint64_t recorded = 0;
+
+  while (!host->quit) {
+    if (rewind != NULL && host->rewinding) {
+      sdl_host_poll(host);
+      rewind_frame(system, rewind);
+      // Apply the queued key events without running anything.
+      sdl_host_run(host, system, 0);
+      present_frame(system);
+      scheduler_wait(&sched);
+      continue;
+    }
+
+    for (uint32_t i = 0; i < polls_per_frame && !host->quit; ++i) {
+      // Split the frame's instructions evenly between the polls.
+      uint64_t per_frame = sched.instructions_per_frame;
+      uint64_t batch = per_frame * (i + 1) / polls_per_frame -
+                       per_frame * i / polls_per_frame;
+
+      sdl_host_poll(host);
+      sdl_host_run(host, system, batch);
+    }
+
+    if (rewind != NULL) {
+      uint64_t record_start = monotonic_ns();
+      rewind_record(rewind, system);
+      recording_ns += monotonic_ns() - record_start;
+      ++recorded;
+    }
+
+    // Fast-forward, unless waiting for a key, when the screen should show
+    // what the program is asking for.
+    uint8_t fast = host->turbo && !system->waiting_for_key;
+    update_status(system, host, t, fast);
+    if (fast) {
+      ++t->frames;
+      if (t->frames % t->frameskip == 0) {
+        present_frame(system);
+      } else {
+        ++t->skipped;
+      }
+      if (t->multiplier > 0 && t->frames % t->multiplier == 0) {
+        scheduler_wait(&sched);
+      }
+      continue;
+    }
+
+    // If the draw flag is set, update the screen.
+    present_frame(system);
+
+    if (system->waiting_for_key) {
+      // Nothing runs until a key is pressed, so with a single thread, block
+      // on the event queue for the rest of the frame. The press is applied at
+      // the next poll.
+      uint64_t now = monotonic_ns();
+      if (now < sched.deadline) {
+        sdl_host_wait(host, (sched.deadline - now) / 1000000);
+      }
+    }
+
+    // Sleep for the rest of the frame.
+    scheduler_wait(&sched);
+  }
+
+  double seconds = (monotonic_ns() - start) / 1e9;
+  fprintf(stderr, "%.0f instructions/s\n",
+          seconds > 0 ? (system->cycle - start_cycle) / seconds : 0);
+  scheduler_report(&sched, stderr);
+  if (recorded > 0) {
+    fprintf(stderr, "rewind: %.2f us per frame recorded, %zu bytes used\n",
+            recording_ns / 1e3 / recorded, rewind->used);
   }
+  if (t->frames > 0) {
+    fprintf(stderr, "fast-forward: %llu frames, %llu not presented\n",
+            (unsigned long long)t->frames, (unsigned long long)t->skipped);
+  }
+}
+
+// The arguments of game_loop(), for running it on a thread of its own.
+typedef struct game {
+  chip8 *system;
+  sdl_host *host;
+  uint32_t instructions_per_second;
+  uint32_t polls_per_frame;
+  rewind_buffer *rewind;
+  turbo *t;
+} game;
 
-  SDL_FillRect(screen_surface, NULL,
-               SDL_MapRGB(screen_surface->format, 0xFF, 0xFF, 0xFF));
-  SDL_UpdateWindowSurface(window);
+static void *run_game(void *arg) {
+  game *g = arg;
+  game_loop(g->system, g->host, g->instructions_per_second,
+            g->polls_per_frame, g->rewind, g->t);
+  return NULL;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [--texture] [--ips N] [--polls N] [--rewind N] "
+          "[--record F] [--seed N] [--libc-rand] [--turbo N] "
+          "[--frameskip K] [--fast-forward] [--one-thread] "
+          "[--audio-buffer N] [--mute] [--log F] [rom]\n",
+          name);
+  fprintf(stderr, "  --texture  draw through a scaled streaming texture\n");
+  fprintf(stderr, "  --ips N    run N instructions per second (default %d)\n",
+          CLOCK_SPEED);
+  fprintf(stderr, "  --polls N  poll for input N times a frame (default 1)\n");
+  fprintf(stderr, "  --rewind N keep N seconds of rewind, 0 to disable "
+                  "(default %d)\n",
+          REWIND_SECONDS);
+  fprintf(stderr, "  --record F record the input into the movie F, see "
+                  "chip8_play\n");
+  fprintf(stderr, "  --seed N   seed the random number generator with N\n");
+  fprintf(stderr, "  --libc-rand  draw random numbers from the C library's "
+                  "rand()\n");
+  fprintf(stderr, "  --turbo N  fast-forward at N times the speed, 0 for as "
+                  "fast as possible (default 0)\n");
+  fprintf(stderr, "  --frameskip K  present every Kth frame while "
+                  "fast-forwarding (default %d)\n",
+          TURBO_FRAMESKIP);
+  fprintf(stderr, "  --fast-forward  start with fast-forward on\n");
+  fprintf(stderr, "  --one-thread  emulate on the thread which draws, instead "
+                  "of a thread of its own\n");
+  fprintf(stderr, "  --audio-buffer N  play sound in buffers of N samples "
+                  "(default %d)\n",
+          AUDIO_BUFFER_SAMPLES);
+  fprintf(stderr, "  --mute     don't play sound\n");
+  fprintf(stderr, "  --log F    write the log to F instead of stderr\n");
+  fprintf(stderr, "Hold Backspace to rewind, unless recording. Press Tab to "
+                  "toggle fast-forward.\n");
+}
+
+int main(int argc, char *args[]) {
+  const char *rom = "pong.ch8";
+  sdl_renderer renderer_kind = RENDER_SURFACE;
+  uint32_t instructions_per_second = CLOCK_SPEED;
+  uint32_t polls_per_frame = 1;
+  uint32_t rewind_seconds = REWIND_SECONDS;
+  const char *record = NULL;
+  uint32_t seed = time(NULL);
+  uint8_t libc_rand = 0;
+  turbo t = {.multiplier = 0, .frameskip = TURBO_FRAMESKIP};
+  uint8_t fast_forward = 0;
+  uint8_t one_thread = 0;
+  uint32_t audio_buffer = AUDIO_BUFFER_SAMPLES;
+  uint8_t mute = 0;
+  const char *log_path = NULL;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(args[i], "--texture") == 0) {
+      renderer_kind = RENDER_TEXTURE;
+    } else if (strcmp(args[i], "--ips") == 0 && i + 1 < argc) {
+      instructions_per_second = strtoul(args[++i], NULL, 10);
+      if (instructions_per_second < FRAME_RATE) {
+        usage(args[0]);
+        return 1;
+      }
+    } else if (strcmp(args[i], "--polls") == 0 && i + 1 < argc) {
+      polls_per_frame = strtoul(args[++i], NULL, 10);
+      if (polls_per_frame == 0) {
+        usage(args[0]);
+        return 1;
+      }
+    } else if (strcmp(args[i], "--rewind") == 0 && i + 1 < argc) {
+      rewind_seconds = strtoul(args[++i], NULL, 10);
+    } else if (strcmp(args[i], "--record") == 0 && i + 1 < argc) {
+      record = args[++i];
+    } else if (strcmp(args[i], "--seed") == 0 && i + 1 < argc) {
+      seed = strtoul(args[++i], NULL, 10);
+    } else if (strcmp(args[i], "--libc-rand") == 0) {
+      libc_rand = 1;
+    } else if (strcmp(args[i], "--turbo") == 0 && i + 1 < argc) {
+      t.multiplier = strtoul(args[++i], NULL, 10);
+    } else if (strcmp(args[i], "--frameskip") == 0 && i + 1 < argc) {
+      t.frameskip = strtoul(args[++i], NULL, 10);
+      if (t.frameskip == 0) {
+        usage(args[0]);
+        return 1;
+      }
+    } else if (strcmp(args[i], "--fast-forward") == 0) {
+      fast_forward = 1;
+    } else if (strcmp(args[i], "--one-thread") == 0) {
+      one_thread = 1;
+    } else if (strcmp(args[i], "--audio-buffer") == 0 && i + 1 < argc) {
+      audio_buffer = strtoul(args[++i], NULL, 10);
+      if (audio_buffer == 0 || audio_buffer > UINT16_MAX) {
+        usage(args[0]);
+        return 1;
+      }
+    } else if (strcmp(args[i], "--mute") == 0) {
+      mute = 1;
+    } else if (strcmp(args[i], "--log") == 0 && i + 1 < argc) {
+      log_path = args[++i];
+    } else if (args[i][0] == '-') {
+      usage(args[0]);
+      return 1;
+    } else {
+      rom = args[i];
+    }
+  }
+
+#ifdef CHIP8_PROFILE
+  profile_install();
+#endif
+
+  sdl_host host;
+  if (sdl_host_init(&host, "hello_sdl2", renderer_kind)) {
+    return 1;
+  }
+  host.turbo = fast_forward;
+  if (!mute) {
+    // Carry on without sound if there is no audio device.
+    sdl_host_init_audio(&host, audio_buffer);
+  }
 
   // initialize chip8 system
   chip8 system = initialize_chip8();
   load_hex_fonts(&system);
   system.pc = 0x200;
-  system.window = window;
-  system.screen_surface = screen_surface;
+  system.host = &host.host;
+  system.clock_speed = instructions_per_second;
 
   // load game into memory.
-  if (load_program("pong.ch8", &system)) {
+  if (load_program(rom, &system)) {
     fprintf(stderr, "Failed to load program\n");
     return 1;
   }
 
-  // Chip 8 game loop.
-  game_loop(&system);
+  if (libc_rand) {
+    system.libc_rand = 1;
+    srand(seed);
+  } else {
+    chip8_seed(&system, seed);
+  }
+  movie recording;
+  if (record != NULL) {
+    movie_init(&recording, &system, seed);
+    host.movie = &recording;
+    // Rewinding would take the recorded session back in time.
+    rewind_seconds = 0;
+  }
+
+  // Keep a keyframe every second.
+  rewind_buffer rewind;
+  rewind_buffer *history = NULL;
+  if (rewind_seconds > 0 &&
+      rewind_init(&rewind, rewind_seconds * REWIND_BYTES_PER_SECOND,
+                  rewind_seconds * FRAME_RATE, FRAME_RATE) == 0) {
+    history = &rewind;
+  }
+
+  // From here on, log from a thread of its own rather than the hot paths.
+  FILE *log_file = stderr;
+  if (log_path != NULL && (log_file = fopen(log_path, "w")) == NULL) {
+    fprintf(stderr, "Failed to open file: %s\n", log_path);
+    log_file = stderr;
+  }
+  log_start(log_file);
+
+  // Chip 8 game loop. By default it runs on a thread of its own, so that
+  // drawing never holds up emulation, while this thread handles SDL.
+  game g = {&system, &host, instructions_per_second, polls_per_frame,
+            history, &t};
+  pthread_t thread;
+  if (one_thread || sdl_host_init_threaded(&host) ||
+      pthread_create(&thread, NULL, run_game, &g) != 0) {
+    host.threaded = 0;
+    run_game(&g);
+  } else {
+    sdl_host_present_loop(&host);
+    pthread_join(thread, NULL);
+  }
+  log_stop();
+  if (log_file != stderr) {
+    fclose(log_file);
+  }
+
+  if (history != NULL) {
+    rewind_destroy(history);
+  }
+  if (record != NULL) {
+    movie_save(&recording, record, system.cycle);
+    movie_destroy(&recording);
+  }
 
-  // Quit SDL
-  SDL_DestroyWindow(window);
-  SDL_Quit();
+#ifdef CHIP8_PROFILE
+  profile_dump(stderr, &system);
+#endif
+  sdl_host_destroy(&host);
 
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,263 @@
+#include "movie.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MOVIE_MAGIC "C8MV"
+#define MOVIE_VERSION 2
+
+// Set in the flags of movies which use rand().
+#define FLAG_LIBC_RAND 1
+
+// The size of the header, see movie.h, and of the header of version 1 movies,
+// which is one byte shorter.
+#define HEADER_SIZE (4 + 1 + 1 + 8 + 4 + 4)
+
+// The most bytes an event can take: a 64-bit varint and the keys.
+#define MAX_EVENT_SIZE (10 + 2)
+
+uint64_t movie_rom_hash(const chip8 *system) {
+  // 64-bit FNV-1a over all of program memory, so that it doesn't depend on how
+  // long the file was.
+  uint64_t hash = 0xcbf29ce484222325;
+  for (uint32_t i = 0x200; i < sizeof(system->memory); ++i) {
+    hash ^= system->memory[i];
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+// Returns the keys of |system| held down, bit k for key k.
+static uint16_t key_mask(const chip8 *system) {
+  uint16_t mask = 0;
+  for (int k = 0; k < 16; ++k) {
+    mask |= (system->keys[k] != 0) << k;
+  }
+  return mask;
+}
+
+void movie_init(movie *m, const chip8 *system, uint32_t seed) {
+  memset(m, 0, sizeof(*m));
+  m->rom_hash = movie_rom_hash(system);
+  m->clock_speed = system->clock_speed;
+  m->seed = seed;
+  m->libc_rand = system->libc_rand;
+  m->cycle = system->cycle;
+  m->keys = key_mask(system);
+}
+
+void movie_destroy(movie *m) {
+  free(m->events);
+  memset(m, 0, sizeof(*m));
+}
+
+// Stores |value| in |length| little endian bytes at |p|.
+static void put_le(uint8_t *p, uint64_t value, int length) {
+  for (int i = 0; i < length; ++i) {
+    p[i] = value >> (8 * i);
+  }
+}
+
+// Reads a |length| byte little endian value from |p|.
+static uint64_t get_le(const uint8_t *p, int length) {
+  uint64_t value = 0;
+  for (int i = 0; i < length; ++i) {
+    value |= (uint64_t)p[i] << (8 * i);
+  }
+  return value;
+}
+
+// Encodes an event into |p|. Returns the number of bytes written.
+static size_t put_event(uint8_t *p, uint64_t cycles, uint16_t keys) {
+  size_t length = 0;
+  do {
+    p[length++] = (cycles & 0x7F) | (cycles > 0x7F ? 0x80 : 0);
+    cycles >>= 7;
+  } while (cycles > 0);
+  put_le(p + length, keys, 2);
+  return length + 2;
+}
+
+// Decodes the event at |p|, which has |left| bytes left. Returns the number of
+// bytes read, or 0 if the event is truncated.
+static size_t get_event(const uint8_t *p, size_t left, uint64_t *cycles,
+                        uint16_t *keys) {
+  size_t length = 0;
+  *cycles = 0;
+  for (int shift = 0;; shift += 7) {
+    if (length >= left || shift > 63) {
+      return 0;
+    }
+    uint8_t byte = p[length++];
+    *cycles |= (uint64_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      break;
+    }
+  }
+  if (length + 2 > left) {
+    return 0;
+  }
+  *keys = get_le(p + length, 2);
+  return length + 2;
+}
+
+int movie_record_keys(movie *m, const chip8 *system) {
+  uint16_t keys = key_mask(system);
+  if (keys == m->keys) {
+    return 0;
+  }
+
+  if (m->capacity - m->length < MAX_EVENT_SIZE) {
+    size_t capacity = m->capacity ? m->capacity * 2 : 4096;
+    uint8_t *events = realloc(m->events, capacity);
+    if (events == NULL) {
+      return 1;
+    }
+    m->events = events;
+    m->capacity = capacity;
+  }
+  m->length += put_event(m->events + m->length, system->cycle - m->cycle,
+                         keys ^ m->keys);
+  m->cycle = system->cycle;
+  m->keys = keys;
+  return 0;
+}
+
+int movie_save(const movie *m, const char *filename, uint64_t end_cycle) {
+  FILE *f = fopen(filename, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "Failed to open file: %s\n", filename);
+    return 1;
+  }
+
+  uint8_t header[HEADER_SIZE];
+  memcpy(header, MOVIE_MAGIC, 4);
+  header[4] = MOVIE_VERSION;
+  header[5] = m->libc_rand ? FLAG_LIBC_RAND : 0;
+  put_le(header + 6, m->rom_hash, 8);
+  put_le(header + 14, m->clock_speed, 4);
+  put_le(header + 18, m->seed, 4);
+
+  uint8_t end[MAX_EVENT_SIZE];
+  size_t end_length = put_event(end, end_cycle - m->cycle, 0);
+
+  int failed = fwrite(header, 1, sizeof(header), f) != sizeof(header) ||
+               fwrite(m->events, 1, m->length, f) != m->length ||
+               fwrite(end, 1, end_length, f) != end_length;
+  failed |= fclose(f) != 0;
+  if (failed) {
+    fprintf(stderr, "Failed to write file: %s\n", filename);
+  }
+  return failed;
+}
+
+int movie_load(movie *m, const char *filename) {
+  memset(m, 0, sizeof(*m));
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "Failed to open file: %s\n", filename);
+    return 1;
+  }
+
+  uint8_t header[HEADER_SIZE];
+  if (fread(header, 1, 5, f) != 5 || memcmp(header, MOVIE_MAGIC, 4) != 0 ||
+      header[4] < 1 || header[4] > MOVIE_VERSION) {
+    fprintf(stderr, "Not a chip8 movie: %s\n", filename);
+    fclose(f);
+    return 1;
+  }
+  // Version 1 has no flags and always uses rand().
+  size_t start = header[4] == 1 ? 6 : 5;
+  header[5] = FLAG_LIBC_RAND;
+  if (fread(header + start, 1, HEADER_SIZE - start, f) !=
+      HEADER_SIZE - start) {
+    fprintf(stderr, "Malformed chip8 movie: %s\n", filename);
+    fclose(f);
+    return 1;
+  }
+  m->libc_rand = (header[5] & FLAG_LIBC_RAND) != 0;
+  m->rom_hash = get_le(header + 6, 8);
+  m->clock_speed = get_le(header + 14, 4);
+  m->seed = get_le(header + 18, 4);
+  if (m->clock_speed < FRAME_RATE) {
+    fprintf(stderr, "Malformed chip8 movie: %s\n", filename);
+    fclose(f);
+    return 1;
+  }
+
+  // Read the events to the end of the file.
+  size_t read;
+  do {
+    if (m->capacity - m->length < 4096) {
+      size_t capacity = m->capacity ? m->capacity * 2 : 4096;
+      uint8_t *events = realloc(m->events, capacity);
+      if (events == NULL) {
+        fprintf(stderr, "Out of memory reading movie: %s\n", filename);
+        fclose(f);
+        movie_destroy(m);
+        return 1;
+      }
+      m->events = events;
+      m->capacity = capacity;
+    }
+    read = fread(m->events + m->length, 1, m->capacity - m->length, f);
+    m->length += read;
+  } while (read > 0);
+  fclose(f);
+
+  // Check that the events are well formed and find where the movie ends.
+  uint64_t cycle = 0;
+  for (size_t i = 0;;) {
+    uint64_t cycles;
+    uint16_t keys;
+    size_t length = get_event(m->events + i, m->length - i, &cycles, &keys);
+    if (length == 0) {
+      fprintf(stderr, "Malformed chip8 movie: %s\n", filename);
+      movie_destroy(m);
+      return 1;
+    }
+    i += length;
+    cycle += cycles;
+    if (keys == 0) {
+      break;
+    }
+  }
+  m->end_cycle = cycle;
+  return 0;
+}
+
+int movie_play(const movie *m, chip8 *system) {
+  if (movie_rom_hash(system) != m->rom_hash) {
+    fprintf(stderr, "The ROM doesn't match the movie.\n");
+    return 1;
+  }
+  system->clock_speed = m->clock_speed;
+  system->libc_rand = m->libc_rand;
+  if (m->libc_rand) {
+    srand(m->seed);
+  } else {
+    chip8_seed(system, m->seed);
+  }
+
+  uint64_t cycle = system->cycle;
+  for (size_t i = 0; !system->trap;) {
+    uint64_t cycles;
+    uint16_t keys;
+    i += get_event(m->events + i, m->length - i, &cycles, &keys);
+    cycle += cycles;
+    run_cycles(system, cycle - system->cycle);
+    if (keys == 0 || system->trap) {
+      break;
+    }
+
+    // Apply the changes in the order they were recorded in. Each event holds
+    // the changes of a single set_key() call.
+    for (int k = 0; k < 16; ++k) {
+      if (keys & (1u << k)) {
+        set_key(system, k, !system->keys[k]);
+      }
+    }
+  }
+  return 0;
+}
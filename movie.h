@@ -0,0 +1,82 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+// A recording of the input to a chip8 session, from which the session can be
+// reproduced exactly: the same ROM, clock speed and random seed, and every key
+// change at the cycle it was applied.
+//
+// The file format is little endian:
+//
+//   char     magic[4]      "C8MV"
+//   uint8_t  version       2
+//   uint8_t  flags         bit 0: SET_RAND uses rand(), see chip8.libc_rand
+//   uint64_t rom_hash      see movie_rom_hash()
+//   uint32_t clock_speed
+//   uint32_t seed          see chip8_seed(), or srand() with rand()
+//
+// followed by events, each of them
+//
+//   varint   cycles        cycles since the previous event (or the start),
+//                          7 bits per byte, least significant first, with the
+//                          top bit set on all but the last byte
+//   uint16_t keys          the keys which changed, bit k for key k
+//
+// An event where no key changed marks the end of the movie. Version 1 movies
+// have no flags byte and always use rand().
+typedef struct movie {
+  uint64_t rom_hash;
+  uint32_t clock_speed;
+  uint32_t seed;
+  uint8_t libc_rand;
+
+  // The encoded events, without the end marker while recording.
+  uint8_t *events;
+  size_t length;
+  size_t capacity;
+
+  // While recording, the cycle of the last event and the keys held after it,
+  // bit k for key k.
+  uint64_t cycle;
+  uint16_t keys;
+
+  // The cycle the movie ends at. Set by movie_load().
+  uint64_t end_cycle;
+} movie;
+
+// Returns a hash of the program in |system|, which must have just been loaded
+// with load_program().
+uint64_t movie_rom_hash(const chip8 *system);
+
+// Starts recording a session of |system|, which must have just been loaded
+// with load_program() and seeded with |seed|, by chip8_seed() or by srand() if
+// |system->libc_rand| is set.
+void movie_init(movie *m, const chip8 *system, uint32_t seed);
+
+void movie_destroy(movie *m);
+
+// Records the keys of |system| if they have changed since the last call. Must
+// be called after every set_key() which changes a key. Returns a nonzero value
+// if out of memory, leaving the change unrecorded.
+int movie_record_keys(movie *m, const chip8 *system);
+
+// Writes the movie to |filename|, ending at |end_cycle|. Returns a nonzero
+// value on failure.
+int movie_save(const movie *m, const char *filename, uint64_t end_cycle);
+
+// Reads the movie in |filename| into |m|, which is set up as by movie_init().
+// Returns a nonzero value if it can't be read or is malformed.
+int movie_load(movie *m, const char *filename);
+
+// Replays |m| on |system|, which must have just been loaded with the ROM the
+// movie was recorded with, as fast as possible. Each key change is applied at
+// exactly the cycle it was recorded at, and the run stops at the end of the
+// movie or when |system| traps. Returns a nonzero value if the ROM doesn't
+// match.
+int movie_play(const movie *m, chip8 *system);
+
+#endif // MOVIE_H
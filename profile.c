@@ -0,0 +1,413 @@
+#include "profile.h"
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+profile_counters chip8_profile = {.frame_count = 1};
+
+// An open addressing hash table of the frames after the root, by parent and
+// entry. Holds the index of each frame plus 1, or 0 in empty slots.
+#define FRAME_TABLE_SIZE (2 * PROFILE_MAX_FRAMES)
+static uint16_t frame_table[FRAME_TABLE_SIZE];
+
+// Set by the SIGUSR1 handler, cleared by profile_poll().
+static volatile sig_atomic_t dump_requested;
+
+uint64_t profile_ticks() {
+#if defined(__x86_64__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+void profile_sample(opcode_t op, uint64_t ticks) {
+  int bucket = 0;
+  while (bucket < PROFILE_BUCKETS - 1 && ticks >> bucket != 0) {
+    ++bucket;
+  }
+  ++chip8_profile.samples[op];
+  chip8_profile.ticks[op] += ticks;
+  ++chip8_profile.histogram[op][bucket];
+}
+
+// Returns the frame for a call of |entry| from |parent|, adding it if it is
+// new. Returns -1 if there's no room for it.
+static int32_t child_frame(uint16_t parent, uint16_t entry) {
+  uint32_t slot = (parent * 4099u + entry) % FRAME_TABLE_SIZE;
+  for (; frame_table[slot] != 0; slot = (slot + 1) % FRAME_TABLE_SIZE) {
+    const profile_frame *f = &chip8_profile.frames[frame_table[slot] - 1];
+    if (f->parent == parent && f->entry == entry) {
+      return frame_table[slot] - 1;
+    }
+  }
+
+  if (chip8_profile.frame_count == PROFILE_MAX_FRAMES) {
+    return -1;
+  }
+  uint16_t index = chip8_profile.frame_count++;
+  profile_frame *f = &chip8_profile.frames[index];
+  f->parent = parent;
+  f->entry = entry;
+  frame_table[slot] = index + 1;
+  return index;
+}
+
+void profile_call_return(const chip8 *system, opcode_t op) {
+  if (op == CALL) {
+    int32_t frame = chip8_profile.overflow > 0
+                        ? -1
+                        : child_frame(chip8_profile.frame, system->pc);
+    if (frame < 0) {
+      ++chip8_profile.overflow;
+      return;
+    }
+    ++chip8_profile.frames[frame].calls;
+    chip8_profile.frame = frame;
+  } else if (chip8_profile.overflow > 0) {
+    --chip8_profile.overflow;
+  } else {
+    // Returning from the root, with an empty stack, traps. Stay there.
+    chip8_profile.frame = chip8_profile.frames[chip8_profile.frame].parent;
+  }
+}
+
+// Writes a disassembly of |next| in the usual CHIP-8 assembler syntax to
+// |buf|.
+static void disassemble(instruction next, char *buf, size_t size) {
+  uint8_t x = X(next);
+  uint8_t y = Y(next);
+  uint8_t nn = NN(next);
+  uint16_t nnn = NNN(next);
+  switch (next.opcode) {
+  case CLEAR_SCREEN:
+    snprintf(buf, size, "CLS");
+    break;
+  case RETURN:
+    snprintf(buf, size, "RET");
+    break;
+  case JUMP:
+    snprintf(buf, size, "JP 0x%03X", nnn);
+    break;
+  case CALL:
+    snprintf(buf, size, "CALL 0x%03X", nnn);
+    break;
+  case IF_X_EQ_NN:
+    snprintf(buf, size, "SE V%X, 0x%02X", x, nn);
+    break;
+  case IF_X_NEQ_NN:
+    snprintf(buf, size, "SNE V%X, 0x%02X", x, nn);
+    break;
+  case IF_X_EQ_Y:
+    snprintf(buf, size, "SE V%X, V%X", x, y);
+    break;
+  case SET_X_NN:
+    snprintf(buf, size, "LD V%X, 0x%02X", x, nn);
+    break;
+  case ADD_X_NN:
+    snprintf(buf, size, "ADD V%X, 0x%02X", x, nn);
+    break;
+  case SET_X_Y:
+    snprintf(buf, size, "LD V%X, V%X", x, y);
+    break;
+  case OR_X_Y:
+    snprintf(buf, size, "OR V%X, V%X", x, y);
+    break;
+  case AND_X_Y:
+    snprintf(buf, size, "AND V%X, V%X", x, y);
+    break;
+  case XOR_X_Y:
+    snprintf(buf, size, "XOR V%X, V%X", x, y);
+    break;
+  case ADD_X_Y:
+    snprintf(buf, size, "ADD V%X, V%X", x, y);
+    break;
+  case SUB_X_Y:
+    snprintf(buf, size, "SUB V%X, V%X", x, y);
+    break;
+  case SHIFT_X_RIGHT:
+    snprintf(buf, size, "SHR V%X, V%X", x, y);
+    break;
+  case SUB_X_Y_REV:
+    snprintf(buf, size, "SUBN V%X, V%X", x, y);
+    break;
+  case SHIFT_X_LEFT:
+    snprintf(buf, size, "SHL V%X, V%X", x, y);
+    break;
+  case IF_X_NEQ_Y:
+    snprintf(buf, size, "SNE V%X, V%X", x, y);
+    break;
+  case SET_I_NNN:
+    snprintf(buf, size, "LD I, 0x%03X", nnn);
+    break;
+  case JUMP_ADDR:
+    snprintf(buf, size, "JP V0, 0x%03X", nnn);
+    break;
+  case SET_RAND:
+    snprintf(buf, size, "RND V%X, 0x%02X", x, nn);
+    break;
+  case DRAW:
+    snprintf(buf, size, "DRW V%X, V%X, %u", x, y, N(next));
+    break;
+  case IF_KEY_EQ:
+    snprintf(buf, size, "SKP V%X", x);
+    break;
+  case IF_KEY_NEQ:
+    snprintf(buf, size, "SKNP V%X", x);
+    break;
+  case GET_DELAY:
+    snprintf(buf, size, "LD V%X, DT", x);
+    break;
+  case GET_KEY:
+    snprintf(buf, size, "LD V%X, K", x);
+    break;
+  case SET_DELAY:
+    snprintf(buf, size, "LD DT, V%X", x);
+    break;
+  case SET_SOUND:
+    snprintf(buf, size, "LD ST, V%X", x);
+    break;
+  case ADD_X_I:
+    snprintf(buf, size, "ADD I, V%X", x);
+    break;
+  case LOAD_CHAR:
+    snprintf(buf, size, "LD F, V%X", x);
+    break;
+  case BCD:
+    snprintf(buf, size, "LD B, V%X", x);
+    break;
+  case REG_DUMP:
+    snprintf(buf, size, "LD [I], V%X", x);
+    break;
+  case REG_LOAD:
+    snprintf(buf, size, "LD V%X, [I]", x);
+    break;
+  default:
+    snprintf(buf, size, "DW 0x%02X%02X", next.hi, next.lo);
+    break;
+  }
+}
+
+// Returns the upper bound, in ticks, of the bucket which holds the |fraction|
+// quantile of the samples of |op|.
+static uint64_t quantile(opcode_t op, double fraction) {
+  uint64_t target = chip8_profile.samples[op] * fraction;
+  uint64_t seen = 0;
+  for (int b = 0; b < PROFILE_BUCKETS; ++b) {
+    seen += chip8_profile.histogram[op][b];
+    if (seen > target) {
+      return b == 0 ? 0 : (1ull << b) - 1;
+    }
+  }
+  return UINT64_MAX;
+}
+
+// Prints the opcode counts, most executed first.
+static void dump_opcodes(FILE *f) {
+  // Sort the opcodes by how often they ran, most first.
+  opcode_t order[PROFILE_OPCODES];
+  uint64_t total = chip8_profile.skipped;
+  for (int op = 0; op < PROFILE_OPCODES; ++op) {
+    uint64_t count = chip8_profile.count[op];
+    int i = op;
+    while (i > 0 && chip8_profile.count[order[i - 1]] < count) {
+      order[i] = order[i - 1];
+      --i;
+    }
+    order[i] = op;
+    total += count;
+  }
+
+  fprintf(f, "%-14s %14s %7s %10s %10s %8s %8s\n", "opcode", "count", "%",
+          "samples", "mean", "p50", "p99");
+  for (int i = 0; i < PROFILE_OPCODES; ++i) {
+    opcode_t op = order[i];
+    uint64_t count = chip8_profile.count[op];
+    if (count == 0) {
+      break;
+    }
+    uint64_t samples = chip8_profile.samples[op];
+    fprintf(f, "%-14s %14llu %6.2f%% %10llu", opcode_name(op),
+            (unsigned long long)count, 100.0 * count / total,
+            (unsigned long long)samples);
+    if (samples > 0) {
+      fprintf(f, " %10.1f %8llu %8llu\n",
+              (double)chip8_profile.ticks[op] / samples,
+              (unsigned long long)quantile(op, 0.5),
+              (unsigned long long)quantile(op, 0.99));
+    } else {
+      fprintf(f, " %10s %8s %8s\n", "-", "-", "-");
+    }
+  }
+  fprintf(f, "%-14s %14llu %6.2f%%\n", "(skipped)",
+          (unsigned long long)chip8_profile.skipped,
+          total ? 100.0 * chip8_profile.skipped / total : 0);
+  fprintf(f, "Times are in %s; p50 and p99 are bucket upper bounds.\n",
+#if defined(__x86_64__)
+          "time stamp counter ticks"
+#else
+          "nanoseconds"
+#endif
+  );
+}
+
+// A call from the subroutine at |caller| to the one at |callee|, made |calls|
+// times. The root is at address 0.
+typedef struct call_edge {
+  uint16_t caller;
+  uint16_t callee;
+  uint64_t calls;
+} call_edge;
+
+static int by_address_count(const void *a, const void *b) {
+  uint64_t x = chip8_profile.address[*(const uint16_t *)a];
+  uint64_t y = chip8_profile.address[*(const uint16_t *)b];
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int by_caller_callee(const void *a, const void *b) {
+  const call_edge *x = a;
+  const call_edge *y = b;
+  if (x->caller != y->caller) {
+    return x->caller < y->caller ? -1 : 1;
+  }
+  return x->callee < y->callee ? -1 : x->callee > y->callee;
+}
+
+static int by_calls(const void *a, const void *b) {
+  uint64_t x = ((const call_edge *)a)->calls;
+  uint64_t y = ((const call_edge *)b)->calls;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Prints the executed addresses of |system|, hottest first, with their
+// instructions.
+static void dump_addresses(FILE *f, const chip8 *system) {
+  static uint16_t order[PROFILE_ADDRESSES];
+  uint32_t executed = 0;
+  uint64_t total = 0;
+  for (uint32_t a = 0; a < PROFILE_ADDRESSES; ++a) {
+    if (chip8_profile.address[a] != 0) {
+      order[executed++] = a;
+      total += chip8_profile.address[a];
+    }
+  }
+  qsort(order, executed, sizeof(order[0]), by_address_count);
+
+  fprintf(f, "\n%-6s %-5s %-18s %14s %7s\n", "addr", "code", "instruction",
+          "count", "%");
+  for (uint32_t i = 0; i < executed; ++i) {
+    uint16_t a = order[i];
+    uint8_t hi = system->memory[a];
+    uint8_t lo = a + 1 < PROFILE_ADDRESSES ? system->memory[a + 1] : 0;
+    instruction next = {decode_opcode(hi, lo), hi, lo};
+    char text[32];
+    disassemble(next, text, sizeof(text));
+    fprintf(f, "0x%03X  %02X%02X  %-18s %14llu %6.2f%%\n", a, hi, lo, text,
+            (unsigned long long)chip8_profile.address[a],
+            100.0 * chip8_profile.address[a] / total);
+  }
+}
+
+// Prints the calls between subroutines, most frequent first.
+static void dump_calls(FILE *f) {
+  static call_edge edges[PROFILE_MAX_FRAMES];
+  uint32_t count = 0;
+  for (uint32_t i = 1; i < chip8_profile.frame_count; ++i) {
+    const profile_frame *frame = &chip8_profile.frames[i];
+    edges[count].caller = chip8_profile.frames[frame->parent].entry;
+    edges[count].callee = frame->entry;
+    edges[count].calls = frame->calls;
+    ++count;
+  }
+
+  // The same call can be made from several stacks. Merge them.
+  qsort(edges, count, sizeof(edges[0]), by_caller_callee);
+  uint32_t merged = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    if (merged > 0 && edges[merged - 1].caller == edges[i].caller &&
+        edges[merged - 1].callee == edges[i].callee) {
+      edges[merged - 1].calls += edges[i].calls;
+    } else {
+      edges[merged++] = edges[i];
+    }
+  }
+  qsort(edges, merged, sizeof(edges[0]), by_calls);
+
+  fprintf(f, "\n%-6s    %-6s %14s\n", "caller", "callee", "calls");
+  for (uint32_t i = 0; i < merged; ++i) {
+    char caller[8];
+    if (edges[i].caller == 0) {
+      snprintf(caller, sizeof(caller), "main");
+    } else {
+      snprintf(caller, sizeof(caller), "0x%03X", edges[i].caller);
+    }
+    fprintf(f, "%-6s -> 0x%03X  %14llu\n", caller, edges[i].callee,
+            (unsigned long long)edges[i].calls);
+  }
+  if (chip8_profile.frame_count == PROFILE_MAX_FRAMES) {
+    fprintf(f, "(more than %d call stacks, deeper calls were merged into their "
+               "callers)\n",
+            PROFILE_MAX_FRAMES);
+  }
+}
+
+void profile_dump(FILE *f, const chip8 *system) {
+  dump_opcodes(f);
+  if (system != NULL) {
+    dump_addresses(f, system);
+    dump_calls(f);
+  }
+}
+
+// Writes the stack of |frame| in the folded format, root first.
+static void write_stack(FILE *f, uint16_t frame) {
+  if (frame == 0) {
+    fprintf(f, "main");
+    return;
+  }
+  write_stack(f, chip8_profile.frames[frame].parent);
+  fprintf(f, ";0x%03x", chip8_profile.frames[frame].entry);
+}
+
+void profile_write_folded(FILE *f) {
+  for (uint32_t i = 0; i < chip8_profile.frame_count; ++i) {
+    if (chip8_profile.frames[i].self == 0) {
+      continue;
+    }
+    write_stack(f, i);
+    fprintf(f, " %llu\n", (unsigned long long)chip8_profile.frames[i].self);
+  }
+}
+
+void profile_reset() {
+  memset(&chip8_profile, 0, sizeof(chip8_profile));
+  memset(frame_table, 0, sizeof(frame_table));
+  chip8_profile.frame_count = 1;
+}
+
+static void request_dump(int signal) { dump_requested = 1; }
+
+void profile_install() {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = request_dump;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &action, NULL);
+}
+
+void profile_poll(const chip8 *system) {
+  if (dump_requested) {
+    dump_requested = 0;
+    profile_dump(stderr, system);
+  }
+}
@@ -0,0 +1,154 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "chip8.h"
+
+// Instrumentation of the interpreter, compiled in with -DCHIP8_PROFILE (and
+// profile.c linked in). It counts how often each opcode and each address is
+// executed and how many instructions are skipped, samples the time each
+// opcode's handler takes, and follows CALL and RETURN to attribute every
+// instruction to a call stack. This shows where a real ROM mix spends its
+// time: which handlers are worth optimizing and which loops spin.
+//
+// Only the interpreters are instrumented: in a profiling build ENGINE_JIT runs
+// as ENGINE_THREADED, and lockstep.c isn't counted. The counters are shared by
+// all systems in the process and aren't synchronized, so they are only exact
+// with a single emulated system.
+
+// The number of opcodes, see opcode_t.
+#define PROFILE_OPCODES (REG_LOAD + 1)
+
+// The number of addresses, one per byte of chip8.memory.
+#define PROFILE_ADDRESSES 4096
+
+// One in this many executions of each opcode is timed. Must be a power of 2.
+#define PROFILE_SAMPLE_PERIOD 64
+
+// Timed samples are counted in buckets by the log2 of their length in ticks.
+#define PROFILE_BUCKETS 32
+
+// The most distinct call stacks which are told apart. Calls which would make
+// more are attributed to their caller.
+#define PROFILE_MAX_FRAMES 4096
+
+// A call stack, as a node of the tree of all call stacks seen. The root is the
+// stack of the program's entry point, with no calls on it.
+typedef struct profile_frame {
+  // The caller's frame, and the address which was called. The root has itself
+  // as its parent and an |entry| of 0.
+  uint16_t parent;
+  uint16_t entry;
+
+  // The number of times this stack was entered by a CALL, and the number of
+  // instructions executed with it as the current stack.
+  uint64_t calls;
+  uint64_t self;
+} profile_frame;
+
+typedef struct profile_counters {
+  // Executions of each opcode, and instructions skipped by the IF_*
+  // instructions, which are never executed.
+  uint64_t count[PROFILE_OPCODES];
+  uint64_t skipped;
+
+  // For each opcode, the number of timed executions, their total length and a
+  // histogram of their lengths, in ticks of profile_ticks(). Bucket b counts
+  // samples of [2^(b-1), 2^b) ticks, bucket 0 those of 0 ticks.
+  uint64_t samples[PROFILE_OPCODES];
+  uint64_t ticks[PROFILE_OPCODES];
+  uint64_t histogram[PROFILE_OPCODES][PROFILE_BUCKETS];
+
+  // Executions of the instruction at each address.
+  uint64_t address[PROFILE_ADDRESSES];
+
+  // The call stacks seen so far, |frames[0]| being the root, and the current
+  // one. Calls past PROFILE_MAX_FRAMES stacks stay in the caller's frame, and
+  // |overflow| counts how many of them are on the stack, so that their
+  // RETURNs don't leave it.
+  profile_frame frames[PROFILE_MAX_FRAMES];
+  uint32_t frame_count;
+  uint16_t frame;
+  uint32_t overflow;
+} profile_counters;
+
+extern profile_counters chip8_profile;
+
+// Returns a timestamp: the time stamp counter on x86-64, or the monotonic
+// clock in nanoseconds elsewhere.
+uint64_t profile_ticks();
+
+// Records a timed execution of |op| which took |ticks|.
+void profile_sample(opcode_t op, uint64_t ticks);
+
+// Moves to the call stack entered by the CALL or left by the RETURN which
+// |system| just performed.
+void profile_call_return(const chip8 *system, opcode_t op);
+
+// Counts an execution of |op| at |pc|. Returns the start time if this
+// execution is to be timed, 0 otherwise.
+static inline uint64_t profile_begin(uint16_t pc, opcode_t op) {
+  ++chip8_profile.address[pc % PROFILE_ADDRESSES];
+  ++chip8_profile.frames[chip8_profile.frame].self;
+  if ((++chip8_profile.count[op] & (PROFILE_SAMPLE_PERIOD - 1)) != 0) {
+    return 0;
+  }
+  return profile_ticks();
+}
+
+// Ends an execution of |op| by |system| which profile_begin() returned
+// |start| for.
+static inline void profile_end(const chip8 *system, opcode_t op,
+                               uint64_t start) {
+  if (start != 0) {
+    profile_sample(op, profile_ticks() - start);
+  }
+  if ((op == CALL || op == RETURN) && !system->trap) {
+    profile_call_return(system, op);
+  }
+}
+
+// Prints the counters to |f|: the opcodes, most executed first, and, if
+// |system| isn't NULL, the hottest addresses of its program disassembled and
+// the calls between subroutines.
+void profile_dump(FILE *f, const chip8 *system);
+
+// Writes the instructions executed by each call stack to |f| in the folded
+// format read by flame graph tools, one stack per line, e.g.
+//
+//   main;0x2a4;0x31c 1520
+//
+// for 1520 instructions executed in the subroutine at 0x31c, called by the one
+// at 0x2a4.
+void profile_write_folded(FILE *f);
+
+void profile_reset();
+
+// Makes the counters be dumped to stderr whenever the process receives
+// SIGUSR1, at the next profile_poll().
+void profile_install();
+
+// Dumps the counters and the program of |system| to stderr if SIGUSR1 was
+// received since the last call. Called by run_cycles().
+void profile_poll(const chip8 *system);
+
+#ifdef CHIP8_PROFILE
+// Performs |call|, the handler of |op| at the |pc| of |system|, counting and
+// sampling it.
+#define PROFILE_HANDLER(system, op, call)                                      \
+  do {                                                                         \
+    uint64_t profile_start = profile_begin((system)->pc, op);                  \
+    call;                                                                      \
+    profile_end(system, op, profile_start);                                    \
+  } while (0)
+#define PROFILE_SKIP() (++chip8_profile.skipped)
+#define PROFILE_POLL(system) profile_poll(system)
+#else
+#define PROFILE_HANDLER(system, op, call) call
+#define PROFILE_SKIP() ((void)0)
+#define PROFILE_POLL(system) ((void)0)
+#endif
+
+#endif // PROFILE_H
@@ -0,0 +1,226 @@
+#include "rewind.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// A frame is encoded as the XOR of its snapshot with the snapshot of its
+// keyframe (or with zeros for a keyframe), split into runs:
+//
+//   uint16_t zeros      the number of bytes which are unchanged
+//   uint16_t literals   the number of bytes which follow
+//   uint8_t  xor[literals]
+//
+// repeated until the runs cover CHIP8_SNAPSHOT_SIZE bytes.
+_Static_assert(CHIP8_SNAPSHOT_SIZE <= UINT16_MAX,
+               "run lengths must fit in 16 bits");
+
+// The most bytes a frame can take to encode. A run of literals only ends at 4
+// unchanged bytes, so every 4 byte header covers at least 5 bytes.
+#define MAX_ENCODED_SIZE (CHIP8_SNAPSHOT_SIZE + CHIP8_SNAPSHOT_SIZE / 5 * 4 + 8)
+
+// The base that keyframes are encoded against.
+static const uint8_t zeros[CHIP8_SNAPSHOT_SIZE];
+
+int rewind_init(rewind_buffer *r, size_t bytes, uint32_t frames,
+                uint32_t keyframe_interval) {
+  memset(r, 0, sizeof(*r));
+  r->capacity = bytes;
+  r->max_entries = frames;
+  r->keyframe_interval = keyframe_interval > 0 ? keyframe_interval : 1;
+
+  r->data = malloc(bytes);
+  r->entries = calloc(frames, sizeof(rewind_entry));
+  r->keyframe = malloc(CHIP8_SNAPSHOT_SIZE);
+  r->scratch = malloc(CHIP8_SNAPSHOT_SIZE + MAX_ENCODED_SIZE);
+  if (r->data == NULL || r->entries == NULL || r->keyframe == NULL ||
+      r->scratch == NULL) {
+    rewind_destroy(r);
+    return 1;
+  }
+  return 0;
+}
+
+void rewind_destroy(rewind_buffer *r) {
+  free(r->data);
+  free(r->entries);
+  free(r->keyframe);
+  free(r->scratch);
+  memset(r, 0, sizeof(*r));
+}
+
+// Returns the |index|th oldest entry.
+static rewind_entry *entry_at(rewind_buffer *r, uint32_t index) {
+  return &r->entries[(r->first + index) % r->max_entries];
+}
+
+// Copies |length| bytes of |src| into |data| at |offset|, wrapping around.
+static void ring_write(rewind_buffer *r, size_t offset, const uint8_t *src,
+                       size_t length) {
+  size_t before_end = r->capacity - offset;
+  if (length <= before_end) {
+    memcpy(r->data + offset, src, length);
+  } else {
+    memcpy(r->data + offset, src, before_end);
+    memcpy(r->data, src + before_end, length - before_end);
+  }
+}
+
+// Copies |length| bytes of |data| at |offset| into |dst|, wrapping around.
+static void ring_read(const rewind_buffer *r, size_t offset, uint8_t *dst,
+                      size_t length) {
+  size_t before_end = r->capacity - offset;
+  if (length <= before_end) {
+    memcpy(dst, r->data + offset, length);
+  } else {
+    memcpy(dst, r->data + offset, before_end);
+    memcpy(dst + before_end, r->data, length - before_end);
+  }
+}
+
+// Encodes |state| against |base| into |out|, see above. Returns the number of
+// bytes written.
+static size_t encode_frame(const uint8_t *base, const uint8_t *state,
+                           uint8_t *out) {
+  size_t size = CHIP8_SNAPSHOT_SIZE;
+  size_t length = 0;
+  size_t i = 0;
+  while (i < size) {
+    // Skip unchanged bytes, a word at a time where possible.
+    size_t start = i;
+    while (i + 8 <= size && memcmp(base + i, state + i, 8) == 0) {
+      i += 8;
+    }
+    while (i < size && base[i] == state[i]) {
+      ++i;
+    }
+    uint16_t zeros_run = i - start;
+
+    // Copy changed bytes until the next run of 4 unchanged ones.
+    uint8_t *header = out + length;
+    length += 4;
+    start = i;
+    while (i < size &&
+           (i + 4 > size || memcmp(base + i, state + i, 4) != 0)) {
+      out[length++] = base[i] ^ state[i];
+      ++i;
+    }
+    uint16_t literals = i - start;
+
+    memcpy(header, &zeros_run, sizeof(zeros_run));
+    memcpy(header + 2, &literals, sizeof(literals));
+  }
+  return length;
+}
+
+// XORs the frame encoded in |in| into |state|.
+static void apply_frame(const uint8_t *in, uint8_t *state) {
+  size_t i = 0;
+  while (i < CHIP8_SNAPSHOT_SIZE) {
+    uint16_t zeros_run;
+    uint16_t literals;
+    memcpy(&zeros_run, in, sizeof(zeros_run));
+    memcpy(&literals, in + 2, sizeof(literals));
+    in += 4;
+
+    i += zeros_run;
+    for (uint16_t j = 0; j < literals; ++j) {
+      state[i++] ^= *in++;
+    }
+  }
+}
+
+// Decodes the keyframe |e| into |state|.
+static void decode_keyframe(rewind_buffer *r, const rewind_entry *e,
+                            uint8_t *state) {
+  uint8_t *encoded = r->scratch + CHIP8_SNAPSHOT_SIZE;
+  ring_read(r, e->offset, encoded, e->length);
+  memset(state, 0, CHIP8_SNAPSHOT_SIZE);
+  apply_frame(encoded, state);
+}
+
+// Drops the oldest keyframe and the frames recorded after it.
+static void drop_oldest(rewind_buffer *r) {
+  do {
+    rewind_entry *e = entry_at(r, 0);
+    r->head = (r->head + e->length) % r->capacity;
+    r->used -= e->length;
+    r->first = (r->first + 1) % r->max_entries;
+    --r->count;
+  } while (r->count > 0 && !entry_at(r, 0)->keyframe);
+}
+
+void rewind_record(rewind_buffer *r, const chip8 *system) {
+  uint8_t *state = r->scratch;
+  uint8_t *encoded = r->scratch + CHIP8_SNAPSHOT_SIZE;
+  chip8_snapshot(system, state);
+
+  uint8_t keyframe =
+      r->count == 0 || r->since_keyframe + 1 >= r->keyframe_interval;
+  size_t length;
+  for (;;) {
+    length = encode_frame(keyframe ? zeros : r->keyframe, state, encoded);
+    if (length > r->capacity) {
+      // The frame can never fit.
+      return;
+    }
+
+    while (r->count > 0 &&
+           (r->capacity - r->used < length || r->count == r->max_entries)) {
+      drop_oldest(r);
+    }
+    if (r->count > 0 || keyframe) {
+      break;
+    }
+    // Making room dropped the keyframe this frame was encoded against.
+    keyframe = 1;
+  }
+
+  rewind_entry *e = entry_at(r, r->count);
+  e->offset = (r->head + r->used) % r->capacity;
+  e->length = length;
+  e->keyframe = keyframe;
+  ring_write(r, e->offset, encoded, length);
+  r->used += length;
+  ++r->count;
+
+  if (keyframe) {
+    memcpy(r->keyframe, state, CHIP8_SNAPSHOT_SIZE);
+    r->since_keyframe = 0;
+  } else {
+    ++r->since_keyframe;
+  }
+}
+
+int rewind_step_back(rewind_buffer *r, chip8 *system) {
+  if (r->count < 2) {
+    return 1;
+  }
+
+  rewind_entry *newest = entry_at(r, r->count - 1);
+  r->used -= newest->length;
+  --r->count;
+
+  if (newest->keyframe) {
+    // Go back to the previous keyframe. The oldest frame is always a keyframe,
+    // so there is one.
+    uint32_t index = r->count - 1;
+    while (!entry_at(r, index)->keyframe) {
+      --index;
+    }
+    decode_keyframe(r, entry_at(r, index), r->keyframe);
+    r->since_keyframe = r->count - 1 - index;
+  } else {
+    --r->since_keyframe;
+  }
+
+  newest = entry_at(r, r->count - 1);
+  uint8_t *state = r->scratch;
+  uint8_t *encoded = r->scratch + CHIP8_SNAPSHOT_SIZE;
+  memcpy(state, r->keyframe, CHIP8_SNAPSHOT_SIZE);
+  if (!newest->keyframe) {
+    ring_read(r, newest->offset, encoded, newest->length);
+    apply_frame(encoded, state);
+  }
+  chip8_restore(system, state);
+  return 0;
+}
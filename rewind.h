@@ -0,0 +1,75 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+// Where a recorded frame is stored in rewind_buffer.data.
+typedef struct rewind_entry {
+  size_t offset;
+  uint32_t length;
+
+  // Set for keyframes, which are stored on their own. Other frames are stored
+  // relative to the keyframe before them.
+  uint8_t keyframe;
+} rewind_entry;
+
+// Records the state of a chip8 system once a frame so that it can be rewound,
+// within a fixed memory budget.
+//
+// Every |keyframe_interval| frames a keyframe is recorded. Each frame in
+// between stores only the bytes of its snapshot (see chip8_snapshot()) which
+// differ from that keyframe: the snapshots are XORed and the runs of zeros are
+// skipped. Since most of memory doesn't change after load_program(), a frame
+// usually takes a few dozen bytes for the registers and the screen rows which
+// changed.
+//
+// When either the |capacity| bytes of |data| or the |max_entries| entries run
+// out, the oldest keyframe and the frames after it are dropped.
+typedef struct rewind_buffer {
+  // A ring buffer holding the encoded frames, oldest first. The used part is
+  // the |used| bytes from |head|, wrapping around at |capacity|.
+  uint8_t *data;
+  size_t capacity;
+  size_t head;
+  size_t used;
+
+  // A ring buffer of the |count| recorded frames, oldest first from |first|.
+  // The oldest frame is always a keyframe.
+  rewind_entry *entries;
+  uint32_t max_entries;
+  uint32_t first;
+  uint32_t count;
+
+  uint32_t keyframe_interval;
+
+  // The number of frames recorded after the newest keyframe.
+  uint32_t since_keyframe;
+
+  // The snapshot of the newest keyframe, which new frames are encoded
+  // against.
+  uint8_t *keyframe;
+
+  // Space to encode and decode a frame in.
+  uint8_t *scratch;
+} rewind_buffer;
+
+// Sets up |r| to hold up to |frames| frames in |bytes| bytes, recording a
+// keyframe every |keyframe_interval| frames. Returns a nonzero value if memory
+// can't be allocated.
+int rewind_init(rewind_buffer *r, size_t bytes, uint32_t frames,
+                uint32_t keyframe_interval);
+
+void rewind_destroy(rewind_buffer *r);
+
+// Records the current state of |system| as the newest frame.
+void rewind_record(rewind_buffer *r, const chip8 *system);
+
+// Drops the newest frame and restores |system| to the one recorded before it,
+// see chip8_restore(). Returns a nonzero value, leaving |system| alone, if
+// there is no earlier frame.
+int rewind_step_back(rewind_buffer *r, chip8 *system);
+
+#endif // REWIND_H
@@ -0,0 +1,64 @@
+#include "scheduler.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "chip8.h"
+
+uint64_t monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void scheduler_init(scheduler *s, uint32_t instructions_per_second) {
+  s->instructions_per_frame = instructions_per_second / FRAME_RATE;
+  if (s->instructions_per_frame == 0) {
+    s->instructions_per_frame = 1;
+  }
+  s->frame_ns = 1000000000 / FRAME_RATE;
+  s->deadline = monotonic_ns() + s->frame_ns;
+  s->frames = 0;
+  s->late_frames = 0;
+  s->total_drift_ns = 0;
+  s->max_drift_ns = 0;
+}
+
+void scheduler_wait(scheduler *s) {
+  ++s->frames;
+
+  uint64_t now = monotonic_ns();
+  if (now >= s->deadline) {
+    ++s->late_frames;
+  } else {
+    struct timespec ts;
+    ts.tv_sec = s->deadline / 1000000000;
+    ts.tv_nsec = s->deadline % 1000000000;
+    // Sleeping until an absolute time keeps errors from accumulating.
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+      ;
+    now = monotonic_ns();
+  }
+
+  uint64_t drift = now - s->deadline;
+  s->total_drift_ns += drift;
+  if (drift > s->max_drift_ns) {
+    s->max_drift_ns = drift;
+  }
+
+  if (drift > s->frame_ns) {
+    // Too far behind to catch up, start the schedule over.
+    s->deadline = now + s->frame_ns;
+  } else {
+    s->deadline += s->frame_ns;
+  }
+}
+
+void scheduler_report(const scheduler *s, FILE *f) {
+  double mean = s->frames ? (double)s->total_drift_ns / s->frames : 0;
+  fprintf(f,
+          "frames: %llu, late: %llu, drift mean: %.3f ms, max: %.3f ms\n",
+          (unsigned long long)s->frames, (unsigned long long)s->late_frames,
+          mean / 1e6, s->max_drift_ns / 1e6);
+}
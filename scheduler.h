@@ -0,0 +1,48 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Paces emulation against the wall clock. Each 1 / FRAME_RATE second frame the
+// host runs |instructions_per_frame| instructions, presents the screen, and
+// then calls scheduler_wait() to sleep until the frame's deadline.
+typedef struct scheduler {
+  // The number of instructions to run each frame.
+  uint32_t instructions_per_frame;
+
+  // The length of a frame in nanoseconds.
+  uint64_t frame_ns;
+
+  // The end of the current frame, on the monotonic clock.
+  uint64_t deadline;
+
+  // The number of frames waited for so far.
+  uint64_t frames;
+
+  // The number of frames whose work ran past the deadline, so there was no
+  // time left to sleep.
+  uint64_t late_frames;
+
+  // How far past its deadline each wakeup was, summed over all frames and the
+  // largest single value, in nanoseconds.
+  uint64_t total_drift_ns;
+  uint64_t max_drift_ns;
+} scheduler;
+
+// Returns the current time of the monotonic clock in nanoseconds.
+uint64_t monotonic_ns();
+
+// Sets up |s| to run |instructions_per_second| instructions per second, with
+// the first frame starting now.
+void scheduler_init(scheduler *s, uint32_t instructions_per_second);
+
+// Sleeps until the end of the current frame and starts the next one. If the
+// frame's work overran by more than a whole frame the schedule is reset
+// instead of trying to catch up.
+void scheduler_wait(scheduler *s);
+
+// Prints the frame count, late frames and drift of |s| to |f|.
+void scheduler_report(const scheduler *s, FILE *f);
+
+#endif // SCHEDULER_H
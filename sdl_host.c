@@ -0,0 +1,587 @@
+#include "sdl_host.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#include "chip8.h"
+#include "expand.h"
+#include "log.h"
+#include "movie.h"
+
+// Paints row |y| of the screen, drawing each horizontal run of set pixels as a
+// single rect.
+static void paint_row(const chip8 *system, int y, SDL_Surface *screen_surface,
+                      uint32_t black, uint32_t white) {
+  SDL_Rect rect;
+  rect.y = y * PIXEL_SIZE;
+  rect.x = 0;
+  rect.h = PIXEL_SIZE;
+  rect.w = SCREEN_WIDTH;
+  SDL_FillRect(screen_surface, &rect, black);
+
+  uint64_t pixels = system->screen[y];
+  int x = 0;
+  while (x < DISPLAY_WIDTH && (pixels << x) != 0) {
+    // Find the start of the next run of set pixels, then its length.
+    int start = x + __builtin_clzll(pixels << x);
+    uint64_t unset = ~(pixels << start);
+    int length = unset ? __builtin_clzll(unset) : DISPLAY_WIDTH - start;
+
+    rect.x = start * PIXEL_SIZE;
+    rect.w = length * PIXEL_SIZE;
+    SDL_FillRect(screen_surface, &rect, white);
+    x = start + length;
+  }
+}
+
+void draw_screen(const chip8 *system, SDL_Surface *screen_surface) {
+  uint32_t black = SDL_MapRGB(screen_surface->format, 0, 0, 0);
+  uint32_t white = SDL_MapRGB(screen_surface->format, 0xFF, 0xFF, 0xFF);
+  for (int y = 0; y < DISPLAY_HEIGHT; ++y) {
+    paint_row(system, y, screen_surface, black, white);
+  }
+}
+
+int draw_rows(const chip8 *system, uint32_t rows, SDL_Surface *screen_surface,
+              SDL_Rect *rects) {
+  uint32_t black = SDL_MapRGB(screen_surface->format, 0, 0, 0);
+  uint32_t white = SDL_MapRGB(screen_surface->format, 0xFF, 0xFF, 0xFF);
+
+  int count = 0;
+  int y = 0;
+  while (y < DISPLAY_HEIGHT && (rows >> y) != 0) {
+    // Find the next band of consecutive dirty rows.
+    int start = y + __builtin_ctz(rows >> y);
+    int end = start;
+    while (end < DISPLAY_HEIGHT && (rows >> end) & 1) {
+      paint_row(system, end, screen_surface, black, white);
+      ++end;
+    }
+
+    rects[count].x = 0;
+    rects[count].y = start * PIXEL_SIZE;
+    rects[count].w = SCREEN_WIDTH;
+    rects[count].h = (end - start) * PIXEL_SIZE;
+    ++count;
+    y = end;
+  }
+  return count;
+}
+
+void draw_texture(const chip8 *system, SDL_Renderer *renderer,
+                  SDL_Texture *texture) {
+  void *pixels;
+  int pitch;
+  if (SDL_LockTexture(texture, NULL, &pixels, &pitch) != 0) {
+    return;
+  }
+  expand_screen(system->screen, pixels, pitch / sizeof(uint32_t), 0xFFFFFFFF,
+                0xFF000000);
+  SDL_UnlockTexture(texture);
+
+  SDL_RenderCopy(renderer, texture, NULL, NULL);
+  SDL_RenderPresent(renderer);
+}
+
+uint8_t is_chip8_key(SDL_Keycode keycode) {
+  switch (keycode) {
+  case SDLK_1:
+  case SDLK_2:
+  case SDLK_3:
+  case SDLK_4:
+  case SDLK_q:
+  case SDLK_w:
+  case SDLK_e:
+  case SDLK_r:
+  case SDLK_a:
+  case SDLK_s:
+  case SDLK_d:
+  case SDLK_f:
+  case SDLK_z:
+  case SDLK_x:
+  case SDLK_c:
+  case SDLK_v:
+    return 1;
+  default:
+    return 0;
+  }
+  return 0;
+}
+
+uint8_t hex_keycode(SDL_Keycode keycode) {
+  switch (keycode) {
+  case SDLK_1:
+    return 0x01;
+  case SDLK_2:
+    return 0x02;
+  case SDLK_3:
+    return 0x03;
+  case SDLK_4:
+    return 0x0C;
+  case SDLK_q:
+    return 0x04;
+  case SDLK_w:
+    return 0x05;
+  case SDLK_e:
+    return 0x06;
+  case SDLK_r:
+    return 0x0D;
+  case SDLK_a:
+    return 0x07;
+  case SDLK_s:
+    return 0x08;
+  case SDLK_d:
+    return 0x09;
+  case SDLK_f:
+    return 0x0E;
+  case SDLK_z:
+    return 0x0A;
+  case SDLK_x:
+    return 0x00;
+  case SDLK_c:
+    return 0x0B;
+  case SDLK_v:
+    return 0x0F;
+  default:
+    LOG_WARN("Invalid hex keycode %d", keycode);
+    return 0;
+  }
+}
+
+// Translates |event| into |e|. Returns a nonzero value if it is an event the
+// host handles.
+static uint8_t translate_event(const SDL_Event *event, input_event *e) {
+  switch (event->type) {
+  case SDL_QUIT:
+    e->type = INPUT_QUIT;
+    return 1;
+  case SDL_KEYDOWN:
+  case SDL_KEYUP:
+    e->time = event->key.timestamp;
+    e->pressed = event->type == SDL_KEYDOWN;
+    if (event->key.keysym.sym == SDLK_BACKSPACE) {
+      e->type = INPUT_REWIND;
+      return 1;
+    }
+    if (event->key.repeat) {
+      return 0;
+    }
+    if (event->key.keysym.sym == SDLK_TAB) {
+      e->type = INPUT_TURBO;
+      return e->pressed;
+    }
+    if (is_chip8_key(event->key.keysym.sym)) {
+      e->type = INPUT_KEY;
+      e->key = hex_keycode(event->key.keysym.sym);
+      return 1;
+    }
+    return 0;
+  }
+  return 0;
+}
+
+// Adds |e| to |key_queue| if it is a key of the hex keypad, or updates |quit|,
+// |rewinding| and |turbo|.
+static void apply_event(sdl_host *h, const input_event *e) {
+  switch (e->type) {
+  case INPUT_QUIT:
+    h->quit = 1;
+    break;
+  case INPUT_REWIND:
+    h->rewinding = e->pressed;
+    break;
+  case INPUT_TURBO:
+    h->turbo = !h->turbo;
+    break;
+  case INPUT_KEY:
+    if (h->key_queue_length < KEY_QUEUE_SIZE) {
+      key_event *k = &h->key_queue[h->key_queue_length++];
+      k->time = e->time;
+      k->key = e->key;
+      k->pressed = e->pressed;
+    }
+    break;
+  }
+}
+
+static void queue_event(sdl_host *h, const SDL_Event *event) {
+  input_event e;
+  if (translate_event(event, &e)) {
+    apply_event(h, &e);
+  }
+}
+
+void sdl_host_poll(sdl_host *h) {
+  if (h->threaded) {
+    input_event e;
+    while (input_queue_pop(h->input, &e) == 0) {
+      apply_event(h, &e);
+    }
+  } else {
+    SDL_Event event;
+    while (SDL_PollEvent(&event) > 0) {
+      queue_event(h, &event);
+    }
+  }
+
+  h->previous_poll = h->last_poll;
+  h->last_poll = SDL_GetTicks();
+}
+
+void sdl_host_wait(sdl_host *h, int timeout) {
+  if (h->threaded) {
+    return;
+  }
+
+  SDL_Event event;
+  if (timeout > 0 && SDL_WaitEventTimeout(&event, timeout)) {
+    queue_event(h, &event);
+  }
+}
+
+void sdl_host_run(sdl_host *h, chip8 *system, uint64_t cycles) {
+  uint32_t window = h->last_poll - h->previous_poll;
+  uint64_t done = 0;
+  for (int i = 0; i < h->key_queue_length; ++i) {
+    const key_event *e = &h->key_queue[i];
+
+    // Map the time of the event onto the batch.
+    uint64_t at = 0;
+    if (window > 0 && e->time > h->previous_poll) {
+      at = (uint64_t)(e->time - h->previous_poll) * cycles / window;
+      if (at > cycles) {
+        at = cycles;
+      }
+    }
+    if (at > done) {
+      run_cycles(system, at - done);
+      done = at;
+    }
+    set_key(system, e->key, e->pressed);
+    if (h->movie != NULL && movie_record_keys(h->movie, system) != 0) {
+      LOG_ERROR("Out of memory recording the movie");
+    }
+  }
+  h->key_queue_length = 0;
+
+  run_cycles(system, cycles - done);
+}
+
+// Shows |status|, if not empty, in the window title after |title|.
+static void set_title(sdl_host *h, const char *status) {
+  if (status[0] == '\0') {
+    SDL_SetWindowTitle(h->window, h->title);
+    return;
+  }
+  char title[128];
+  snprintf(title, sizeof(title), "%s - %s", h->title, status);
+  SDL_SetWindowTitle(h->window, title);
+}
+
+// Wakes up sdl_host_present_loop() to pick up a new frame or status. Only one
+// wake-up is queued at a time, so that fast-forwarding doesn't flood SDL's
+// event queue.
+static void wake_presenter(sdl_host *h) {
+  if (atomic_exchange(&h->wake_pending, 1)) {
+    return;
+  }
+  SDL_Event event;
+  memset(&event, 0, sizeof(event));
+  event.type = h->wake_event;
+  if (SDL_PushEvent(&event) != 1) {
+    atomic_store(&h->wake_pending, 0);
+  }
+}
+
+void sdl_host_set_status(sdl_host *h, const char *status) {
+  if (status == NULL) {
+    status = "";
+  }
+  if (!h->threaded) {
+    set_title(h, status);
+    return;
+  }
+
+  // The window belongs to the other thread, which picks this up.
+  pthread_mutex_lock(&h->status_lock);
+  snprintf(h->status, sizeof(h->status), "%s", status);
+  h->status_changed = 1;
+  pthread_mutex_unlock(&h->status_lock);
+  wake_presenter(h);
+}
+
+// Draws the screen of |system|, repainting only |dirty_rows| once the whole
+// screen has been drawn.
+static void repaint(sdl_host *h, const chip8 *system) {
+  if (h->renderer_kind == RENDER_TEXTURE) {
+    // The whole texture is uploaded at once, so dirty rows don't matter.
+    draw_texture(system, h->renderer, h->texture);
+    return;
+  }
+
+  if (h->needs_full_redraw) {
+    draw_screen(system, h->screen_surface);
+    SDL_UpdateWindowSurface(h->window);
+    h->needs_full_redraw = 0;
+    return;
+  }
+
+  // Only repaint and update the rows which changed.
+  SDL_Rect rects[DISPLAY_HEIGHT / 2];
+  int count = draw_rows(system, system->dirty_rows, h->screen_surface, rects);
+  if (count > 0) {
+    SDL_UpdateWindowSurfaceRects(h->window, rects, count);
+  }
+}
+
+static void present(void *userdata, const chip8 *system) {
+  sdl_host *h = userdata;
+  if (!h->threaded) {
+    repaint(h, system);
+    return;
+  }
+
+  frame *f = triple_buffer_back(h->frames);
+  memcpy(f->screen, system->screen, sizeof(f->screen));
+  f->cycle = system->cycle;
+  triple_buffer_publish(h->frames);
+  wake_presenter(h);
+}
+
+// Counts a tick of sound for the audio callback. This is all the emulation
+// thread does for sound.
+static void beep(void *userdata) {
+  sdl_host *h = userdata;
+  tone_beep(&h->tone);
+}
+
+// The SDL audio callback, run on SDL's audio thread.
+static void fill_audio(void *userdata, Uint8 *stream, int len) {
+  sdl_host *h = userdata;
+  tone_fill(&h->tone, (int16_t *)stream, len / sizeof(int16_t));
+}
+
+// Gets the window surface used by RENDER_SURFACE.
+static int init_surface(sdl_host *h) {
+  h->screen_surface = SDL_GetWindowSurface(h->window);
+  if (h->screen_surface == NULL) {
+    fprintf(stderr, "could not create window surface: %s\n", SDL_GetError());
+    return 1;
+  }
+
+  SDL_FillRect(h->screen_surface, NULL,
+               SDL_MapRGB(h->screen_surface->format, 0xFF, 0xFF, 0xFF));
+  SDL_UpdateWindowSurface(h->window);
+  return 0;
+}
+
+// Creates the renderer and texture used by RENDER_TEXTURE.
+static int init_texture(sdl_host *h) {
+  h->renderer = SDL_CreateRenderer(h->window, -1, SDL_RENDERER_SOFTWARE);
+  if (h->renderer == NULL) {
+    fprintf(stderr, "could not create renderer: %s\n", SDL_GetError());
+    return 1;
+  }
+
+  h->texture = SDL_CreateTexture(h->renderer, SDL_PIXELFORMAT_ARGB8888,
+                                 SDL_TEXTUREACCESS_STREAMING, DISPLAY_WIDTH,
+                                 DISPLAY_HEIGHT);
+  if (h->texture == NULL) {
+    fprintf(stderr, "could not create texture: %s\n", SDL_GetError());
+    return 1;
+  }
+  return 0;
+}
+
+int sdl_host_init(sdl_host *h, const char *title,
+                  sdl_renderer renderer_kind) {
+  // Start SDL
+  SDL_Init(SDL_INIT_VIDEO);
+
+  h->window = SDL_CreateWindow(title, SDL_WINDOWPOS_UNDEFINED,
+                               SDL_WINDOWPOS_UNDEFINED, SCREEN_WIDTH,
+                               SCREEN_HEIGHT, SDL_WINDOW_SHOWN);
+  if (h->window == NULL) {
+    fprintf(stderr, "could not create window: %s\n", SDL_GetError());
+    return 1;
+  }
+
+  h->renderer_kind = renderer_kind;
+  h->renderer = NULL;
+  h->texture = NULL;
+  h->screen_surface = NULL;
+  if (renderer_kind == RENDER_TEXTURE) {
+    if (init_texture(h)) {
+      return 1;
+    }
+  } else if (init_surface(h)) {
+    return 1;
+  }
+
+  h->needs_full_redraw = 1;
+  h->key_queue_length = 0;
+  h->previous_poll = h->last_poll = SDL_GetTicks();
+  h->quit = 0;
+  h->rewinding = 0;
+  h->turbo = 0;
+  h->title = title;
+  h->movie = NULL;
+  h->threaded = 0;
+  h->input = NULL;
+  h->frames = NULL;
+  h->shown = NULL;
+  h->host.userdata = h;
+  h->host.present = present;
+  // Silent until sdl_host_init_audio().
+  h->audio = 0;
+  h->host.beep = NULL;
+  return 0;
+}
+
+int sdl_host_init_audio(sdl_host *h, uint16_t buffer_samples) {
+  if (SDL_InitSubSystem(SDL_INIT_AUDIO) != 0) {
+    fprintf(stderr, "could not start audio: %s\n", SDL_GetError());
+    return 1;
+  }
+
+  SDL_AudioSpec want;
+  memset(&want, 0, sizeof(want));
+  want.freq = AUDIO_SAMPLE_RATE;
+  want.format = AUDIO_S16SYS;
+  want.channels = 1;
+  want.samples = buffer_samples;
+  want.callback = fill_audio;
+  want.userdata = h;
+
+  SDL_AudioSpec have;
+  h->audio = SDL_OpenAudioDevice(NULL, 0, &want, &have,
+                                 SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+  if (h->audio == 0) {
+    fprintf(stderr, "could not open audio device: %s\n", SDL_GetError());
+    return 1;
+  }
+
+  // The device starts paused, so the callback doesn't run before this.
+  tone_init(&h->tone, have.freq, TONE_FREQUENCY, TONE_AMPLITUDE);
+  h->host.beep = beep;
+  SDL_PauseAudioDevice(h->audio, 0);
+  return 0;
+}
+
+int sdl_host_init_threaded(sdl_host *h) {
+  h->wake_event = SDL_RegisterEvents(1);
+  if (h->wake_event == (uint32_t)-1) {
+    return 1;
+  }
+  atomic_init(&h->wake_pending, 0);
+
+  h->input = malloc(sizeof(input_queue));
+  h->frames = malloc(sizeof(triple_buffer));
+  h->shown = malloc(sizeof(chip8));
+  if (h->input == NULL || h->frames == NULL || h->shown == NULL) {
+    free(h->input);
+    free(h->frames);
+    free(h->shown);
+    h->input = NULL;
+    h->frames = NULL;
+    h->shown = NULL;
+    return 1;
+  }
+
+  input_queue_init(h->input);
+  triple_buffer_init(h->frames);
+  *h->shown = initialize_chip8();
+  pthread_mutex_init(&h->status_lock, NULL);
+  h->status[0] = '\0';
+  h->status_changed = 0;
+  h->threaded = 1;
+  return 0;
+}
+
+// Shows the status set by the emulation thread, if it changed.
+static void update_title(sdl_host *h) {
+  char status[sizeof(h->status)];
+  uint8_t changed;
+  pthread_mutex_lock(&h->status_lock);
+  changed = h->status_changed;
+  memcpy(status, h->status, sizeof(status));
+  h->status_changed = 0;
+  pthread_mutex_unlock(&h->status_lock);
+
+  if (changed) {
+    set_title(h, status);
+  }
+}
+
+void sdl_host_present_loop(sdl_host *h) {
+  uint8_t quit = 0;
+  while (!quit) {
+    SDL_Event event;
+    if (SDL_WaitEventTimeout(&event, PRESENT_TIMEOUT_MS)) {
+      do {
+        if (event.type == h->wake_event) {
+          // Cleared before reading the frame, so that a frame published
+          // after this queues another wake-up.
+          atomic_store(&h->wake_pending, 0);
+          continue;
+        }
+        input_event e;
+        if (!translate_event(&event, &e)) {
+          continue;
+        }
+        // The emulation thread must see every event, or a key could be left
+        // held down, so wait for room. It drains the queue each frame.
+        while (input_queue_push(h->input, &e) != 0) {
+          SDL_Delay(1);
+        }
+        if (e.type == INPUT_QUIT) {
+          quit = 1;
+        }
+      } while (SDL_PollEvent(&event) > 0);
+    }
+
+    const frame *f = triple_buffer_read(h->frames);
+    if (f != NULL) {
+      // Repaint the rows which differ from the frame drawn last, which may be
+      // several frames back.
+      uint32_t rows = 0;
+      for (int y = 0; y < DISPLAY_HEIGHT; ++y) {
+        if (h->shown->screen[y] != f->screen[y]) {
+          rows |= 1u << y;
+        }
+      }
+      memcpy(h->shown->screen, f->screen, sizeof(f->screen));
+      h->shown->dirty_rows = rows;
+      repaint(h, h->shown);
+    }
+
+    update_title(h);
+  }
+}
+
+void sdl_host_destroy(sdl_host *h) {
+  if (h->audio != 0) {
+    SDL_CloseAudioDevice(h->audio);
+  }
+  if (h->threaded) {
+    pthread_mutex_destroy(&h->status_lock);
+  }
+  free(h->input);
+  free(h->frames);
+  free(h->shown);
+
+  if (h->texture != NULL) {
+    SDL_DestroyTexture(h->texture);
+  }
+  if (h->renderer != NULL) {
+    SDL_DestroyRenderer(h->renderer);
+  }
+
+  // Quit SDL
+  SDL_DestroyWindow(h->window);
+  SDL_Quit();
+}
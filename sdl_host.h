@@ -0,0 +1,206 @@
+#ifndef SDL_HOST_H
+#define SDL_HOST_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include <SDL2/SDL.h>
+
+#include "chip8.h"
+#include "input_queue.h"
+#include "tone.h"
+#include "triple_buffer.h"
+
+#define SCREEN_WIDTH 640
+#define SCREEN_HEIGHT 320
+
+// The size of a chip8 pixel in the window.
+#define PIXEL_SIZE (SCREEN_WIDTH / DISPLAY_WIDTH)
+
+// The number of key events which can be queued between two polls.
+#define KEY_QUEUE_SIZE 64
+
+// The sample rate asked for when opening the audio device, and the default
+// number of samples per audio buffer. Smaller buffers lower the latency of the
+// sound, at the risk of running dry.
+#define AUDIO_SAMPLE_RATE 44100
+#define AUDIO_BUFFER_SAMPLES 512
+
+// The pitch and volume of the sound.
+#define TONE_FREQUENCY 440
+#define TONE_AMPLITUDE 3000
+
+// The longest sdl_host_present_loop() sleeps without input or a new frame,
+// in milliseconds. The emulation thread wakes it up for every frame, so this
+// is just a backstop.
+#define PRESENT_TIMEOUT_MS (1000 / FRAME_RATE)
+
+// The ways in which the SDL host can draw the screen.
+typedef enum sdl_renderer {
+  // Fill rects on the window surface, repainting only the rows which changed.
+  RENDER_SURFACE = 0,
+  // Expand the screen into a streaming texture, see expand.h, and let the
+  // software renderer scale it to the window.
+  RENDER_TEXTURE,
+} sdl_renderer;
+
+// A change of a hex key, queued until the instructions running at the time it
+// happened are emulated.
+typedef struct key_event {
+  // When the event happened, in SDL_GetTicks() milliseconds.
+  uint32_t time;
+  uint8_t key;
+  uint8_t pressed;
+} key_event;
+
+// A chip8_host which displays the screen in an SDL window and reads input from
+// the keyboard.
+typedef struct sdl_host {
+  // The SDL window that the chip8 system is running in.
+  SDL_Window *window;
+
+  // The sdl_renderer used to draw the screen.
+  uint8_t renderer_kind;
+
+  // The screen surface used for drawing with RENDER_SURFACE.
+  SDL_Surface *screen_surface;
+
+  // The renderer and DISPLAY_WIDTH x DISPLAY_HEIGHT texture used for drawing
+  // with RENDER_TEXTURE.
+  SDL_Renderer *renderer;
+  SDL_Texture *texture;
+
+  // Set until the whole screen has been drawn once, after which only the rows
+  // that changed are repainted.
+  uint8_t needs_full_redraw;
+
+  // Key events collected by the last sdl_host_poll() which haven't been applied
+  // yet, oldest first.
+  key_event key_queue[KEY_QUEUE_SIZE];
+  int key_queue_length;
+
+  // The times of the previous and the last sdl_host_poll(). The queued events
+  // happened in between.
+  uint32_t previous_poll;
+  uint32_t last_poll;
+
+  // The audio device playing |tone|, or 0 without sound.
+  SDL_AudioDeviceID audio;
+  tone tone;
+
+  // Set once the window has been closed.
+  uint8_t quit;
+
+  // Set while the rewind key (Backspace) is held down.
+  uint8_t rewinding;
+
+  // Toggled by the fast-forward key (Tab).
+  uint8_t turbo;
+
+  // The title the window was opened with.
+  const char *title;
+
+  // The movie that key changes are recorded in, or NULL.
+  struct movie *movie;
+
+  // Set by sdl_host_init_threaded(). The emulation then runs on a thread of
+  // its own, which reads input from |input| and publishes frames to |frames|,
+  // while sdl_host_present_loop() handles SDL on the thread which opened the
+  // window.
+  uint8_t threaded;
+  input_queue *input;
+  triple_buffer *frames;
+
+  // The last frame drawn by sdl_host_present_loop(), as a system for the draw
+  // functions to read the screen from.
+  chip8 *shown;
+
+  // The window title status set by the emulation thread, see
+  // sdl_host_set_status(), and whether it changed since the window title was
+  // last updated.
+  pthread_mutex_t status_lock;
+  char status[64];
+  uint8_t status_changed;
+
+  // The SDL event type which wakes up sdl_host_present_loop(), and whether one
+  // is queued already.
+  uint32_t wake_event;
+  _Atomic uint8_t wake_pending;
+
+  // The callbacks to hand to the core, with |userdata| pointing back at this
+  // struct.
+  chip8_host host;
+} sdl_host;
+
+// Starts SDL and opens a window titled |title| which is drawn with
+// |renderer_kind|. Returns a nonzero value on failure.
+int sdl_host_init(sdl_host *h, const char *title, sdl_renderer renderer_kind);
+
+// Opens the audio device, with buffers of |buffer_samples| samples, and plays
+// a tone whenever the sound timer runs. Without it the host is silent. Returns
+// a nonzero value on failure.
+int sdl_host_init_audio(sdl_host *h, uint16_t buffer_samples);
+
+// Sets up |h| for running the emulation on another thread than the one which
+// called sdl_host_init(). sdl_host_poll(), sdl_host_wait(), sdl_host_run(),
+// sdl_host_set_status() and the host callbacks may then only be called on the
+// emulation thread, which never waits on SDL, and the thread which called
+// sdl_host_init() must call sdl_host_present_loop(). Returns a nonzero value
+// on failure.
+int sdl_host_init_threaded(sdl_host *h);
+
+// Handles SDL for a host set up by sdl_host_init_threaded() until the window
+// is closed: passes input events to the emulation thread through |input|, and
+// draws each frame published to |frames| (skipping any which are replaced
+// before it gets to them).
+void sdl_host_present_loop(sdl_host *h);
+
+// Closes the window and shuts down SDL.
+void sdl_host_destroy(sdl_host *h);
+
+// Moves all pending SDL events (or events from |input| if threaded) into
+// |key_queue|, setting |quit| if the window was closed and |rewinding| while
+// Backspace is held, and toggling |turbo| when Tab is pressed.
+void sdl_host_poll(sdl_host *h);
+
+// Sleeps until an event arrives or |timeout| milliseconds have passed, and
+// queues the event like sdl_host_poll(). Used instead of sleeping while the
+// system waits for a key, so that the press is picked up right away. Returns
+// right away if threaded: the caller sleeps until the frame's deadline, and
+// the press is picked up by the next sdl_host_poll().
+void sdl_host_wait(sdl_host *h, int timeout);
+
+// Runs |cycles| cycles of |system| in a single batch, applying the events
+// queued by the last sdl_host_poll() in between, and recording them in
+// |movie|. Each event takes effect at the
+// point of the batch matching when it happened between the last two polls, so
+// that a key tapped between polls is still seen as held for a while.
+void sdl_host_run(sdl_host *h, chip8 *system, uint64_t cycles);
+
+// Shows |status| in the window title after |title|, or just |title| if
+// |status| is NULL.
+void sdl_host_set_status(sdl_host *h, const char *status);
+
+// Draws the screen of |system| to |screen_surface|.
+void draw_screen(const chip8 *system, SDL_Surface *screen_surface);
+
+// Repaints the rows of |screen_surface| set in |rows| (bit y for row y). Each
+// band of consecutive rows that was repainted is stored in |rects|, which must
+// have room for DISPLAY_HEIGHT / 2 rects. Returns the number of rects stored.
+int draw_rows(const chip8 *system, uint32_t rows, SDL_Surface *screen_surface,
+              SDL_Rect *rects);
+
+// Expands the screen of |system| into |texture| and presents it, scaled to
+// fill the window.
+void draw_texture(const chip8 *system, SDL_Renderer *renderer,
+                  SDL_Texture *texture);
+
+// Returns a nonzero value if |keycode| represents a key on the chip8 hex
+// keypad.
+uint8_t is_chip8_key(SDL_Keycode keycode);
+
+// Returns the hex-key value which corresponds to |keycode|.
+uint8_t hex_keycode(SDL_Keycode keycode);
+
+#endif // SDL_HOST_H
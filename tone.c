@@ -0,0 +1,43 @@
+#include "tone.h"
+
+#include "chip8.h"
+
+void tone_init(tone *t, uint32_t sample_rate, uint32_t frequency,
+               int16_t amplitude) {
+  t->sample_rate = sample_rate;
+  t->frequency = frequency;
+  t->amplitude = amplitude;
+  atomic_init(&t->pending, 0);
+  t->samples_left = 0;
+  t->phase = 0;
+}
+
+void tone_beep(tone *t) {
+  atomic_fetch_add_explicit(&t->pending, 1, memory_order_relaxed);
+}
+
+void tone_fill(tone *t, int16_t *samples, int count) {
+  for (int i = 0; i < count; ++i) {
+    if (t->samples_left == 0) {
+      // Start on the next tick, if there is one.
+      uint32_t pending =
+          atomic_load_explicit(&t->pending, memory_order_relaxed);
+      if (pending == 0) {
+        samples[i] = 0;
+        continue;
+      }
+      uint32_t taken = pending > TONE_MAX_PENDING
+                           ? pending - TONE_MAX_PENDING + 1
+                           : 1;
+      atomic_fetch_sub_explicit(&t->pending, taken, memory_order_relaxed);
+      t->samples_left = t->sample_rate / FRAME_RATE;
+    }
+
+    samples[i] = t->phase < t->sample_rate / 2 ? t->amplitude : -t->amplitude;
+    t->phase += t->frequency;
+    if (t->phase >= t->sample_rate) {
+      t->phase -= t->sample_rate;
+    }
+    --t->samples_left;
+  }
+}
@@ -0,0 +1,46 @@
+#ifndef TONE_H
+#define TONE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// The most timer ticks of sound which can be waiting to be played. Ticks
+// beyond this, e.g. while fast-forwarding, are dropped so that the sound
+// doesn't fall behind.
+#define TONE_MAX_PENDING 6
+
+// Generates the square wave played while the sound timer runs. The emulation
+// thread only counts the ticks it heard with tone_beep(), and the audio thread
+// turns each of them into 1 / FRAME_RATE seconds of the tone with
+// tone_fill(), so that no I/O happens on the emulation thread.
+typedef struct tone {
+  uint32_t sample_rate;
+  uint32_t frequency;
+  int16_t amplitude;
+
+  // Ticks counted by tone_beep() which haven't started playing yet.
+  _Atomic uint32_t pending;
+
+  // The samples left of the tick being played.
+  uint32_t samples_left;
+
+  // The position in the period of the wave, counting up by |frequency| each
+  // sample and wrapping around at |sample_rate|. The wave is high in the
+  // first half of the period.
+  uint32_t phase;
+} tone;
+
+// Sets up |t| to generate a |frequency| Hz square wave of |amplitude| at
+// |sample_rate| samples per second.
+void tone_init(tone *t, uint32_t sample_rate, uint32_t frequency,
+               int16_t amplitude);
+
+// Adds a tick of sound. Called on the emulation thread for each timer tick
+// with the sound timer running, see chip8_host.beep.
+void tone_beep(tone *t);
+
+// Fills |samples| with the next |count| samples: the tone for as many ticks as
+// are pending, and silence after them. Called on the audio thread.
+void tone_fill(tone *t, int16_t *samples, int count);
+
+#endif // TONE_H
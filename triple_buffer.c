@@ -0,0 +1,31 @@
+#include "triple_buffer.h"
+
+#include <string.h>
+
+void triple_buffer_init(triple_buffer *b) {
+  memset(b->frames, 0, sizeof(b->frames));
+  b->back = 0;
+  atomic_init(&b->middle, 1);
+  b->front = 2;
+}
+
+frame *triple_buffer_back(triple_buffer *b) { return &b->frames[b->back]; }
+
+void triple_buffer_publish(triple_buffer *b) {
+  // Release the writes to the frame, and acquire the reader's last use of the
+  // frame taken back in exchange.
+  uint8_t old = atomic_exchange_explicit(
+      &b->middle, b->back | TRIPLE_BUFFER_FRESH, memory_order_acq_rel);
+  b->back = old & ~TRIPLE_BUFFER_FRESH;
+}
+
+const frame *triple_buffer_read(triple_buffer *b) {
+  if (!(atomic_load_explicit(&b->middle, memory_order_relaxed) &
+        TRIPLE_BUFFER_FRESH)) {
+    return NULL;
+  }
+  uint8_t old =
+      atomic_exchange_explicit(&b->middle, b->front, memory_order_acq_rel);
+  b->front = old & ~TRIPLE_BUFFER_FRESH;
+  return &b->frames[b->front];
+}
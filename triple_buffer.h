@@ -0,0 +1,55 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+// A finished frame, as handed from the emulation thread to the one presenting
+// it.
+typedef struct frame {
+  uint64_t screen[DISPLAY_HEIGHT];
+
+  // The cycle count when the frame was finished.
+  uint64_t cycle;
+} frame;
+
+// Passes frames from one writer thread to one reader thread without locks and
+// without either of them ever waiting for the other.
+//
+// Of the three frames, the writer owns |back| and the reader owns |front|.
+// The third is |middle|, the newest frame published. Publishing swaps |back|
+// with |middle|, and reading swaps |middle| with |front| if something was
+// published since the last read. So the writer never overwrites a frame that
+// is being read, and the reader always gets the newest frame, skipping any it
+// was too slow for.
+typedef struct triple_buffer {
+  frame frames[3];
+
+  // The index of the middle frame, with TRIPLE_BUFFER_FRESH set if it was
+  // published after the last read. On its own cache line, since both threads
+  // write it.
+  _Alignas(64) _Atomic uint8_t middle;
+
+  // The indices of the frames owned by the writer and the reader.
+  _Alignas(64) uint8_t back;
+  _Alignas(64) uint8_t front;
+} triple_buffer;
+
+#define TRIPLE_BUFFER_FRESH 0x4
+
+void triple_buffer_init(triple_buffer *b);
+
+// Returns the frame for the writer to fill in.
+frame *triple_buffer_back(triple_buffer *b);
+
+// Publishes the frame returned by triple_buffer_back(), which the writer must
+// not touch afterwards.
+void triple_buffer_publish(triple_buffer *b);
+
+// Returns the newest frame published, or NULL if none has been since the last
+// call. The frame stays valid until the next call.
+const frame *triple_buffer_read(triple_buffer *b);
+
+#endif // TRIPLE_BUFFER_H